@@ -0,0 +1,120 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+// Writing output on a thread of its own, so that the next event can be
+// made while the last one is written
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "parallel.h"
+
+// Runs the writes given to submit() in order on a background thread.
+// `nbuffers` events can be held at once: one being written and the
+// rest waiting, so the default of 2 is double buffering. Once they're
+// all taken, submit() waits for the writer, and how often and how long
+// it waits is recorded, to show whether the output is what limits the
+// program
+class AsyncWriter
+{
+public:
+    explicit AsyncWriter(size_t nbuffers=2)
+        : m_queue(nbuffers>1 ? nbuffers-1 : 1),
+          m_thread([this](){ run(); })
+    {}
+
+    ~AsyncWriter()
+    {
+        m_queue.close();
+        if(m_thread.joinable()) m_thread.join();
+    }
+
+    // Queue `write` to be run on the writer thread. It should own (eg
+    // by capturing a shared_ptr) everything it writes out. Rethrows
+    // the exception from any earlier write that failed
+    void submit(std::function<void()> write)
+    {
+        rethrow_error();
+        const auto start=std::chrono::steady_clock::now();
+        bool waited=false;
+        m_queue.push(std::move(write), &waited);
+        ++m_nsubmitted;
+        if(waited){
+            ++m_nwaited;
+            m_wait_seconds+=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        }
+    }
+
+    // Wait for all of the writes to be done. Rethrows the exception
+    // from the first one that failed, if any did, in which case none
+    // of the writes after it were run
+    void finish()
+    {
+        m_queue.close();
+        if(m_thread.joinable()) m_thread.join();
+        rethrow_error();
+    }
+
+    // How many writes there have been, how many of them had to wait
+    // for a buffer, and how long the waiting and the writing took
+    // Call after finish()
+    void print_stats(std::ostream& out) const
+    {
+        out << "Output: " << m_nsubmitted << " writes, " << m_nwaited << " of which waited for the writer for "
+            << m_wait_seconds << "s in all; the writer was busy for " << m_busy_seconds << "s" << std::endl;
+    }
+
+private:
+    void run()
+    {
+        std::function<void()> write;
+        while(m_queue.pop(write)){
+            // After a failed write, the ones queued behind it are
+            // dropped, so that the output doesn't have gaps in it
+            if(failed()){
+                write=nullptr;
+                continue;
+            }
+            const auto start=std::chrono::steady_clock::now();
+            try{
+                write();
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lock(m_error_mutex);
+                if(!m_error) m_error=std::current_exception();
+            }
+            m_busy_seconds+=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+            // Drop the data as soon as it's written
+            write=nullptr;
+        }
+    }
+
+    bool failed()
+    {
+        std::lock_guard<std::mutex> lock(m_error_mutex);
+        return bool(m_error);
+    }
+
+    void rethrow_error()
+    {
+        // The error is kept, so that the writes after it stay dropped
+        std::lock_guard<std::mutex> lock(m_error_mutex);
+        if(m_error) std::rethrow_exception(m_error);
+    }
+
+    BoundedQueue<std::function<void()> > m_queue;
+    std::exception_ptr m_error;
+    std::mutex m_error_mutex;
+    size_t m_nsubmitted=0;
+    size_t m_nwaited=0;
+    double m_wait_seconds=0;
+    // Only touched by the writer thread until it's been joined
+    double m_busy_seconds=0;
+    std::thread m_thread;
+};
+
+#endif // include guard
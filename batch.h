@@ -0,0 +1,273 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// Running one of the extractors over many input files in one go, so
+// that the program's startup is paid once rather than once per file,
+// with the files spread over several worker processes
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The input files named by `patterns` and by the file `listfile` (if
+// it isn't empty), which has one name per line, with blank lines and
+// lines starting with "#" ignored. Names containing any of "*?[" are
+// expanded as globs, in sorted order; others are used as they are, so
+// that eg xrootd URLs can be given. Throws if a glob matches nothing
+// or `listfile` can't be read
+inline std::vector<std::string> expand_inputs(std::vector<std::string> const& patterns, std::string const& listfile)
+{
+    std::vector<std::string> names(patterns);
+    if(listfile!=""){
+        std::ifstream fin(listfile);
+        if(!fin){
+            throw std::runtime_error("Unable to open input list "+listfile);
+        }
+        for(std::string line; std::getline(fin, line); ){
+            const size_t begin=line.find_first_not_of(" \t\r");
+            if(begin==std::string::npos || line[begin]=='#') continue;
+            const size_t end=line.find_last_not_of(" \t\r");
+            names.push_back(line.substr(begin, end+1-begin));
+        }
+    }
+
+    std::vector<std::string> ret;
+    for(std::string const& name: names){
+        if(name.find_first_of("*?[")==std::string::npos){
+            ret.push_back(name);
+            continue;
+        }
+        glob_t matches;
+        const int status=glob(name.c_str(), 0, nullptr, &matches);
+        if(status==0){
+            ret.insert(ret.end(), matches.gl_pathv, matches.gl_pathv+matches.gl_pathc);
+        }
+        globfree(&matches);
+        if(status!=0){
+            throw std::runtime_error("No input files match "+name);
+        }
+    }
+    return ret;
+}
+
+// The name of the input file `input` without its directory or its
+// extension, eg /data/np04_raw_run5387.root -> np04_raw_run5387
+inline std::string input_stem(std::string const& input)
+{
+    const size_t slash=input.find_last_of("/");
+    std::string ret=(slash==std::string::npos) ? input : input.substr(slash+1);
+    const size_t dotpos=ret.find_last_of(".");
+    if(dotpos!=std::string::npos && dotpos>0) ret=ret.substr(0, dotpos);
+    return ret;
+}
+
+// The output file name to use for input file `input` in a batch:
+// `outfile` with "_" and the stem of `input` inserted before the
+// extension (or at the end if there is no extension), eg wf.npy ->
+// wf_np04_raw_run5387.npy. The per-event names are then made from
+// this as usual. Empty names stay empty
+inline std::string batch_output_filename(std::string const& outfile, std::string const& input)
+{
+    if(outfile=="") return outfile;
+    size_t dotpos=outfile.find_last_of(".");
+    if(dotpos==std::string::npos){
+        dotpos=outfile.length();
+    }
+    return outfile.substr(0, dotpos)+"_"+input_stem(input)+outfile.substr(dotpos);
+}
+
+// Throws if two of `inputs` have the same stem, since their outputs
+// would overwrite each other
+inline void check_unique_stems(std::vector<std::string> const& inputs)
+{
+    std::set<std::string> seen;
+    for(std::string const& input: inputs){
+        if(!seen.insert(input_stem(input)).second){
+            throw std::runtime_error("More than one input file is named like "+input+", so their output files would have the same names");
+        }
+    }
+}
+
+// How the processing of one input file of a batch went
+struct BatchResult
+{
+    std::string input;
+    // Whether the file was processed without an error
+    bool ok=false;
+    // The number of events written
+    int64_t nevents=0;
+    double seconds=0;
+    // The size of the input file, or 0 if it isn't a local file
+    uint64_t bytes=0;
+};
+
+// Call `process` on each file in `inputs`, which returns the number of
+// events it wrote, and throws if anything goes wrong. With `njobs`
+// greater than 1, each file is processed in a child process forked
+// for it, with up to `njobs` of them running at once, and the next
+// file is started as soon as any of them finishes, so the files don't
+// need to be the same size to keep all of the jobs busy. A file that
+// fails doesn't stop the others. Must be called before any threads
+// are started, since only the calling thread survives a fork
+inline std::vector<BatchResult> run_batch(std::vector<std::string> const& inputs, unsigned int njobs,
+                                          std::function<int64_t(std::string const&)> const& process)
+{
+    using clock=std::chrono::steady_clock;
+    std::vector<BatchResult> results(inputs.size());
+    std::vector<clock::time_point> starts(inputs.size());
+    for(size_t i=0; i<inputs.size(); ++i){
+        results[i].input=inputs[i];
+        struct stat st;
+        if(stat(inputs[i].c_str(), &st)==0) results[i].bytes=st.st_size;
+    }
+    auto finish=[&](size_t i){
+        results[i].seconds=std::chrono::duration<double>(clock::now()-starts[i]).count();
+    };
+
+    if(njobs<=1){
+        for(size_t i=0; i<inputs.size(); ++i){
+            starts[i]=clock::now();
+            try{
+                results[i].nevents=process(inputs[i]);
+                results[i].ok=true;
+            }
+            catch(std::exception const& e){
+                std::cerr << inputs[i] << ": " << e.what() << std::endl;
+            }
+            finish(i);
+        }
+        return results;
+    }
+
+    // The children report their number of events down a pipe each,
+    // which is only read once the child has exited: a single int64_t
+    // always fits in the pipe's buffer, so the child never blocks
+    struct Child { size_t input; int fd; };
+    std::map<pid_t, Child> running;
+    size_t next=0;
+    while(next<inputs.size() || !running.empty()){
+        while(next<inputs.size() && running.size()<njobs){
+            int fds[2];
+            if(pipe(fds)!=0){
+                throw std::runtime_error("Unable to create a pipe for a batch job");
+            }
+            // Anything still buffered would be written by the child too
+            std::cout.flush();
+            std::cerr.flush();
+            fflush(nullptr);
+            starts[next]=clock::now();
+            const pid_t pid=fork();
+            if(pid<0){
+                throw std::runtime_error("Unable to fork a batch job");
+            }
+            if(pid==0){
+                close(fds[0]);
+                int status=1;
+                try{
+                    const int64_t nevents=process(inputs[next]);
+                    if(write(fds[1], &nevents, sizeof(nevents))==sizeof(nevents)) status=0;
+                }
+                catch(std::exception const& e){
+                    std::cerr << inputs[next] << ": " << e.what() << std::endl;
+                }
+                std::cout.flush();
+                std::cerr.flush();
+                fflush(nullptr);
+                // _exit() rather than exit(), so that the child doesn't
+                // run the parent's atexit handlers and static destructors
+                _exit(status);
+            }
+            close(fds[1]);
+            running[pid]=Child{next, fds[0]};
+            ++next;
+        }
+
+        int status;
+        const pid_t pid=wait(&status);
+        if(pid<0){
+            throw std::runtime_error("Lost track of the batch jobs");
+        }
+        auto it=running.find(pid);
+        if(it==running.end()) continue;
+        const size_t i=it->second.input;
+        finish(i);
+        int64_t nevents;
+        if(WIFEXITED(status) && WEXITSTATUS(status)==0 &&
+           read(it->second.fd, &nevents, sizeof(nevents))==sizeof(nevents)){
+            results[i].ok=true;
+            results[i].nevents=nevents;
+        }
+        else if(WIFSIGNALED(status)){
+            std::cerr << inputs[i] << ": killed by signal " << WTERMSIG(status) << std::endl;
+        }
+        close(it->second.fd);
+        running.erase(it);
+    }
+    return results;
+}
+
+// Print a table of `results` to `out`: for each file, whether it
+// succeeded, the number of events, the time taken, and the rates in
+// events and megabytes of input per second, then the totals. The
+// total rates are over `wall_seconds`, the time the whole batch took
+inline void print_batch_summary(std::ostream& out, std::vector<BatchResult> const& results, double wall_seconds)
+{
+    auto rate=[](double amount, double seconds){ return seconds>0 ? amount/seconds : 0.0; };
+    out << std::left << std::setw(40) << "# input" << std::right
+        << std::setw(8) << "status" << std::setw(10) << "events" << std::setw(10) << "seconds"
+        << std::setw(10) << "events/s" << std::setw(10) << "MB/s" << std::endl;
+    int64_t nevents=0;
+    uint64_t bytes=0;
+    size_t nfailed=0;
+    out << std::fixed << std::setprecision(2);
+    for(BatchResult const& r: results){
+        out << std::left << std::setw(40) << r.input << std::right
+            << std::setw(8) << (r.ok ? "ok" : "FAILED") << std::setw(10) << r.nevents << std::setw(10) << r.seconds
+            << std::setw(10) << rate(r.nevents, r.seconds) << std::setw(10) << rate(r.bytes/1e6, r.seconds) << std::endl;
+        nevents+=r.nevents;
+        bytes+=r.bytes;
+        if(!r.ok) ++nfailed;
+    }
+    out << std::left << std::setw(40) << "# total" << std::right
+        << std::setw(8) << (nfailed ? std::to_string(nfailed)+" bad" : std::string("ok")) << std::setw(10) << nevents << std::setw(10) << wall_seconds
+        << std::setw(10) << rate(nevents, wall_seconds) << std::setw(10) << rate(bytes/1e6, wall_seconds) << std::endl;
+    out << std::defaultfloat;
+}
+
+// Report on a batch that took `wall_seconds`: the summary table is
+// printed if there was more than one file, and written to
+// `summary_file` too if it isn't empty. Returns the exit status for
+// the program: 0 if every file succeeded, 1 otherwise
+inline int report_batch(std::vector<BatchResult> const& results, double wall_seconds, std::string const& summary_file)
+{
+    if(results.size()>1) print_batch_summary(std::cout, results, wall_seconds);
+    if(summary_file!=""){
+        std::ofstream fout(summary_file);
+        print_batch_summary(fout, results, wall_seconds);
+        if(!fout){
+            std::cerr << "Unable to write batch summary to " << summary_file << std::endl;
+            return 1;
+        }
+    }
+    for(BatchResult const& r: results){
+        if(!r.ok) return 1;
+    }
+    return 0;
+}
+
+#endif // include guard
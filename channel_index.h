@@ -0,0 +1,78 @@
+#ifndef CHANNEL_INDEX_H
+#define CHANNEL_INDEX_H
+
+// A small file written next to each event's numpy output that says
+// which row holds each channel, sorted by channel number, so that a
+// reader can fetch just the channels it wants without first reading
+// the channel number from every row. It is itself a numpy file: an
+// int32 array with one row per channel of (channel number, row)
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "cnpy.h"
+#include "geometry.h"
+
+struct ChannelIndexEntry
+{
+    int channel;
+    int row;
+};
+
+static_assert(sizeof(ChannelIndexEntry)==2*sizeof(int), "ChannelIndexEntry must have no padding");
+
+// Name of the channel index for the numpy file `datafile`: "_chidx"
+// inserted before the extension, eg wf_evt100.npy -> wf_evt100_chidx.npy
+inline std::string channel_index_filename(std::string const& datafile)
+{
+    size_t dotpos=datafile.find_last_of(".");
+    if(dotpos==std::string::npos){
+        dotpos=datafile.length();
+    }
+    return datafile.substr(0, dotpos)+"_chidx"+datafile.substr(dotpos);
+}
+
+// The index for rows with channel numbers `channels`, sorted by
+// channel number, and then by row for channels that appear more than once
+inline std::vector<ChannelIndexEntry> make_channel_index(std::vector<int> const& channels)
+{
+    std::vector<ChannelIndexEntry> ret(channels.size());
+    for(size_t i=0; i<channels.size(); ++i){
+        ret[i]=ChannelIndexEntry{channels[i], (int)i};
+    }
+    std::sort(ret.begin(), ret.end(), [](ChannelIndexEntry const& a, ChannelIndexEntry const& b){
+        return a.channel<b.channel || (a.channel==b.channel && a.row<b.row);
+    });
+    return ret;
+}
+
+inline void save_channel_index(std::string const& filename, std::vector<ChannelIndexEntry> const& index)
+{
+    if(index.empty()) return;
+    cnpy::npy_save(filename, reinterpret_cast<const int*>(index.data()), {index.size(), 2});
+}
+
+// Read the index in `filename`. Throws if it isn't a channel index
+inline std::vector<ChannelIndexEntry> load_channel_index(std::string const& filename)
+{
+    cnpy::NpyArray arr=cnpy::npy_load(filename);
+    if(arr.shape.size()!=2 || arr.shape[1]!=2 || arr.word_size!=sizeof(int)){
+        throw std::runtime_error(filename+" is not a channel index");
+    }
+    const ChannelIndexEntry* begin=reinterpret_cast<const ChannelIndexEntry*>(arr.data<int>());
+    return std::vector<ChannelIndexEntry>(begin, begin+arr.shape[0]);
+}
+
+// The entries of `index` (which is sorted by channel) for the channels
+// in `mask`, in channel order
+inline std::vector<ChannelIndexEntry> select_channels(std::vector<ChannelIndexEntry> const& index, ChannelMask const& mask)
+{
+    std::vector<ChannelIndexEntry> ret;
+    for(auto const& e: index){
+        if(mask.contains(e.channel)) ret.push_back(e);
+    }
+    return ret;
+}
+
+#endif // include guard
@@ -6,10 +6,14 @@
 #include<complex>
 #include<cstdlib>
 #include<algorithm>
+#include<cerrno>
 #include<cstring>
 #include<iomanip>
 #include<stdint.h>
 
+#include"mapped_file.h"
+#include"parallel.h"
+
 char cnpy::BigEndianTest() {
     int x = 1;
     return (((char *)&x)[0]) ? '<' : '>';
@@ -99,6 +103,61 @@ void cnpy::parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector
     word_size = atoi(str_ws.substr(0,loc2).c_str());
 }
 
+cnpy::NpyInfo cnpy::parse_npy_info(const char* buffer, size_t buffer_size) {
+    if(buffer_size < 10 || (unsigned char)buffer[0] != 0x93 || std::string(buffer+1,5) != "NUMPY")
+        throw std::runtime_error("parse_npy_info: not an npy header");
+
+    //version 1 has a 2-byte header length; versions 2 and 3 have 4 bytes
+    uint8_t major_version = buffer[6];
+    size_t len_size = (major_version == 1) ? 2 : 4;
+    size_t preamble = 8 + len_size;
+    if(buffer_size < preamble)
+        throw std::runtime_error("parse_npy_info: truncated header");
+    //the buffer may not be aligned, eg if it's part of a mapped npz file, so copy the length out
+    uint16_t len16 = 0;
+    uint32_t len32 = 0;
+    if(len_size == 2) memcpy(&len16, buffer+8, sizeof(len16));
+    else memcpy(&len32, buffer+8, sizeof(len32));
+    size_t header_len = (len_size == 2) ? len16 : len32;
+    if(buffer_size < preamble + header_len)
+        throw std::runtime_error("parse_npy_info: truncated header");
+    std::string header(buffer+preamble, header_len);
+
+    NpyInfo info;
+    info.header_size = preamble + header_len;
+
+    size_t loc1 = header.find("fortran_order");
+    if(loc1 == std::string::npos)
+        throw std::runtime_error("parse_npy_info: failed to find header keyword: 'fortran_order'");
+    info.fortran_order = (header.substr(loc1+16,4) == "True");
+
+    loc1 = header.find("(");
+    size_t loc2 = header.find(")");
+    if(loc1 == std::string::npos || loc2 == std::string::npos)
+        throw std::runtime_error("parse_npy_info: failed to find header keyword: '(' or ')'");
+    std::string str_shape = header.substr(loc1+1,loc2-loc1-1);
+    std::istringstream shape_stream(str_shape);
+    std::string dim;
+    while(std::getline(shape_stream, dim, ',')) {
+        if(dim.find_first_not_of(' ') == std::string::npos) continue;
+        info.shape.push_back(std::stoull(dim));
+    }
+
+    loc1 = header.find("descr");
+    if(loc1 == std::string::npos)
+        throw std::runtime_error("parse_npy_info: failed to find header keyword: 'descr'");
+    loc1 = header.find("'", loc1+6);
+    if(loc1 == std::string::npos || loc1+3 >= header.size())
+        throw std::runtime_error("parse_npy_info: malformed 'descr'");
+    char byte_order = header[loc1+1];
+    if(byte_order != '<' && byte_order != '|' && !(byte_order == '=' && BigEndianTest() == '<'))
+        throw std::runtime_error("parse_npy_info: only little-endian data is supported");
+    info.type = header[loc1+2];
+    info.word_size = atoi(header.c_str()+loc1+3);
+
+    return info;
+}
+
 void cnpy::parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {  
     char buffer[256];
     size_t res = fread(buffer,sizeof(char),11,fp);       
@@ -187,158 +246,564 @@ cnpy::NpyArray load_the_npy_file(FILE* fp) {
     return arr;
 }
 
-cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncompr_bytes) {
-
-    std::vector<unsigned char> buffer_compr(compr_bytes);
-    std::vector<unsigned char> buffer_uncompr(uncompr_bytes);
-    size_t nread = fread(&buffer_compr[0],1,compr_bytes,fp);
-    if(nread != compr_bytes)
-        throw std::runtime_error("load_the_npy_file: failed fread");
-
-    int err;
-    z_stream d_stream;
+cnpy::npz_t cnpy::npz_load(std::string fname) {
+    return NpzFile(fname).load_all(default_nthreads(0));
+}
 
-    d_stream.zalloc = Z_NULL;
-    d_stream.zfree = Z_NULL;
-    d_stream.opaque = Z_NULL;
-    d_stream.avail_in = 0;
-    d_stream.next_in = Z_NULL;
-    err = inflateInit2(&d_stream, -MAX_WBITS);
+cnpy::NpyArray cnpy::npz_load(std::string fname, std::string varname) {
+    //look the member up in the central directory, rather than walking the local headers to find it
+    std::unique_ptr<NpzFile> npz;
+    try {
+        npz.reset(new NpzFile(fname));
+    }
+    catch(std::runtime_error& e) {
+        printf("npz_load: Error! %s\n",e.what());
+        abort();
+    }
 
-    d_stream.avail_in = compr_bytes;
-    d_stream.next_in = &buffer_compr[0];
-    d_stream.avail_out = uncompr_bytes;
-    d_stream.next_out = &buffer_uncompr[0];
+    if(!npz->contains(varname)) {
+        printf("npz_load: Error! Variable name %s not found in %s!\n",varname.c_str(),fname.c_str());
+        abort();
+    }
+    return npz->load(varname);
+}
 
-    err = inflate(&d_stream, Z_FINISH);
-    err = inflateEnd(&d_stream);
+cnpy::NpyArray cnpy::npy_load(std::string fname) {
 
-    std::vector<size_t> shape;
-    size_t word_size;
-    bool fortran_order;
-    cnpy::parse_npy_header(&buffer_uncompr[0],word_size,shape,fortran_order);
+    FILE* fp = fopen(fname.c_str(), "rb");
 
-    cnpy::NpyArray array(shape, word_size, fortran_order);
+    if(!fp) {
+        printf("npy_load: Error! Unable to open file %s!\n",fname.c_str());
+        abort();  
+    }
 
-    size_t offset = uncompr_bytes - array.num_bytes();
-    memcpy(array.data<unsigned char>(),&buffer_uncompr[0]+offset,array.num_bytes());
+    NpyArray arr = load_the_npy_file(fp);
 
-    return array;
+    fclose(fp);
+    return arr;
 }
 
-cnpy::npz_t cnpy::npz_load(std::string fname) {
-    FILE* fp = fopen(fname.c_str(),"rb");
+namespace {
+    //id of the zip extra field in which npz_save_members records the compressed size of each piece of a member
+    const uint16_t npz_pieces_extra_id = 0x6370;
 
-    if(!fp) {
-        throw std::runtime_error("npz_load: Error! Unable to open file "+fname+"!");
+    template<typename T> T read_le(const char* p) {
+        T val;
+        memcpy(&val, p, sizeof(T));
+        return val;
     }
 
-    cnpy::npz_t arrays;  
-
-    while(1) {
-        std::vector<char> local_header(30);
-        size_t headerres = fread(&local_header[0],sizeof(char),30,fp);
-        if(headerres != 30)
-            throw std::runtime_error("npz_load: failed fread");
-
-        //if we've reached the global header, stop reading
-        if(local_header[2] != 0x03 || local_header[3] != 0x04) break;
-
-        //read in the variable name
-        uint16_t name_len = *(uint16_t*) &local_header[26];
-        std::string varname(name_len,' ');
-        size_t vname_res = fread(&varname[0],sizeof(char),name_len,fp);
-        if(vname_res != name_len)
-            throw std::runtime_error("npz_load: failed fread");
-
-        //erase the lagging .npy        
-        varname.erase(varname.end()-4,varname.end());
-
-        //read in the extra field
-        uint16_t extra_field_len = *(uint16_t*) &local_header[28];
-        if(extra_field_len > 0) {
-            std::vector<char> buff(extra_field_len);
-            size_t efield_res = fread(&buff[0],sizeof(char),extra_field_len,fp);
-            if(efield_res != extra_field_len)
-                throw std::runtime_error("npz_load: failed fread");
+    //a z_stream for inflating a raw deflate stream (as in a zip file) that is cleaned up when it goes out of scope
+    struct Inflater {
+        z_stream stream;
+
+        Inflater(const char* src, size_t nsrc) {
+            stream.zalloc = Z_NULL;
+            stream.zfree = Z_NULL;
+            stream.opaque = Z_NULL;
+            stream.next_in = (Bytef*)src;
+            stream.avail_in = nsrc;
+            if(inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+                throw std::runtime_error("npz_load: inflateInit2 failed");
         }
 
-        uint16_t compr_method = *reinterpret_cast<uint16_t*>(&local_header[0]+8);
-        uint32_t compr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0]+18);
-        uint32_t uncompr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0]+22);
+        ~Inflater() {
+            inflateEnd(&stream);
+        }
 
-        if(compr_method == 0) {arrays[varname] = load_the_npy_file(fp);}
-        else {arrays[varname] = load_the_npz_array(fp,compr_bytes,uncompr_bytes);}
-    }
+        //inflate exactly n bytes into dst
+        void read(char* dst, size_t n) {
+            stream.next_out = (Bytef*)dst;
+            stream.avail_out = n;
+            while(stream.avail_out > 0) {
+                int err = inflate(&stream, Z_NO_FLUSH);
+                if(err == Z_STREAM_END && stream.avail_out > 0)
+                    throw std::runtime_error("npz_load: compressed member is shorter than its header says");
+                if(err != Z_OK && err != Z_STREAM_END)
+                    throw std::runtime_error("npz_load: inflate failed");
+            }
+        }
 
-    fclose(fp);
-    return arrays;  
+        //inflate the npy header at the start of the stream into buffer, and parse it
+        cnpy::NpyInfo read_header(std::vector<char>& buffer) {
+            //enough for the preamble of any version of the header
+            buffer.resize(12);
+            read(&buffer[0], buffer.size());
+            size_t len_size = (buffer[6] == 1) ? 2 : 4;
+            size_t header_len = (len_size == 2) ? read_le<uint16_t>(&buffer[8]) : read_le<uint32_t>(&buffer[8]);
+            size_t header_size = 8 + len_size + header_len;
+            if(header_size > buffer.size()) {
+                buffer.resize(header_size);
+                read(&buffer[12], header_size - 12);
+            }
+            return cnpy::parse_npy_info(&buffer[0], buffer.size());
+        }
+    };
 }
 
-cnpy::NpyArray cnpy::npz_load(std::string fname, std::string varname) {
-    FILE* fp = fopen(fname.c_str(),"rb");
+void cnpy::fwrite_or_throw(const void* data, size_t nbytes, FILE* fp, const std::string& fname) {
+    if(fwrite(data,sizeof(char),nbytes,fp) != nbytes)
+        throw std::runtime_error("Failed to write to "+fname+": "+strerror(errno));
+}
 
-    if(!fp) {
-        printf("npz_load: Error! Unable to open file %s!\n",fname.c_str());
-        abort();
-    }       
-
-    while(1) {
-        std::vector<char> local_header(30);
-        size_t header_res = fread(&local_header[0],sizeof(char),30,fp);
-        if(header_res != 30)
-            throw std::runtime_error("npz_load: failed fread");
-
-        //if we've reached the global header, stop reading
-        if(local_header[2] != 0x03 || local_header[3] != 0x04) break;
-
-        //read in the variable name
-        uint16_t name_len = *(uint16_t*) &local_header[26];
-        std::string vname(name_len,' ');
-        size_t vname_res = fread(&vname[0],sizeof(char),name_len,fp);      
-        if(vname_res != name_len)
-            throw std::runtime_error("npz_load: failed fread");
-        vname.erase(vname.end()-4,vname.end()); //erase the lagging .npy
-
-        //read in the extra field
-        uint16_t extra_field_len = *(uint16_t*) &local_header[28];
-        fseek(fp,extra_field_len,SEEK_CUR); //skip past the extra field
-        
-        uint16_t compr_method = *reinterpret_cast<uint16_t*>(&local_header[0]+8);
-        uint32_t compr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0]+18);
-        uint32_t uncompr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0]+22);
-
-        if(vname == varname) {
-            NpyArray array  = (compr_method == 0) ? load_the_npy_file(fp) : load_the_npz_array(fp,compr_bytes,uncompr_bytes);
-            fclose(fp);
-            return array;
+void cnpy::fclose_or_throw(FILE* fp, const std::string& fname) {
+    //fclose frees fp even if it fails
+    if(fclose(fp) != 0)
+        throw std::runtime_error("Failed to write to "+fname+": "+strerror(errno));
+}
+
+cnpy::NpzFile::NpzFile(std::string fname)
+    : m_fname(fname), m_file(std::make_shared<MappedFile>(fname))
+{
+    const char* data = m_file->data();
+    const size_t size = m_file->size();
+
+    //the end-of-central-directory record is the last thing in the file, apart from a comment of up to 64k
+    const size_t eocd_size = 22;
+    const char* eocd = NULL;
+    if(size >= eocd_size) {
+        //no further back than the longest comment allows
+        const char* first = size - eocd_size > 0xffff ? data + size - eocd_size - 0xffff : data;
+        for(const char* p = data + size - eocd_size; ; p--) {
+            if(read_le<uint32_t>(p) == 0x06054b50) {
+                eocd = p;
+                break;
+            }
+            if(p == first) break;
         }
-        else {
-            //skip past the data
-            size_t size = *(uint32_t*) &local_header[22];
-            fseek(fp,size,SEEK_CUR);
+    }
+    if(!eocd) throw std::runtime_error("NpzFile: "+fname+" is not a zip file");
+
+    uint16_t nrecs = read_le<uint16_t>(eocd+10);
+    size_t cd_size = read_le<uint32_t>(eocd+12);
+    size_t cd_offset = read_le<uint32_t>(eocd+16);
+    if(nrecs == 0xffff || cd_offset == 0xffffffff)
+        throw std::runtime_error("NpzFile: "+fname+" uses zip64 extensions, which aren't supported");
+    if(cd_offset + cd_size > size)
+        throw std::runtime_error("NpzFile: central directory of "+fname+" is past the end of the file");
+
+    const char* p = data + cd_offset;
+    const char* cd_end = p + cd_size;
+    for(uint16_t i = 0; i < nrecs; i++) {
+        const size_t entry_size = 46;
+        if(p + entry_size > cd_end || read_le<uint32_t>(p) != 0x02014b50)
+            throw std::runtime_error("NpzFile: bad central directory entry in "+fname);
+        uint16_t name_len = read_le<uint16_t>(p+28);
+        uint16_t extra_len = read_le<uint16_t>(p+30);
+        uint16_t comment_len = read_le<uint16_t>(p+32);
+        if(p + entry_size + name_len > cd_end)
+            throw std::runtime_error("NpzFile: bad central directory entry in "+fname);
+
+        Member m;
+        m.name = std::string(p+entry_size, name_len);
+        //erase the lagging .npy
+        if(m.name.size() >= 4 && m.name.compare(m.name.size()-4, 4, ".npy") == 0) m.name.erase(m.name.size()-4);
+        m.compr_method = read_le<uint16_t>(p+10);
+        m.crc = read_le<uint32_t>(p+16);
+        m.compr_bytes = read_le<uint32_t>(p+20);
+        m.uncompr_bytes = read_le<uint32_t>(p+24);
+        m.local_header_offset = read_le<uint32_t>(p+42);
+        m.piece_bytes = 0;
+        if(p + entry_size + name_len + extra_len > cd_end)
+            throw std::runtime_error("NpzFile: bad central directory entry in "+fname);
+        //look for the sizes of the pieces in the extra fields
+        for(const char* extra = p + entry_size + name_len; extra + 4 <= p + entry_size + name_len + extra_len; ) {
+            uint16_t id = read_le<uint16_t>(extra);
+            uint16_t len = read_le<uint16_t>(extra+2);
+            const char* field = extra + 4;
+            extra = field + len;
+            if(id != npz_pieces_extra_id || len < 8 || len % 4 != 0 || extra > p + entry_size + name_len + extra_len) continue;
+            m.piece_bytes = read_le<uint32_t>(field);
+            size_t total = 0;
+            for(const char* q = field + 4; q < extra; q += 4) {
+                m.piece_compr_bytes.push_back(read_le<uint32_t>(q));
+                total += m.piece_compr_bytes.back();
+            }
+            //don't trust sizes that don't add up
+            if(total != m.compr_bytes || m.piece_bytes == 0) {
+                m.piece_compr_bytes.clear();
+                m.piece_bytes = 0;
+            }
         }
+        if(m.compr_method != 0 && m.compr_method != 8)
+            throw std::runtime_error("NpzFile: "+m.name+" in "+fname+" uses an unsupported compression method");
+
+        m_index.emplace(m.name, m_members.size());
+        m_members.push_back(m);
+        p += entry_size + name_len + extra_len + comment_len;
     }
+}
 
-    fclose(fp);
-    printf("npz_load: Error! Variable name %s not found in %s!\n",varname.c_str(),fname.c_str());
-    abort();
+const cnpy::NpzFile::Member& cnpy::NpzFile::member(const std::string& name) const {
+    auto it = m_index.find(name);
+    if(it == m_index.end())
+        throw std::runtime_error("NpzFile: no array called "+name+" in "+m_fname);
+    return m_members[it->second];
 }
 
-cnpy::NpyArray cnpy::npy_load(std::string fname) {
+const char* cnpy::NpzFile::member_data(const Member& m) const {
+    //the local header has its own name and extra field lengths, which needn't match the ones in the central directory
+    const size_t local_header_size = 30;
+    const char* local_header = m_file->data() + m.local_header_offset;
+    if(m.local_header_offset + local_header_size > m_file->size() || read_le<uint32_t>(local_header) != 0x04034b50)
+        throw std::runtime_error("NpzFile: bad local header for "+m.name+" in "+m_fname);
+    size_t offset = m.local_header_offset + local_header_size + read_le<uint16_t>(local_header+26) + read_le<uint16_t>(local_header+28);
+    if(offset + m.compr_bytes > m_file->size())
+        throw std::runtime_error("NpzFile: "+m.name+" runs past the end of "+m_fname);
+    return m_file->data() + offset;
+}
 
-    FILE* fp = fopen(fname.c_str(), "rb");
+cnpy::NpyInfo cnpy::NpzFile::info(const std::string& name) const {
+    const Member& m = member(name);
+    const char* src = member_data(m);
+    if(m.compr_method == 0) return parse_npy_info(src, m.compr_bytes);
 
-    if(!fp) {
-        printf("npy_load: Error! Unable to open file %s!\n",fname.c_str());
-        abort();  
+    std::vector<char> header;
+    Inflater inflater(src, m.compr_bytes);
+    return inflater.read_header(header);
+}
+
+cnpy::NpyArray cnpy::NpzFile::prepare_load(const Member& m, std::vector<std::function<void()>>& tasks) const {
+    const char* src = member_data(m);
+    //stored members and the pieces of compressed ones are split into jobs of about this many bytes
+    const size_t job_bytes = 1 << 20;
+
+    if(m.compr_method == 0) {
+        NpyInfo info = parse_npy_info(src, m.compr_bytes);
+        NpyArray arr(info.shape, info.word_size, info.fortran_order);
+        if(info.header_size + arr.num_bytes() > m.compr_bytes)
+            throw std::runtime_error("NpzFile: "+m.name+" in "+m_fname+" is shorter than its header says");
+        //copying out of the mapping is what reads the file, so do it in pieces to keep several reads going at once
+        char* dst = arr.num_bytes() > 0 ? arr.data<char>() : NULL;
+        for(size_t offset = 0; offset < arr.num_bytes(); offset += job_bytes) {
+            size_t n = std::min(job_bytes, arr.num_bytes() - offset);
+            tasks.push_back([=]() { memcpy(dst + offset, src + info.header_size + offset, n); });
+        }
+        return arr;
     }
 
-    NpyArray arr = load_the_npy_file(fp);
+    //inflate the header on its own to find out how big the array is
+    std::vector<char> header;
+    NpyInfo info = Inflater(src, m.compr_bytes).read_header(header);
+    NpyArray arr(info.shape, info.word_size, info.fortran_order);
+    const size_t nbytes = arr.num_bytes();
+    char* dst = nbytes > 0 ? arr.data<char>() : NULL;
+
+    //each piece after the header was deflated on its own, so they can all be inflated at once, each straight into its place in the array
+    size_t npieces = m.piece_compr_bytes.size();
+    if(npieces > 0 && npieces - 1 == (nbytes + m.piece_bytes - 1) / m.piece_bytes) {
+        const char* piece_src = src + m.piece_compr_bytes[0];
+        for(size_t i = 1; i < npieces; i++) {
+            size_t offset = (i-1) * m.piece_bytes;
+            size_t n = std::min(m.piece_bytes, nbytes - offset);
+            size_t ncompr = m.piece_compr_bytes[i];
+            tasks.push_back([=]() { Inflater(piece_src, ncompr).read(dst + offset, n); });
+            piece_src += ncompr;
+        }
+        return arr;
+    }
 
-    fclose(fp);
+    //otherwise the member is one deflate stream, which has to be inflated from start to finish in one go
+    size_t ncompr = m.compr_bytes;
+    tasks.push_back([=]() {
+        std::vector<char> header;
+        Inflater inflater(src, ncompr);
+        inflater.read_header(header);
+        inflater.read(dst, nbytes);
+    });
     return arr;
 }
 
+cnpy::NpyArray cnpy::NpzFile::load(const std::string& name, unsigned int nthreads) const {
+    std::vector<std::function<void()>> tasks;
+    NpyArray arr = prepare_load(member(name), tasks);
+    ThreadPool pool(std::min<size_t>(std::max(nthreads, 1u), tasks.size()));
+    pool.parallel_for(tasks.size(), [&](size_t i, unsigned int) { tasks[i](); });
+    return arr;
+}
+
+cnpy::npz_t cnpy::NpzFile::load_all(unsigned int nthreads) const {
+    npz_t arrays;
+    std::vector<std::function<void()>> tasks;
+    for(const Member& m : m_members) {
+        arrays[m.name] = prepare_load(m, tasks);
+    }
+    ThreadPool pool(std::min<size_t>(std::max(nthreads, 1u), tasks.size()));
+    pool.parallel_for(tasks.size(), [&](size_t i, unsigned int) { tasks[i](); });
+    return arrays;
+}
+
+void cnpy::NpzFile::read_data(const std::string& name, size_t offset, size_t nbytes, char* dst) const {
+    const Member& m = member(name);
+    const char* src = member_data(m);
+    if(nbytes == 0) return;
+
+    if(m.compr_method == 0) {
+        NpyInfo info = parse_npy_info(src, m.compr_bytes);
+        if(info.header_size + offset + nbytes > m.compr_bytes)
+            throw std::runtime_error("NpzFile: read past the end of "+name+" in "+m_fname);
+        memcpy(dst, src + info.header_size + offset, nbytes);
+        return;
+    }
+
+    std::vector<char> scratch;
+    if(m.piece_compr_bytes.empty()) {
+        //one deflate stream, so everything before the range has to be inflated to get to it
+        Inflater inflater(src, m.compr_bytes);
+        inflater.read_header(scratch);
+        scratch.resize(std::min<size_t>(offset, 1 << 20));
+        for(size_t skipped = 0; skipped < offset; skipped += scratch.size()) {
+            inflater.read(&scratch[0], std::min(scratch.size(), offset - skipped));
+        }
+        inflater.read(dst, nbytes);
+        return;
+    }
+
+    //the first piece is the header, and piece i after that holds bytes [(i-1)*piece_bytes, i*piece_bytes) of the data
+    if(offset + nbytes > (m.piece_compr_bytes.size() - 1) * m.piece_bytes)
+        throw std::runtime_error("NpzFile: read past the end of "+name+" in "+m_fname);
+    const char* piece_src = src + m.piece_compr_bytes[0];
+    for(size_t i = 1; i < m.piece_compr_bytes.size(); i++) {
+        size_t begin = (i-1) * m.piece_bytes;
+        size_t end = begin + m.piece_bytes;
+        size_t ncompr = m.piece_compr_bytes[i];
+        if(end > offset && begin < offset + nbytes) {
+            //inflate whole pieces straight into dst, and pieces that are only partly wanted into scratch
+            if(begin >= offset && end <= offset + nbytes) {
+                Inflater(piece_src, ncompr).read(dst + (begin - offset), m.piece_bytes);
+            }
+            else {
+                size_t copy_begin = std::max(begin, offset);
+                size_t copy_end = std::min(end, offset + nbytes);
+                scratch.resize(copy_end - begin);
+                Inflater(piece_src, ncompr).read(&scratch[0], scratch.size());
+                memcpy(dst + (copy_begin - offset), &scratch[copy_begin - begin], copy_end - copy_begin);
+            }
+        }
+        piece_src += ncompr;
+    }
+}
+
+cnpy::MappedNpyArray cnpy::NpzFile::map(const std::string& name) const {
+    const Member& m = member(name);
+    if(m.compr_method != 0)
+        throw std::runtime_error("NpzFile: "+name+" in "+m_fname+" is compressed, so it can't be mapped");
+    const char* src = member_data(m);
+    NpyInfo info = parse_npy_info(src, m.compr_bytes);
+    if(info.header_size + info.num_vals()*info.word_size > m.compr_bytes)
+        throw std::runtime_error("NpzFile: "+name+" in "+m_fname+" is shorter than its header says");
+    return MappedNpyArray{info, src + info.header_size, m_file};
+}
 
+namespace {
+    //size of the pieces that large members are split into for compression
+    const size_t npz_piece_bytes = 1 << 20;
+
+    //a piece of a member that is compressed on its own. each piece is compressed with a fresh deflate stream that ends on a byte boundary
+    //(or with the final block, for the last piece of a member), so the compressed pieces of a member concatenate into one valid deflate stream
+    struct NpzPiece {
+        const char* data;
+        size_t nbytes;
+        bool last;
+        uint32_t crc;
+        std::vector<char> compressed;
+    };
+
+    void deflate_piece(NpzPiece& piece, int level) {
+        z_stream stream;
+        stream.zalloc = Z_NULL;
+        stream.zfree = Z_NULL;
+        stream.opaque = Z_NULL;
+        if(deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("npz_save: deflateInit2 failed");
+
+        //deflateBound doesn't count the few bytes of the sync flush marker, so leave some room for that
+        piece.compressed.resize(deflateBound(&stream, piece.nbytes) + 16);
+        stream.next_in = (Bytef*)piece.data;
+        stream.avail_in = piece.nbytes;
+        stream.next_out = (Bytef*)&piece.compressed[0];
+        stream.avail_out = piece.compressed.size();
+
+        int flush = piece.last ? Z_FINISH : Z_SYNC_FLUSH;
+        while(true) {
+            int err = deflate(&stream, flush);
+            if(err == Z_STREAM_END) break;
+            if(err != Z_OK && err != Z_BUF_ERROR) {
+                deflateEnd(&stream);
+                throw std::runtime_error("npz_save: deflate failed");
+            }
+            //done once all the input is consumed and the flush has fit in the output
+            if(!piece.last && stream.avail_in == 0 && stream.avail_out > 0) break;
+            //otherwise we ran out of output space
+            size_t used = piece.compressed.size() - stream.avail_out;
+            piece.compressed.resize(2*piece.compressed.size());
+            stream.next_out = (Bytef*)&piece.compressed[used];
+            stream.avail_out = piece.compressed.size() - used;
+        }
+        piece.compressed.resize(piece.compressed.size() - stream.avail_out);
+        deflateEnd(&stream);
+    }
+}
+
+namespace {
+    //write members as a zip file through `write`, after `nrecs` existing records whose global header is `global_header`
+    //and begins at `global_header_offset`, ie where the new members start
+    void npz_write_members(const std::function<void(const char*, size_t)>& write, const std::vector<cnpy::NpzMember>& members,
+                           int compression_level, unsigned int nthreads,
+                           uint16_t nrecs, size_t global_header_offset, std::vector<char> global_header)
+    {
+        using namespace cnpy;
+        //split each member into pieces: the npy header, then the data in chunks of npz_piece_bytes
+        std::vector<NpzPiece> pieces;
+        std::vector<size_t> first_piece; //index of each member's first piece in pieces
+        for(const NpzMember& member : members) {
+            first_piece.push_back(pieces.size());
+            pieces.push_back(NpzPiece{&member.npy_header[0], member.npy_header.size(), member.nbytes == 0, 0, {}});
+            for(size_t offset = 0; offset < member.nbytes; offset += npz_piece_bytes) {
+                size_t n = std::min(npz_piece_bytes, member.nbytes - offset);
+                pieces.push_back(NpzPiece{member.data + offset, n, offset + n == member.nbytes, 0, {}});
+            }
+        }
+        first_piece.push_back(pieces.size());
+
+        //get the CRC of each piece, and compress it if asked to
+        ThreadPool pool(std::min<size_t>(std::max(nthreads, 1u), pieces.size()));
+        pool.parallel_for(pieces.size(), [&](size_t i, unsigned int) {
+            NpzPiece& piece = pieces[i];
+            piece.crc = crc32(0L, (const Bytef*)piece.data, piece.nbytes);
+            if(compression_level > 0) deflate_piece(piece, compression_level);
+        });
+
+        for(size_t imember = 0; imember < members.size(); imember++) {
+            std::string fname = members[imember].name + ".npy";
+            size_t nbytes = members[imember].npy_header.size() + members[imember].nbytes;
+
+            //combine the pieces' CRCs into the CRC of the whole member
+            uint32_t crc = 0;
+            size_t compressed_bytes = 0;
+            for(size_t i = first_piece[imember]; i < first_piece[imember+1]; i++) {
+                crc = (i == first_piece[imember]) ? pieces[i].crc : crc32_combine(crc, pieces[i].crc, pieces[i].nbytes);
+                compressed_bytes += compression_level > 0 ? pieces[i].compressed.size() : pieces[i].nbytes;
+            }
+            if(nbytes > 0xffffffff || global_header_offset > 0xffffffff)
+                throw std::runtime_error("npz_save: "+fname+" is too large for a zip file without zip64 extensions");
+
+            //build the local header
+            std::vector<char> local_header;
+            local_header += "PK"; //first part of sig
+            local_header += (uint16_t) 0x0403; //second part of sig
+            local_header += (uint16_t) 20; //min version to extract
+            local_header += (uint16_t) 0; //general purpose bit flag
+            local_header += (uint16_t) (compression_level > 0 ? 8 : 0); //compression method: deflate or stored
+            local_header += (uint16_t) 0; //file last mod time
+            local_header += (uint16_t) 0;     //file last mod date
+            local_header += (uint32_t) crc; //crc
+            local_header += (uint32_t) compressed_bytes; //compressed size
+            local_header += (uint32_t) nbytes; //uncompressed size
+            local_header += (uint16_t) fname.size(); //fname length
+            local_header += (uint16_t) 0; //extra field length
+            local_header += fname;
+
+            //record the compressed size of each piece, so that readers can inflate them in parallel
+            std::vector<char> extra;
+            size_t npieces = first_piece[imember+1] - first_piece[imember];
+            if(compression_level > 0 && 4 + 4 + 4*npieces <= 0xffff) {
+                extra += (uint16_t) npz_pieces_extra_id;
+                extra += (uint16_t) (4 + 4*npieces); //size of the field's data
+                extra += (uint32_t) npz_piece_bytes; //uncompressed size of each piece of data
+                for(size_t i = first_piece[imember]; i < first_piece[imember+1]; i++) {
+                    extra += (uint32_t) pieces[i].compressed.size();
+                }
+            }
+
+            //add to the global header
+            global_header += "PK"; //first part of sig
+            global_header += (uint16_t) 0x0201; //second part of sig
+            global_header += (uint16_t) 20; //version made by
+            global_header.insert(global_header.end(),local_header.begin()+4,local_header.begin()+28);
+            global_header += (uint16_t) extra.size(); //extra field length, which is only in the global header
+            global_header += (uint16_t) 0; //file comment length
+            global_header += (uint16_t) 0; //disk number where file starts
+            global_header += (uint16_t) 0; //internal file attributes
+            global_header += (uint32_t) 0; //external file attributes
+            global_header += (uint32_t) global_header_offset; //relative offset of local file header, since it begins where the global header used to begin
+            global_header += fname;
+            global_header.insert(global_header.end(),extra.begin(),extra.end());
+
+            //write the member
+            write(&local_header[0],local_header.size());
+            for(size_t i = first_piece[imember]; i < first_piece[imember+1]; i++) {
+                if(compression_level > 0) write(pieces[i].compressed.data(),pieces[i].compressed.size());
+                else write(pieces[i].data,pieces[i].nbytes);
+            }
+
+            global_header_offset += local_header.size() + compressed_bytes;
+            nrecs++;
+        }
+
+        //build footer
+        std::vector<char> footer;
+        footer += "PK"; //first part of sig
+        footer += (uint16_t) 0x0605; //second part of sig
+        footer += (uint16_t) 0; //number of this disk
+        footer += (uint16_t) 0; //disk where footer starts
+        footer += (uint16_t) nrecs; //number of records on this disk
+        footer += (uint16_t) nrecs; //total number of records
+        footer += (uint32_t) global_header.size(); //nbytes of global headers
+        footer += (uint32_t) global_header_offset; //offset of start of global headers, since global header now starts after the newly written arrays
+        footer += (uint16_t) 0; //zip file comment length
+
+        write(global_header.data(),global_header.size());
+        write(&footer[0],footer.size());
+    }
+}
 
+void cnpy::npz_save_members(std::string zipname, const std::vector<NpzMember>& members, std::string mode, int compression_level, unsigned int nthreads)
+{
+    if(compression_level < 0 || compression_level > 9)
+        throw std::runtime_error("npz_save: compression level must be 0-9");
+    FILE* fp = NULL;
+    uint16_t nrecs = 0;
+    size_t global_header_offset = 0;
+    std::vector<char> global_header;
+
+    if(mode == "a") fp = fopen(zipname.c_str(),"r+b");
+
+    if(fp) {
+        //zip file exists. we need to add new npy files to it.
+        //first read the footer. this gives us the offset and size of the global header
+        //then read and store the global header.
+        //below, we will write the the new data at the start of the global header then append the global header and footer below it
+        size_t global_header_size;
+        parse_zip_footer(fp,nrecs,global_header_size,global_header_offset);
+        fseek(fp,global_header_offset,SEEK_SET);
+        global_header.resize(global_header_size);
+        size_t res = fread(&global_header[0],sizeof(char),global_header_size,fp);
+        if(res != global_header_size){
+            throw std::runtime_error("npz_save: header read error while adding to existing zip");
+        }
+        fseek(fp,global_header_offset,SEEK_SET);
+    }
+    else {
+        fp = fopen(zipname.c_str(),"wb");
+    }
+
+    if(!fp) throw std::runtime_error("npz_save: unable to open file "+zipname);
+
+    try {
+        npz_write_members([fp,&zipname](const char* data, size_t n) { fwrite_or_throw(data,n,fp,zipname); },
+                          members, compression_level, nthreads, nrecs, global_header_offset, global_header);
+    }
+    catch(...) {
+        fclose(fp);
+        throw;
+    }
+    fclose_or_throw(fp,zipname);
+}
+
+void cnpy::npz_save_members(const std::function<void(const char*, size_t)>& write, const std::vector<NpzMember>& members, int compression_level, unsigned int nthreads)
+{
+    if(compression_level < 0 || compression_level > 9)
+        throw std::runtime_error("npz_save: compression level must be 0-9");
+    npz_write_members(write, members, compression_level, nthreads, 0, 0, {});
+}
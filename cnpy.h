@@ -18,6 +18,11 @@
 #include<memory>
 #include<stdint.h>
 #include<numeric>
+#include<algorithm>
+#include<functional>
+#include<unordered_map>
+
+class MappedFile;
 
 namespace cnpy {
 
@@ -62,16 +67,116 @@ namespace cnpy {
    
     using npz_t = std::map<std::string, NpyArray>; 
 
+    //description of an array, parsed from its npy header
+    struct NpyInfo {
+        char type; //'i', 'u', 'f' etc, as returned by map_type
+        size_t word_size;
+        std::vector<size_t> shape;
+        bool fortran_order;
+        size_t header_size; //total length of the header in bytes, ie the offset of the data from the start of the npy file
+        size_t num_vals() const {
+            return std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+        }
+    };
+
     char BigEndianTest();
     char map_type(const std::type_info& t);
     template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape);
     void parse_npy_header(FILE* fp,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order);
     void parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order);
+    //parse the npy header at the start of buffer, which holds buffer_size bytes. throws if the buffer doesn't start with a valid header
+    NpyInfo parse_npy_info(const char* buffer, size_t buffer_size);
     void parse_zip_footer(FILE* fp, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset);
+    //write nbytes of data to fp, throwing if they can't all be written. fname is for the error message
+    void fwrite_or_throw(const void* data, size_t nbytes, FILE* fp, const std::string& fname);
+    //close fp, throwing if what was still buffered can't be written
+    void fclose_or_throw(FILE* fp, const std::string& fname);
+    //read all of the arrays in fname, inflating them on one thread per core
     npz_t npz_load(std::string fname);
     NpyArray npz_load(std::string fname, std::string varname);
     NpyArray npy_load(std::string fname);
 
+    //an array whose data is read in place from a memory-mapped file instead of being copied. the mapping lasts as long as the array does
+    struct MappedNpyArray {
+        NpyInfo info;
+        const char* bytes;
+        std::shared_ptr<const MappedFile> file;
+
+        template<typename T>
+        const T* data() const {
+            return reinterpret_cast<const T*>(bytes);
+        }
+    };
+
+    //an npz file opened for random access. the end-of-central-directory record and the central directory are read once when
+    //the file is opened, giving an index from member name to its position in the file, so any member can then be loaded without
+    //reading any of the others
+    class NpzFile {
+    public:
+        struct Member {
+            std::string name; //without the trailing .npy
+            uint16_t compr_method; //0 for stored, 8 for deflated
+            uint32_t crc;
+            size_t compr_bytes;
+            size_t uncompr_bytes;
+            size_t local_header_offset;
+            //compressed size of each piece of the member that was deflated on its own, if the writer recorded them (see
+            //npz_save_members). the first piece is the npy header, and the rest hold piece_bytes of data each, apart from the last
+            std::vector<uint32_t> piece_compr_bytes;
+            size_t piece_bytes;
+        };
+
+        explicit NpzFile(std::string fname);
+
+        const std::string& filename() const { return m_fname; }
+        const std::vector<Member>& members() const { return m_members; }
+        bool contains(const std::string& name) const { return m_index.count(name) != 0; }
+        //throws if there is no member called name
+        const Member& member(const std::string& name) const;
+
+        //the npy header of a member. only the header is inflated for compressed members
+        NpyInfo info(const std::string& name) const;
+        //read a member into memory, inflating it if it is compressed. pieces of the member are read on nthreads threads
+        NpyArray load(const std::string& name, unsigned int nthreads = 1) const;
+        //read all of the members into memory, spreading the members, and pieces of large members, over nthreads threads
+        npz_t load_all(unsigned int nthreads = 1) const;
+        //read bytes [offset, offset+nbytes) of a member's data, ie counting from the end of its npy header, into dst. for compressed
+        //members, only the pieces that overlap the range are inflated, if the writer recorded them. otherwise the member is inflated
+        //from the start to the end of the range
+        void read_data(const std::string& name, size_t offset, size_t nbytes, char* dst) const;
+        //map a member's data without copying it. only possible for stored (uncompressed) members, so this throws for compressed ones
+        MappedNpyArray map(const std::string& name) const;
+
+    private:
+        //the start of a member's data (compressed or not) in the mapping
+        const char* member_data(const Member& m) const;
+        //allocate an array for member m, and add the jobs that fill it to tasks. the jobs are independent, so they can be run in any order
+        NpyArray prepare_load(const Member& m, std::vector<std::function<void()>>& tasks) const;
+
+        std::string m_fname;
+        std::shared_ptr<const MappedFile> m_file;
+        std::vector<Member> m_members;
+        std::unordered_map<std::string, size_t> m_index;
+    };
+
+    //convert n values of the type described by type and word_size at src to T, storing them in dst
+    template<typename T> void convert_npy_data(const char* src, char type, size_t word_size, size_t n, T* dst) {
+        if(type == map_type(typeid(T)) && word_size == sizeof(T)) {
+            std::copy(reinterpret_cast<const T*>(src), reinterpret_cast<const T*>(src)+n, dst);
+            return;
+        }
+        #define CNPY_CONVERT(TYPE, FROM) if(type == TYPE && word_size == sizeof(FROM)) { std::copy(reinterpret_cast<const FROM*>(src), reinterpret_cast<const FROM*>(src)+n, dst); return; }
+        CNPY_CONVERT('i', int16_t)
+        CNPY_CONVERT('i', int32_t)
+        CNPY_CONVERT('i', int64_t)
+        CNPY_CONVERT('u', uint16_t)
+        CNPY_CONVERT('u', uint32_t)
+        CNPY_CONVERT('f', float)
+        CNPY_CONVERT('f', double)
+        #undef CNPY_CONVERT
+        throw std::runtime_error(std::string("convert_npy_data: unsupported type ")+type+std::to_string(word_size));
+    }
+
     template<typename T> std::vector<char>& operator+=(std::vector<char>& lhs, const T rhs) {
         //write in little endian
         for(size_t byte = 0; byte < sizeof(T); byte++) {
@@ -85,7 +190,9 @@ namespace cnpy {
     template<> std::vector<char>& operator+=(std::vector<char>& lhs, const char* rhs);
 
 
-    template<typename T> void npy_save(std::string fname, const T* data, const std::vector<size_t> shape, std::string mode = "w") {
+    //open fname and write the header for an array of the given shape, appending to the existing array along the first axis if mode is "a" and the file exists.
+    //returns the file positioned at the end of the existing data, ready for the caller to write the new data and fclose_or_throw() it
+    template<typename T> FILE* npy_open(std::string fname, const std::vector<size_t> shape, std::string mode = "w") {
         FILE* fp = NULL;
         std::vector<size_t> true_data_shape; //if appending, the shape of existing + new data
 
@@ -120,104 +227,65 @@ namespace cnpy {
             true_data_shape = shape;
         }
 
+        if(!fp) throw std::runtime_error("npy_open: unable to open file "+fname);
+
         std::vector<char> header = create_npy_header<T>(true_data_shape);
-        size_t nels = std::accumulate(shape.begin(),shape.end(),1,std::multiplies<size_t>());
 
         fseek(fp,0,SEEK_SET);
-        fwrite(&header[0],sizeof(char),header.size(),fp);
+        try {
+            fwrite_or_throw(&header[0],header.size(),fp,fname);
+        }
+        catch(...) {
+            fclose(fp);
+            throw;
+        }
         fseek(fp,0,SEEK_END);
-        fwrite(data,sizeof(T),nels,fp);
-        fclose(fp);
+        return fp;
     }
 
-    template<typename T> void npz_save(std::string zipname, std::string fname, const T* data, const std::vector<size_t>& shape, std::string mode = "w")
-    {
-        //first, append a .npy to the fname
-        fname += ".npy";
+    template<typename T> void npy_save(std::string fname, const T* data, const std::vector<size_t> shape, std::string mode = "w") {
+        FILE* fp = npy_open<T>(fname, shape, mode);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+        try {
+            fwrite_or_throw(data,nels*sizeof(T),fp,fname);
+        }
+        catch(...) {
+            fclose(fp);
+            throw;
+        }
+        fclose_or_throw(fp,fname);
+    }
 
-        //now, on with the show
-        FILE* fp = NULL;
-        uint16_t nrecs = 0;
-        size_t global_header_offset = 0;
-        std::vector<char> global_header;
+    //an array to be written into an npz file by npz_save_members. the data is not copied, so it must stay valid until then
+    struct NpzMember {
+        std::string name; //name of the array, without the trailing .npy
+        std::vector<char> npy_header;
+        const char* data;
+        size_t nbytes;
+    };
 
-        if(mode == "a") fp = fopen(zipname.c_str(),"r+b");
+    template<typename T> NpzMember npz_member(std::string name, const T* data, const std::vector<size_t>& shape) {
+        NpzMember member;
+        member.name = name;
+        member.npy_header = create_npy_header<T>(shape);
+        member.data = reinterpret_cast<const char*>(data);
+        member.nbytes = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>())*sizeof(T);
+        return member;
+    }
 
-        if(fp) {
-            //zip file exists. we need to add a new npy file to it.
-            //first read the footer. this gives us the offset and size of the global header
-            //then read and store the global header.
-            //below, we will write the the new data at the start of the global header then append the global header and footer below it
-            size_t global_header_size;
-            parse_zip_footer(fp,nrecs,global_header_size,global_header_offset);
-            fseek(fp,global_header_offset,SEEK_SET);
-            global_header.resize(global_header_size);
-            size_t res = fread(&global_header[0],sizeof(char),global_header_size,fp);
-            if(res != global_header_size){
-                throw std::runtime_error("npz_save: header read error while adding to existing zip");
-            }
-            fseek(fp,global_header_offset,SEEK_SET);
-        }
-        else {
-            fp = fopen(zipname.c_str(),"wb");
-        }
+    //write members to the zip file zipname, creating it if mode is "w" and adding to it if mode is "a".
+    //compression_level 0 stores the arrays uncompressed, while 1-9 deflates them at that zlib level.
+    //the arrays are compressed in independent pieces (each member, and chunks of large members) spread over nthreads threads.
+    //the compressed size of each piece is recorded in an extra field in the central directory, so that NpzFile can inflate the
+    //pieces in parallel too. other zip readers ignore the field
+    void npz_save_members(std::string zipname, const std::vector<NpzMember>& members, std::string mode = "w", int compression_level = 0, unsigned int nthreads = 1);
 
-        std::vector<char> npy_header = create_npy_header<T>(shape);
-
-        size_t nels = std::accumulate(shape.begin(),shape.end(),1,std::multiplies<size_t>());
-        size_t nbytes = nels*sizeof(T) + npy_header.size();
-
-        //get the CRC of the data to be added
-        uint32_t crc = crc32(0L,(uint8_t*)&npy_header[0],npy_header.size());
-        crc = crc32(crc,(uint8_t*)data,nels*sizeof(T));
-
-        //build the local header
-        std::vector<char> local_header;
-        local_header += "PK"; //first part of sig
-        local_header += (uint16_t) 0x0403; //second part of sig
-        local_header += (uint16_t) 20; //min version to extract
-        local_header += (uint16_t) 0; //general purpose bit flag
-        local_header += (uint16_t) 0; //compression method
-        local_header += (uint16_t) 0; //file last mod time
-        local_header += (uint16_t) 0;     //file last mod date
-        local_header += (uint32_t) crc; //crc
-        local_header += (uint32_t) nbytes; //compressed size
-        local_header += (uint32_t) nbytes; //uncompressed size
-        local_header += (uint16_t) fname.size(); //fname length
-        local_header += (uint16_t) 0; //extra field length
-        local_header += fname;
-
-        //build global header
-        global_header += "PK"; //first part of sig
-        global_header += (uint16_t) 0x0201; //second part of sig
-        global_header += (uint16_t) 20; //version made by
-        global_header.insert(global_header.end(),local_header.begin()+4,local_header.begin()+30);
-        global_header += (uint16_t) 0; //file comment length
-        global_header += (uint16_t) 0; //disk number where file starts
-        global_header += (uint16_t) 0; //internal file attributes
-        global_header += (uint32_t) 0; //external file attributes
-        global_header += (uint32_t) global_header_offset; //relative offset of local file header, since it begins where the global header used to begin
-        global_header += fname;
-
-        //build footer
-        std::vector<char> footer;
-        footer += "PK"; //first part of sig
-        footer += (uint16_t) 0x0605; //second part of sig
-        footer += (uint16_t) 0; //number of this disk
-        footer += (uint16_t) 0; //disk where footer starts
-        footer += (uint16_t) (nrecs+1); //number of records on this disk
-        footer += (uint16_t) (nrecs+1); //total number of records
-        footer += (uint32_t) global_header.size(); //nbytes of global headers
-        footer += (uint32_t) (global_header_offset + nbytes + local_header.size()); //offset of start of global headers, since global header now starts after newly written array
-        footer += (uint16_t) 0; //zip file comment length
-
-        //write everything
-        fwrite(&local_header[0],sizeof(char),local_header.size(),fp);
-        fwrite(&npy_header[0],sizeof(char),npy_header.size(),fp);
-        fwrite(data,sizeof(T),nels,fp);
-        fwrite(&global_header[0],sizeof(char),global_header.size(),fp);
-        fwrite(&footer[0],sizeof(char),footer.size(),fp);
-        fclose(fp);
+    //as above, but for a new zip file whose bytes are passed to `write` in order, rather than written to a file
+    void npz_save_members(const std::function<void(const char*, size_t)>& write, const std::vector<NpzMember>& members, int compression_level = 0, unsigned int nthreads = 1);
+
+    template<typename T> void npz_save(std::string zipname, std::string fname, const T* data, const std::vector<size_t>& shape, std::string mode = "w", int compression_level = 0, unsigned int nthreads = 1)
+    {
+        npz_save_members(zipname, {npz_member(fname, data, shape)}, mode, compression_level, nthreads);
     }
 
     template<typename T> void npy_save(std::string fname, const std::vector<T> data, std::string mode = "w") {
@@ -226,10 +294,10 @@ namespace cnpy {
         npy_save(fname, &data[0], shape, mode);
     }
 
-    template<typename T> void npz_save(std::string zipname, std::string fname, const std::vector<T> data, std::string mode = "w") {
+    template<typename T> void npz_save(std::string zipname, std::string fname, const std::vector<T> data, std::string mode = "w", int compression_level = 0, unsigned int nthreads = 1) {
         std::vector<size_t> shape;
         shape.push_back(data.size());
-        npz_save(zipname, fname, &data[0], shape, mode);
+        npz_save(zipname, fname, &data[0], shape, mode, compression_level, nthreads);
     }
 
     template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape) {  
@@ -0,0 +1,259 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+// A single file holding many events, with an index at the end so
+// that any event can be found without reading the ones before it.
+// The layout is:
+//
+//   "WFCONT01"                   8-byte magic number
+//   block for first event
+//   block for second event
+//   ...
+//   index                        one ContainerIndexEntry per event
+//   trailer                      ContainerTrailer
+//
+// Each block is the event's channel numbers as a 1D npy array,
+// followed immediately by its samples as a 2D npy array (nchannels x
+// nticks), so the sample type is recorded in the file. Events are
+// appended by writing the new block over the old index, and then
+// writing the extended index and trailer after it
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cnpy.h"
+#include "waveform_matrix.h"
+
+// One event's entry in the index
+struct ContainerIndexEntry
+{
+    int64_t event;
+    uint64_t timestamp;
+    // Position of the event's block, in bytes from the start of the file
+    uint64_t offset;
+    // Number of rows (ie, channels) in the event
+    uint64_t nchannels;
+    // Number of samples in each row
+    uint64_t nticks;
+};
+
+// The last bytes of the file, which say where to find the index
+struct ContainerTrailer
+{
+    uint64_t index_offset;
+    uint64_t nentries;
+    char magic[8];
+};
+
+static_assert(sizeof(ContainerIndexEntry)==40, "ContainerIndexEntry must have no padding");
+static_assert(sizeof(ContainerTrailer)==24, "ContainerTrailer must have no padding");
+
+const char container_file_magic[9]="WFCONT01";
+const char container_index_magic[9]="WFINDX01";
+
+// An open container file, which is closed when it goes out of scope,
+// including when the constructor of the class holding it throws
+typedef std::unique_ptr<FILE, decltype(&fclose)> ContainerFile;
+
+// Read the index of the container file open as `fp`. Throws if `fp`
+// isn't a container file
+inline std::vector<ContainerIndexEntry> read_container_index(FILE* fp, std::string const& filename)
+{
+    char magic[8];
+    ContainerTrailer trailer;
+    if(fseek(fp, 0, SEEK_SET)!=0 || fread(magic, 1, 8, fp)!=8 ||
+       std::string(magic, 8)!=container_file_magic ||
+       fseek(fp, -(long)sizeof(ContainerTrailer), SEEK_END)!=0 ||
+       fread(&trailer, sizeof(trailer), 1, fp)!=1 ||
+       std::string(trailer.magic, 8)!=container_index_magic){
+        throw std::runtime_error(filename+" is not a container file, or its index is missing");
+    }
+    std::vector<ContainerIndexEntry> index(trailer.nentries);
+    if(fseek(fp, trailer.index_offset, SEEK_SET)!=0 ||
+       fread(index.data(), sizeof(ContainerIndexEntry), index.size(), fp)!=index.size()){
+        throw std::runtime_error("Failed to read the index of container file "+filename);
+    }
+    return index;
+}
+
+// Writes events to a container file. The index is rewritten after
+// every event, so the file is complete and readable after each call
+// to write_event
+class ContainerWriter
+{
+public:
+    // Open `filename`, replacing any existing file unless `append`
+    // is true, in which case new events are added after the ones
+    // already in it
+    ContainerWriter(std::string const& filename, bool append)
+        : m_filename(filename)
+    {
+        if(append) m_fp.reset(fopen(filename.c_str(), "r+b"));
+
+        if(m_fp){
+            m_index=read_container_index(m_fp.get(), filename);
+            fseek(m_fp.get(), 0, SEEK_END);
+            m_end=ftell(m_fp.get())-sizeof(ContainerTrailer)-m_index.size()*sizeof(ContainerIndexEntry);
+        }
+        else{
+            m_fp.reset(fopen(filename.c_str(), "wb"));
+            if(!m_fp) throw std::runtime_error("Unable to open container file "+filename);
+            cnpy::fwrite_or_throw(container_file_magic, 8, m_fp.get(), filename);
+            m_end=8;
+            write_index();
+        }
+    }
+
+    ContainerWriter(ContainerWriter const&) = delete;
+    ContainerWriter& operator=(ContainerWriter const&) = delete;
+
+    // Add the rows of `m` as event `event`
+    template<class T>
+    void write_event(int64_t event, uint64_t timestamp, WaveformMatrix<T> const& m)
+    {
+        const size_t nrows=m.nrows();
+        if(!m.channels.empty() && m.channels.size()!=nrows){
+            throw std::runtime_error("ContainerWriter: matrix has the wrong number of channel numbers");
+        }
+        // Rows with no channel numbers get -1
+        std::vector<int> no_channels;
+        const int* channels=m.channels.data();
+        if(m.channels.empty()){
+            no_channels.assign(nrows, -1);
+            channels=no_channels.data();
+        }
+
+        std::vector<char> channels_header=cnpy::create_npy_header<int>({nrows});
+        std::vector<char> samples_header=cnpy::create_npy_header<T>({nrows, m.nsamples});
+
+        fseek(m_fp.get(), m_end, SEEK_SET);
+        cnpy::fwrite_or_throw(channels_header.data(), channels_header.size(), m_fp.get(), m_filename);
+        cnpy::fwrite_or_throw(channels, nrows*sizeof(int), m_fp.get(), m_filename);
+        cnpy::fwrite_or_throw(samples_header.data(), samples_header.size(), m_fp.get(), m_filename);
+        cnpy::fwrite_or_throw(m.samples.data(), m.samples.size()*sizeof(T), m_fp.get(), m_filename);
+
+        m_index.push_back(ContainerIndexEntry{event, timestamp, m_end, nrows, m.nsamples});
+        m_end+=channels_header.size()+nrows*sizeof(int)+samples_header.size()+m.samples.size()*sizeof(T);
+        write_index();
+    }
+
+private:
+    void write_index()
+    {
+        ContainerTrailer trailer;
+        trailer.index_offset=m_end;
+        trailer.nentries=m_index.size();
+        std::copy(container_index_magic, container_index_magic+8, trailer.magic);
+
+        fseek(m_fp.get(), m_end, SEEK_SET);
+        cnpy::fwrite_or_throw(m_index.data(), m_index.size()*sizeof(ContainerIndexEntry), m_fp.get(), m_filename);
+        cnpy::fwrite_or_throw(&trailer, sizeof(trailer), m_fp.get(), m_filename);
+        if(fflush(m_fp.get())!=0){
+            throw std::runtime_error("Failed to write to container file "+m_filename+": "+strerror(errno));
+        }
+    }
+
+    std::string m_filename;
+    ContainerFile m_fp{nullptr, fclose};
+    // Where the next block goes, which is also where the index starts
+    uint64_t m_end=0;
+    std::vector<ContainerIndexEntry> m_index;
+};
+
+// Reads events from a container file. The index is read once when
+// the file is opened, after which each event is read with a single
+// seek to its block
+class ContainerReader
+{
+public:
+    explicit ContainerReader(std::string const& filename)
+        : m_filename(filename), m_fp(fopen(filename.c_str(), "rb"), fclose)
+    {
+        if(!m_fp) throw std::runtime_error("Unable to open container file "+filename);
+        m_index=read_container_index(m_fp.get(), filename);
+        for(size_t i=0; i<m_index.size(); ++i){
+            // If an event number appears more than once, the first one wins
+            m_entry_for_event.emplace(m_index[i].event, i);
+        }
+    }
+
+    ContainerReader(ContainerReader const&) = delete;
+    ContainerReader& operator=(ContainerReader const&) = delete;
+
+    std::vector<ContainerIndexEntry> const& index() const { return m_index; }
+
+    bool has_event(int64_t event) const { return m_entry_for_event.count(event)!=0; }
+
+    // Read the `ientry`th event in the file, converting the samples to T
+    template<class T>
+    WaveformMatrix<T> read_entry(size_t ientry)
+    {
+        ContainerIndexEntry const& entry=m_index.at(ientry);
+        WaveformMatrix<T> ret(entry.nticks);
+        ret.channels.resize(entry.nchannels);
+        ret.events.assign(entry.nchannels, entry.event);
+        ret.samples.resize(entry.nchannels*entry.nticks);
+
+        fseek(m_fp.get(), entry.offset, SEEK_SET);
+        read_npy(ret.channels.data(), ret.channels.size());
+        read_npy(ret.samples.data(), ret.samples.size());
+        return ret;
+    }
+
+    // Read event number `event`, converting the samples to T
+    template<class T>
+    WaveformMatrix<T> read_event(int64_t event)
+    {
+        auto it=m_entry_for_event.find(event);
+        if(it==m_entry_for_event.end()){
+            throw std::runtime_error("Event "+std::to_string(event)+" is not in container file "+m_filename);
+        }
+        return read_entry<T>(it->second);
+    }
+
+private:
+    // Read the npy array at the current position into `dst`, which
+    // has room for `n` values
+    template<class T>
+    void read_npy(T* dst, size_t n)
+    {
+        // The headers we write are well under this size
+        char buffer[256];
+        size_t nread=fread(buffer, 1, 10, m_fp.get());
+        size_t header_len=(nread==10) ? *reinterpret_cast<uint16_t*>(buffer+8) : 0;
+        if(nread!=10 || header_len+10>sizeof(buffer) ||
+           fread(buffer+10, 1, header_len, m_fp.get())!=header_len){
+            throw std::runtime_error("Failed to read block header from container file "+m_filename);
+        }
+        cnpy::NpyInfo info=cnpy::parse_npy_info(buffer, 10+header_len);
+        if(info.num_vals()!=n){
+            throw std::runtime_error("Block size doesn't match the index in container file "+m_filename);
+        }
+        // Read straight into `dst` if there's no conversion to do
+        if(info.type==cnpy::map_type(typeid(T)) && info.word_size==sizeof(T)){
+            if(fread(dst, sizeof(T), n, m_fp.get())!=n){
+                throw std::runtime_error("Failed to read block from container file "+m_filename);
+            }
+            return;
+        }
+        std::vector<char> data(n*info.word_size);
+        if(fread(data.data(), 1, data.size(), m_fp.get())!=data.size()){
+            throw std::runtime_error("Failed to read block from container file "+m_filename);
+        }
+        cnpy::convert_npy_data(data.data(), info.type, info.word_size, n, dst);
+    }
+
+    std::string m_filename;
+    ContainerFile m_fp;
+    std::vector<ContainerIndexEntry> m_index;
+    std::unordered_map<int64_t, size_t> m_entry_for_event;
+};
+
+#endif // include guard
@@ -0,0 +1,155 @@
+#ifndef EVENT_INDEX_H
+#define EVENT_INDEX_H
+
+// A small file kept next to an input file that lists the ID, trigger
+// type and timestamp of each of its events, so that selecting events
+// by any of them doesn't need a pass over the input file. Like the
+// channel index, it is a numpy file: an int64 array with one row per
+// entry of (entry, run, subrun, event, trigger flags, timestamp)
+
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "canvas/Utilities/InputTag.h"
+
+#include "cnpy.h"
+#include "event_selection.h"
+#include "event_source.h"
+
+// Where the trigger flags (for --trig) and the timestamp (for --ts) of
+// each event are read from
+const art::InputTag trigger_flags_tag{"timingrawdecoder:daq:DecoderandReco"};
+const art::InputTag timestamp_tag{"timing:daq:RunRawDecoder"};
+
+struct EventIndexEntry
+{
+    int64_t entry;
+    int64_t run;
+    int64_t subrun;
+    int64_t event;
+    // -1 if the event doesn't have them
+    int64_t trigger_flags;
+    int64_t timestamp;
+};
+
+static_assert(sizeof(EventIndexEntry)==6*sizeof(int64_t), "EventIndexEntry must have no padding");
+
+// Name of the event index for the input file `input`: the name of the
+// input file with its extension replaced by "_evidx.npy", in the
+// directory `dir`, or next to the input file if `dir` is empty, eg
+// /data/run5387_1.root -> /data/run5387_1_evidx.npy
+inline std::string event_index_filename(std::string const& input, std::string const& dir)
+{
+    const size_t slash=input.find_last_of("/");
+    std::string ret=(dir=="" || slash==std::string::npos) ? input : input.substr(slash+1);
+    if(dir!="") ret=dir+"/"+ret;
+    const size_t dotpos=ret.find_last_of(".");
+    if(dotpos!=std::string::npos && dotpos>ret.find_last_of("/")+1) ret=ret.substr(0, dotpos);
+    return ret+"_evidx.npy";
+}
+
+// The index of the events of `ev`, made by going to each entry in
+// turn. Only the event ID and the two small timestamp products are
+// read, not the waveforms
+inline std::vector<EventIndexEntry> make_event_index(EventSource& ev)
+{
+    std::vector<EventIndexEntry> ret;
+    const long long nentries=ev.numberOfEventsInFile();
+    for(long long entry=0; entry<nentries; ++entry){
+        ev.goToEntry(entry);
+        auto const& id=ev.eventAuxiliary().id();
+        EventIndexEntry e{entry, id.run(), id.subRun(), id.event(), -1, -1};
+        // Not every file has the timing products, so a missing one is
+        // recorded as -1 rather than being an error
+        try{
+            auto& flags=ev.timestamps(trigger_flags_tag);
+            if(flags.size()==1) e.trigger_flags=flags[0].GetFlags();
+        }
+        catch(std::exception const&){}
+        try{
+            auto& timestamps=ev.timestamps(timestamp_tag);
+            if(timestamps.size()==1) e.timestamp=timestamps[0].GetTimeStamp();
+        }
+        catch(std::exception const&){}
+        ret.push_back(e);
+    }
+    return ret;
+}
+
+inline void save_event_index(std::string const& filename, std::vector<EventIndexEntry> const& index)
+{
+    cnpy::npy_save(filename, reinterpret_cast<const int64_t*>(index.data()), {index.size(), 6});
+}
+
+// Make the index of the input file `input`, whose events are read from
+// `ev`, and save it to `filename`. Returns the number of entries
+inline int64_t write_event_index(EventSource& ev, std::string const& input, std::string const& filename)
+{
+    const std::vector<EventIndexEntry> index=make_event_index(ev);
+    save_event_index(filename, index);
+    std::cout << "Wrote index of " << index.size() << " events in " << input << " to " << filename << std::endl;
+    return index.size();
+}
+
+// Whether there's an index in `filename` to load
+inline bool have_event_index(std::string const& filename)
+{
+    return access(filename.c_str(), R_OK)==0;
+}
+
+// Read the index in `filename`. Throws if it isn't an event index
+inline std::vector<EventIndexEntry> load_event_index(std::string const& filename)
+{
+    cnpy::NpyArray arr=cnpy::npy_load(filename);
+    if(arr.shape.size()!=2 || arr.shape[1]!=6 || arr.word_size!=sizeof(int64_t)){
+        throw std::runtime_error(filename+" is not an event index");
+    }
+    const EventIndexEntry* begin=reinterpret_cast<const EventIndexEntry*>(arr.data<int64_t>());
+    return std::vector<EventIndexEntry>(begin, begin+arr.shape[0]);
+}
+
+// The entries to look at, as for select_entries(), but found from
+// `index` without reading the input file, which has `nentries`
+// entries. If `triggerType` isn't -1, only the entries with those
+// trigger flags are kept, after skipping `nskip`. Throws if the index
+// doesn't match the file
+inline std::vector<long long> select_indexed_entries(std::vector<EventIndexEntry> const& index, long long nentries,
+                                                     EventSelection const& selection, int nskip, int triggerType)
+{
+    if((long long)index.size()!=nentries){
+        throw std::runtime_error("The event index has "+std::to_string(index.size())+" entries but the file has "+
+                                 std::to_string(nentries)+": remake it with --make-event-index");
+    }
+    std::vector<long long> ret;
+    int nmatched=0;
+    for(EventIndexEntry const& e: index){
+        if(!selection.empty() && !selection.contains(e.run, e.subrun, e.event)) continue;
+        if(nmatched++<nskip) continue;
+        if(triggerType!=-1 && e.trigger_flags!=triggerType) continue;
+        ret.push_back(e.entry);
+    }
+    return ret;
+}
+
+// The timestamp of `entry`, the entry `ev` is at, for --ts, read from
+// the product with `tag`. If that's the product the index holds the
+// timestamps of, it's taken from `index` instead, if that isn't null
+// and has it, which saves reading the product. Other tags always read
+// the product, so that the timestamp doesn't depend on whether there
+// happens to be an index
+inline uint64_t event_timestamp(EventSource& ev, long long entry, std::vector<EventIndexEntry> const* index,
+                                art::InputTag const& tag=timestamp_tag)
+{
+    if(index && tag==timestamp_tag && (*index)[entry].timestamp!=-1) return (*index)[entry].timestamp;
+    auto& rdtimestamps=ev.timestamps(tag);
+    assert(rdtimestamps.size()==1);
+    return rdtimestamps[0].GetTimeStamp();
+}
+
+#endif // include guard
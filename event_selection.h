@@ -0,0 +1,140 @@
+#ifndef EVENT_SELECTION_H
+#define EVENT_SELECTION_H
+
+// Choosing which events of an input file to extract, by position in
+// the file or by run, subrun and event number, so that the extractors
+// can jump straight to the entries they want
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// A range of event numbers [first, last] in run `run` and subrun
+// `subrun`, either of which may be -1 to mean any
+struct EventIDRange
+{
+    long run=-1;
+    long subrun=-1;
+    long first=0;
+    long last=0;
+
+    bool contains(long r, long s, long e) const
+    {
+        return (run<0 || run==r) && (subrun<0 || subrun==s) && e>=first && e<=last;
+    }
+};
+
+// A set of events given by ID. Each item is "[run:[subrun:]]event",
+// where `event` is a number or a range "first-last", and `run` and
+// `subrun` are numbers or "*" for any, eg "5387:1:100-200" or "7"
+class EventSelection
+{
+public:
+    // Add the items in `spec`, separated by commas or whitespace.
+    // Throws std::invalid_argument if any of them can't be parsed
+    void add(std::string const& spec)
+    {
+        std::string items(spec);
+        for(char& c: items){
+            if(c==',') c=' ';
+        }
+        std::istringstream iss(items);
+        for(std::string item; iss >> item; ){
+            m_ranges.push_back(parse_item(item));
+        }
+    }
+
+    // Add the items in the file `filename`, in the same format as for
+    // add(), with anything after a "#" on a line ignored
+    void add_file(std::string const& filename)
+    {
+        std::ifstream fin(filename);
+        if(!fin){
+            throw std::invalid_argument("unable to open event list "+filename);
+        }
+        for(std::string line; std::getline(fin, line); ){
+            add(line.substr(0, line.find('#')));
+        }
+    }
+
+    bool empty() const { return m_ranges.empty(); }
+
+    bool contains(long run, long subrun, long event) const
+    {
+        for(EventIDRange const& range: m_ranges){
+            if(range.contains(run, subrun, event)) return true;
+        }
+        return false;
+    }
+
+private:
+    static long parse_number(std::string const& s, std::string const& item)
+    {
+        size_t pos=0;
+        long ret=-1;
+        try{
+            ret=std::stol(s, &pos);
+        }
+        catch(std::exception const&){
+            pos=0;
+        }
+        if(s.empty() || pos!=s.size() || ret<0){
+            throw std::invalid_argument("bad event ID \""+item+"\"");
+        }
+        return ret;
+    }
+
+    static EventIDRange parse_item(std::string const& item)
+    {
+        std::vector<std::string> fields;
+        std::istringstream iss(item);
+        for(std::string field; std::getline(iss, field, ':'); ) fields.push_back(field);
+        if(fields.empty() || fields.size()>3){
+            throw std::invalid_argument("bad event ID \""+item+"\"");
+        }
+        EventIDRange ret;
+        if(fields.size()>=2 && fields[0]!="*") ret.run=parse_number(fields[0], item);
+        if(fields.size()==3 && fields[1]!="*") ret.subrun=parse_number(fields[1], item);
+        std::string const& events=fields.back();
+        const size_t dash=events.find('-');
+        ret.first=parse_number(events.substr(0, dash), item);
+        ret.last=(dash==std::string::npos) ? ret.first : parse_number(events.substr(dash+1), item);
+        if(ret.last<ret.first){
+            throw std::invalid_argument("bad event range \""+item+"\"");
+        }
+        return ret;
+    }
+
+    std::vector<EventIDRange> m_ranges;
+};
+
+// The entries of the gallery::Event `ev` to look at, in file order:
+// all of them if `selection` is empty, or otherwise the ones whose
+// IDs are in `selection`, with the first `nskip` of those left out.
+// Only the event IDs are read to find them, and with no IDs to match,
+// the skipped entries aren't touched at all. The caller then goes to
+// each entry with goToEntry()
+template<class E>
+std::vector<long long> select_entries(E& ev, EventSelection const& selection, int nskip)
+{
+    const long long nentries=ev.numberOfEventsInFile();
+    std::vector<long long> ret;
+    if(selection.empty()){
+        for(long long entry=std::max(nskip, 0); entry<nentries; ++entry) ret.push_back(entry);
+        return ret;
+    }
+    int nmatched=0;
+    for(long long entry=0; entry<nentries; ++entry){
+        ev.goToEntry(entry);
+        auto const& id=ev.eventAuxiliary().id();
+        if(!selection.contains(id.run(), id.subRun(), id.event())) continue;
+        if(nmatched++<nskip) continue;
+        ret.push_back(entry);
+    }
+    return ret;
+}
+
+#endif // include guard
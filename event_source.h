@@ -0,0 +1,93 @@
+#ifndef EVENT_SOURCE_H
+#define EVENT_SOURCE_H
+
+// Where the extractors get their events from. The extraction code only
+// sees an EventSource, so it can run on events read from an art/ROOT
+// file with gallery (GalleryEventSource), or on events made up on the
+// spot (SyntheticEventSource in synthetic_source.h), which need no
+// input files. Building with -DWITH_GALLERY=OFF leaves gallery out
+// altogether, and only synthetic events can then be read
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "canvas/Persistency/Provenance/EventAuxiliary.h"
+#include "canvas/Utilities/InputTag.h"
+
+#include "lardataobj/RawData/OpDetWaveform.h"
+#include "lardataobj/RawData/RawDigit.h"
+#include "lardataobj/RawData/RDTimeStamp.h"
+#include "lardataobj/RecoBase/Hit.h"
+#include "lardataobj/Simulation/SimChannel.h"
+
+#ifndef WAVEFORM_TOOLS_NO_GALLERY
+#include "gallery/Event.h"
+#endif
+
+// A sequence of events, any of which can be gone to. The first three
+// functions are named as they are in gallery::Event, so that eg
+// select_entries() works with either. The products of an event are
+// only valid until the next call to goToEntry()
+class EventSource
+{
+public:
+    virtual ~EventSource() {}
+
+    virtual long long numberOfEventsInFile() const=0;
+    virtual void goToEntry(long long entry)=0;
+    virtual art::EventAuxiliary const& eventAuxiliary() const=0;
+
+    // The products of the current event with `tag`. Each throws if the
+    // event doesn't have them
+    virtual std::vector<raw::RawDigit> const& raw_digits(art::InputTag const& tag)=0;
+    virtual std::vector<raw::OpDetWaveform> const& op_det_waveforms(art::InputTag const& tag)=0;
+    virtual std::vector<recob::Hit> const& hits(art::InputTag const& tag)=0;
+    virtual std::vector<sim::SimChannel> const& sim_channels(art::InputTag const& tag)=0;
+    virtual std::vector<raw::RDTimeStamp> const& timestamps(art::InputTag const& tag)=0;
+};
+
+#ifndef WAVEFORM_TOOLS_NO_GALLERY
+// The events of an art/ROOT file, read with gallery
+class GalleryEventSource : public EventSource
+{
+public:
+    explicit GalleryEventSource(std::string const& filename)
+        : m_event(std::vector<std::string>(1, filename))
+    {}
+
+    long long numberOfEventsInFile() const override { return m_event.numberOfEventsInFile(); }
+    void goToEntry(long long entry) override { m_event.goToEntry(entry); }
+    art::EventAuxiliary const& eventAuxiliary() const override { return m_event.eventAuxiliary(); }
+
+    std::vector<raw::RawDigit> const& raw_digits(art::InputTag const& tag) override
+    {
+        return *m_event.getValidHandle<std::vector<raw::RawDigit> >(tag);
+    }
+
+    std::vector<raw::OpDetWaveform> const& op_det_waveforms(art::InputTag const& tag) override
+    {
+        return *m_event.getValidHandle<std::vector<raw::OpDetWaveform> >(tag);
+    }
+
+    std::vector<recob::Hit> const& hits(art::InputTag const& tag) override
+    {
+        return *m_event.getValidHandle<std::vector<recob::Hit> >(tag);
+    }
+
+    std::vector<sim::SimChannel> const& sim_channels(art::InputTag const& tag) override
+    {
+        return *m_event.getValidHandle<std::vector<sim::SimChannel> >(tag);
+    }
+
+    std::vector<raw::RDTimeStamp> const& timestamps(art::InputTag const& tag) override
+    {
+        return *m_event.getValidHandle<std::vector<raw::RDTimeStamp> >(tag);
+    }
+
+private:
+    gallery::Event m_event;
+};
+#endif
+
+#endif // include guard
@@ -1,6 +1,7 @@
 #include <chrono>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <string>
 #include <vector>
 #include <fstream>
@@ -9,14 +10,20 @@
 #include "boost/program_options.hpp"
 
 #include "canvas/Utilities/InputTag.h"
-#include "gallery/Event.h"
 
 #include "lardataobj/Simulation/SimChannel.h"
 #include "lardataobj/RawData/RawDigit.h"
 #include "lardataobj/RawData/RDTimeStamp.h"
 #include "lardataobj/RecoBase/Hit.h"
 
-#include "cnpy.h"
+#include "async_writer.h"
+#include "batch.h"
+#include "event_index.h"
+#include "event_selection.h"
+#include "event_source.h"
+#include "output.h"
+#include "parallel.h"
+#include "synthetic_source.h"
 
 using namespace art;
 using namespace std;
@@ -24,49 +31,8 @@ using namespace std::chrono;
 
 namespace po = boost::program_options;
 
-enum class Format { Text, Numpy };
-
 // DecoderandReco | timingrawdecoder | daq.................. | std::vector<raw::RDTimeStamp>....................................... | ....1
 
-template<class T>
-void save_to_file(std::string const& outfile,
-                  std::vector<std::vector<T> > v,
-                  Format format,
-                  bool append)
-{
-    switch(format){
-
-    case Format::Text:
-    {
-        // Open in append mode because we 
-        std::ofstream fout(outfile, append ? ios::app : ios_base::out);
-        for(auto const& v1 : v){
-            for(auto const& s : v1){
-                fout << s << " ";
-            }
-            fout << std::endl;
-        }
-    }
-    break;
-    
-    case Format::Numpy:
-    {
-        // Do nothing if the vector is empty
-        if(v.empty() || v[0].empty()) break;
-        // cnpy needs a single contiguous array of data, so do that conversion
-        std::vector<T> tmp;
-        tmp.reserve(v.size()*v[0].size());
-        for(auto const& v1 : v){
-            for(auto const& s : v1){
-                tmp.push_back(s);
-            }
-        }
-        cnpy::npy_save(outfile, &tmp[0], {v.size(), v[0].size()}, append ? "a" : "w");
-    }
-    break;
-    }
-}
-
 // Write `nevents` events of data from `filename` to text files. The
 // raw waveforms are written to `outfile`, while the true energy
 // depositions are written to `truth_outfile` (unless it is an empty
@@ -81,26 +47,60 @@ void save_to_file(std::string const& outfile,
 // Each line in `truth_outfile` has the format
 //
 // event_no channel_no tdc total_charge
-void
+//
+// The events are the first `nevents` of the file after skipping
+// `nskip`, or if `selection` isn't empty, the first `nevents` of the
+// events in `selection` after skipping `nskip` of those. Either way,
+// the reader goes straight to the entries it wants (see
+// event_selection.h). If `eventIndex` isn't null, it's the index of
+// the input file (see event_index.h), and the entries, including their
+// trigger types, are chosen from it without reading the file
+//
+// `filename` can also be a synthetic input, eg "synthetic:events=20",
+// whose events are made up rather than read (see synthetic_source.h)
+//
+// The events are written out on a thread of their own (see
+// async_writer.h), which can hold `noutputbuffers` events, with the
+// per-event numpy files written with `backend` (see output_file.h).
+// Text output is formatted on `nformatthreads` threads (see
+// text_writer.h)
+//
+// Returns the number of events written
+int
 extract_larsoft_hits(std::string const& tag,
                      std::string const& filename,
                      std::string const& outfile,
                      Format format,
                      int nevents, int nskip,
-                     int triggerType)
+                     EventSelection const& selection,
+                     std::vector<EventIndexEntry> const* eventIndex,
+                     int triggerType,
+                     bool append,
+                     unsigned int nformatthreads,
+                     IoBackend backend,
+                     unsigned int noutputbuffers)
 {
     InputTag daq_tag{ tag };
-    // Create a vector of length 1, containing the given filename.
-    vector<string> filenames(1, filename);
+
+    EventWriter event_writer(outfile, format, append, 0, 1, Sharding::None, backend, nformatthreads);
+    AsyncWriter output(noutputbuffers);
 
     int iev=0;
-    for (gallery::Event ev(filenames); !ev.atEnd(); ev.next()) {
-        vector<vector<int> > samples;
+    std::unique_ptr<EventSource> source=open_event_source(filename);
+    EventSource& ev=*source;
+    const std::vector<long long> entries=eventIndex ?
+        select_indexed_entries(*eventIndex, ev.numberOfEventsInFile(), selection, nskip, triggerType) :
+        select_entries(ev, selection, nskip);
+    for(long long entry: entries){
+        // Each row is (StartTick, EndTick, SummedADC, RMS), with the
+        // channel number in front
+        WaveformMatrix<int> samples(4);
 
-        if(iev<nskip) continue;
-        if(iev>=nevents+nskip) break;
-        if(triggerType!=-1){
-            auto& timestamp=*ev.getValidHandle<std::vector<raw::RDTimeStamp>>(InputTag{"timingrawdecoder:daq:DecoderandReco"});
+        if(iev>=nevents) break;
+        ev.goToEntry(entry);
+        // With an index, the entries already have the right trigger type
+        if(triggerType!=-1 && !eventIndex){
+            auto& timestamp=ev.timestamps(trigger_flags_tag);
             assert(timestamp.size()==1);
             if(timestamp[0].GetFlags()!=triggerType){
                 std::cout << "Skipping event " << ev.eventAuxiliary().event()  << " with trigger type " << timestamp[0].GetFlags() << std::endl;
@@ -115,29 +115,35 @@ extract_larsoft_hits(std::string const& tag,
         //------------------------------------------------------------------
         // Look at the hits
         auto& hits =
-            *ev.getValidHandle<vector<recob::Hit>>(daq_tag);
+            ev.hits(daq_tag);
         if(hits.empty()){
             std::cout << "Hits vector is empty" << std::endl;
         }
+        samples.reserve(hits.size());
         for(auto&& hit: hits){
-            samples.push_back({
-                    (int)hit.Channel(), hit.StartTick(), hit.EndTick(), (int)hit.SummedADC(), (int)hit.RMS()
-                        });
+            int* row=samples.add_row(hit.Channel());
+            row[0]=hit.StartTick();
+            row[1]=hit.EndTick();
+            row[2]=hit.SummedADC();
+            row[3]=hit.RMS();
         } // end loop over digits (=?channels)
-        std::string this_outfile(outfile);
-        size_t dotpos=outfile.find_last_of(".");
-        if(dotpos==std::string::npos){
-            dotpos=outfile.length();
-        }
-        std::ostringstream iss;
-        auto& rdtimestamps=*ev.getValidHandle<std::vector<raw::RDTimeStamp>>(InputTag{"timing:daq:RunRawDecoder"});
-        assert(rdtimestamps.size()==1);
-
-        iss << outfile.substr(0, dotpos) << "_evt" << ev.eventAuxiliary().event() << "_t0x" << std::hex << rdtimestamps[0].GetTimeStamp() << outfile.substr(dotpos, outfile.length()-dotpos);
-        std::cout << "Writing event " << ev.eventAuxiliary().event() << " to file " << iss.str() << std::endl;
-        save_to_file<int>(iss.str(), samples, format, false);
+        std::ostringstream timestampStr;
+        const uint64_t timestamp=event_timestamp(ev, entry, eventIndex);
+        timestampStr << "_t0x" << std::hex << timestamp;
+        const unsigned int event=ev.eventAuxiliary().event();
+        std::cout << "Writing event " << event << " to file " << event_writer.filename(event, timestampStr.str()) << std::endl;
+        // The output thread takes over the rows, so the next event can
+        // be read while these are written
+        auto rows=std::make_shared<WaveformMatrix<int> >(std::move(samples));
+        const std::string suffix=timestampStr.str();
+        output.submit([&event_writer, rows, event, timestamp, suffix](){
+            event_writer.write<int>(event, timestamp, suffix, *rows);
+        });
         ++iev;
     } // end loop over events
+    output.finish();
+    output.print_stats(std::cout);
+    return iev;
 }
 
 int main(int argc, char** argv)
@@ -145,13 +151,25 @@ int main(int argc, char** argv)
     po::options_description desc("Allowed options");
     desc.add_options()
         ("help,h", "produce help message")
-        ("input,i", po::value<string>(), "input file name")
-        ("output,o", po::value<string>(), "base output file name. Individual output files will be created for each event, with \"_evtN\" inserted before the extension, or at the end if there is no extension")
+        ("input,i", po::value<vector<string> >()->multitoken(), "input file name(s). Names with wildcards are expanded as globs. With more than one input file, \"_\" and each input file's name without its extension are inserted before the extension of the output file names")
+        ("input-list", po::value<string>()->default_value(""), "file listing more input files, one per line")
+        ("jobs", po::value<unsigned int>()->default_value(1), "number of input files to process at once, each in a process of its own. 0 means one per core")
+        ("batch-summary", po::value<string>()->default_value(""), "also write the table of events and throughput per input file to this file")
+        ("output,o", po::value<string>(), "base output file name. Individual output files will be created for each event, with \"_evtN\" inserted before the extension, or at the end if there is no extension, unless --container is given")
         ("tag,g", po::value<string>()->default_value("daq"), "input tag (aka \"module label\") of input digits")
         ("nevent,n", po::value<int>()->default_value(1), "number of events to save")
         ("nskip,k", po::value<int>()->default_value(0), "number of events to skip")
+        ("events", po::value<string>(), "only extract these events, given as a comma-separated list of \"[run:[subrun:]]event\", where event can be a range like \"100-200\" and run and subrun can be \"*\". --nskip and --nevent then count the selected events, and all of them are extracted unless --nevent is given")
+        ("event-list", po::value<string>(), "file of events to extract, in the same format as --events, separated by commas or whitespace")
+        ("make-event-index", "instead of extracting events, write an index of the ID, trigger flags and timestamp of each event of each input file, next to it or in --event-index-dir. Later runs then use the index to go straight to the events they want (see event_index.h)")
+        ("event-index-dir", po::value<string>()->default_value(""), "directory for the event indexes, instead of next to the input files")
         ("numpy", "use numpy output format instead of text")
         ("trig", po::value<int>()->default_value(-1), "select events with given trigger type")
+        ("output-backend", po::value<string>()->default_value("stdio"), "how the per-event numpy files are written: \"stdio\", \"direct\" (with O_DIRECT, bypassing the page cache) or \"uring\" (with O_DIRECT through io_uring, if built with -DWITH_IO_URING=ON)")
+        ("output-buffers", po::value<unsigned int>()->default_value(2), "number of events that can be held for the output thread, including the one being written")
+        ("container", "write all events to the single file given by --output, with an index of the events at the end, instead of one file per event. Not the default, since the python readers need one file per event")
+        ("format-threads", po::value<unsigned int>()->default_value(1), "number of threads used to format text output. 0 means one per core")
+        ("append", "with --container, add the events to the end of an existing container file instead of replacing it")
         ;
 
     po::variables_map vm;
@@ -163,26 +181,81 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    if(!vm.count("input")){
+    EventSelection selection;
+    try{
+        if(vm.count("events")) selection.add(vm["events"].as<string>());
+        if(vm.count("event-list")) selection.add_file(vm["event-list"].as<string>());
+    }
+    catch(std::exception const& e){
+        cout << "Invalid event selection: " << e.what() << endl;
+        return 1;
+    }
+    // With a list of events, the default is to extract all of them
+    const int nevents=(!selection.empty() && vm["nevent"].defaulted()) ? std::numeric_limits<int>::max() : vm["nevent"].as<int>();
+
+    IoBackend backend;
+    try{
+        backend=parse_io_backend(vm["output-backend"].as<string>());
+    }
+    catch(std::exception const& e){
+        cout << "Invalid --output-backend: " << e.what() << endl;
+        return 1;
+    }
+
+    std::vector<std::string> inputs;
+    try{
+        inputs=expand_inputs(vm.count("input") ? vm["input"].as<vector<string> >() : vector<string>(),
+                             vm["input-list"].as<string>());
+        check_unique_stems(inputs);
+    }
+    catch(std::exception const& e){
+        cout << e.what() << endl;
+        return 1;
+    }
+    if(inputs.empty()){
         cout << "No input file specified" << endl;
         cout << desc << endl;
         return 1;
     }
+    // With more than one input file, each gets its own output files
+    const bool batch=inputs.size()>1;
 
-    if(!vm.count("output")){
+    if(!vm.count("output") && !vm.count("make-event-index")){
         cout << "No output file specified" << endl;
         cout << desc << endl;
         return 1;
     }
+    if(vm.count("append") && !vm.count("container")){
+        cout << "--append needs --container" << endl;
+        return 1;
+    }
 
-    extract_larsoft_hits(vm["tag"].as<string>(),
-                         vm["input"].as<string>(),
-                         vm["output"].as<string>(),
-                         vm.count("numpy") ? Format::Numpy : Format::Text,
-                         vm["nevent"].as<int>(),
-                         vm["nskip"].as<int>(),
-                         vm["trig"].as<int>());
-    return 0;
+    auto process=[&](std::string const& input)->int64_t{
+        const std::string indexFile=event_index_filename(input, vm["event-index-dir"].as<string>());
+        if(vm.count("make-event-index")){
+            return write_event_index(*open_event_source(input), input, indexFile);
+        }
+        std::vector<EventIndexEntry> eventIndex;
+        const bool useIndex=have_event_index(indexFile);
+        if(useIndex) eventIndex=load_event_index(indexFile);
+        return extract_larsoft_hits(vm["tag"].as<string>(),
+                                    input,
+                                    batch ? batch_output_filename(vm["output"].as<string>(), input) : vm["output"].as<string>(),
+                                    vm.count("container") ? Format::Container :
+                                    vm.count("numpy") ? Format::Numpy : Format::Text,
+                                    nevents,
+                                    vm["nskip"].as<int>(),
+                                    selection,
+                                    useIndex ? &eventIndex : nullptr,
+                                    vm["trig"].as<int>(),
+                                    vm.count("append"),
+                                    default_nthreads(vm["format-threads"].as<unsigned int>()),
+                                    backend,
+                                    vm["output-buffers"].as<unsigned int>());
+    };
+    const auto start=steady_clock::now();
+    const std::vector<BatchResult> results=run_batch(inputs, default_nthreads(vm["jobs"].as<unsigned int>()), process);
+    return report_batch(results, duration<double>(steady_clock::now()-start).count(), vm["batch-summary"].as<string>());
 }
 
 // Local Variables:
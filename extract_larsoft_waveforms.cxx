@@ -1,7 +1,15 @@
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <string>
+#include <thread>
 #include <vector>
 #include <fstream>
 #include <sstream>
@@ -9,14 +17,26 @@
 #include "boost/program_options.hpp"
 
 #include "canvas/Utilities/InputTag.h"
-#include "gallery/Event.h"
 
 #include "lardataobj/Simulation/SimChannel.h"
 #include "lardataobj/RawData/RawDigit.h"
 #include "lardataobj/RawData/raw.h"
 #include "lardataobj/RawData/RDTimeStamp.h"
 
-#include "cnpy.h"
+#include "async_writer.h"
+#include "batch.h"
+#include "channel_index.h"
+#include "event_index.h"
+#include "event_selection.h"
+#include "event_source.h"
+#include "fir_filter.h"
+#include "geometry.h"
+#include "hit_finder.h"
+#include "output.h"
+#include "parallel.h"
+#include "pedestal.h"
+#include "roi.h"
+#include "synthetic_source.h"
 
 using namespace art;
 using namespace std;
@@ -24,175 +44,798 @@ using namespace std::chrono;
 
 namespace po = boost::program_options;
 
-enum class Format { Text, Numpy };
+// The products of one event that the worker threads need. The reader
+// stage copies them out of the EventSource, since it invalidates them
+// as soon as we move on to the next event
+struct EventData
+{
+    // Position of this event in the output. Also used as the event
+    // number in the truth file, as it always has been
+    size_t seq;
+    art::EventNumber_t event;
+    uint64_t timestamp;
+    // Inserted into the output file name after the event number
+    std::string suffix;
+    std::vector<raw::RawDigit> digits;
+    std::vector<sim::SimChannel> simchs;
+};
+
+// The true energy depositions of an event, as one array per column.
+// Entry `i` is the number of electrons that arrived on channel
+// `channels[i]` at tick `tdcs[i]`: either in total, or from track
+// `trackIDs[i]` if track IDs are kept
+struct TruthColumns
+{
+    std::vector<int> channels;
+    std::vector<int> tdcs;
+    std::vector<float> electrons;
+    // Empty unless track IDs are kept
+    std::vector<int> trackIDs;
+
+    size_t size() const { return channels.size(); }
+
+    void resize(size_t n, bool withTrackIDs)
+    {
+        channels.resize(n);
+        tdcs.resize(n);
+        electrons.resize(n);
+        if(withTrackIDs) trackIDs.resize(n);
+    }
+};
 
+// The converted event produced by a worker thread, ready to be written
+struct EventOutput
+{
+    size_t seq;
+    art::EventNumber_t event;
+    uint64_t timestamp;
+    std::string suffix;
+    WaveformMatrix<short> samples;
+    TruthColumns truth;
+    // The electrons arriving at each tick of each row of `samples`
+    WaveformMatrix<float> charge;
+    // The pedestal of each row of `samples`
+    WaveformMatrix<short> pedestals{1};
+    // The hits found in `samples`, in the layout of extract_larsoft_hits
+    WaveformMatrix<int> hits{4};
+    // The ROIs of `samples`, if zero suppression is on, in which case
+    // `samples` itself is emptied once the ROIs have been found
+    SparseWaveforms sparse;
+};
 
-template<class T>
-void save_to_file(std::string const& outfile,
-                  std::vector<std::vector<T> > v,
-                  Format format,
-                  bool append)
+// What process_event does with each event, beyond uncompressing the
+// digits. The first few are set by extract_larsoft_waveforms from the
+// outputs it's asked for (see OutputOptions), and the rest come from
+// the command line
+struct ProcessOptions
 {
-    switch(format){
+    // Fill the truth columns (see process_truth)
+    bool doTruth=false;
+    // Fill the charge matrix (see fill_charge)
+    bool doCharge=false;
+    // Put the rows in order of channel number, rather than the order of the digits
+    bool sortChannels=false;
+    // Find the pedestal of each row (see pedestal.h)
+    bool doPedestals=false;
+
+    // Only write the channels with some true energy deposition, rather
+    // than all of them
+    bool onlySignal=false;
+    // Give the truth a row for each track at each tick, with the track
+    // ID added at the end, rather than one for each tick
+    bool truthTrackIDs=false;
+    // If not null, only the channels in it are uncompressed and
+    // written, and only their truth and charge
+    ChannelMask const* channelMask=nullptr;
+    // Subtract each row's pedestal (its median ADC value, see
+    // pedestal.h) from its samples. Needs `doPedestals`
+    bool pedsub=false;
+    // If positive, zero-suppress the rows (see roi.h), keeping the
+    // ticks at least this far from the pedestal, with `roiPre` ticks
+    // before and `roiPost` ticks after. Each event is then written as
+    // an npz file of ROIs in place of the samples, which needs
+    // Format::NumpySplit. Needs `doPedestals`
+    int roiThreshold=0;
+    int roiPre=0;
+    int roiPost=0;
+    // If positive, find hits in the collection plane rows (see
+    // hit_finder.h) with this threshold above the pedestal. Needs
+    // `doPedestals`
+    int hitThreshold=0;
+    // If not empty, filter the rows with these FIR taps (see
+    // fir_filter.h), after subtracting the pedestal, and before finding
+    // hits and zero-suppressing
+    std::vector<float> firTaps;
+};
 
-    case Format::Text:
+// Per-worker state for uncompressing the digits of an event in
+// parallel. Kept for the lifetime of the worker, so that the threads
+// and the scratch buffers are reused from event to event
+struct DigitWorkspace
+{
+    DigitWorkspace(unsigned int nthreads, std::vector<float> const& firTaps)
+        : pool(nthreads), scratch(pool.size())
     {
-        // Open in append mode because we 
-        std::ofstream fout(outfile, append ? ios::app : ios_base::out);
-        for(auto const& v1 : v){
-            for(auto const& s : v1){
-                fout << s << " ";
+        if(!firTaps.empty()) fir_filters.resize(pool.size(), FirFilter(firTaps));
+    }
+
+    ThreadPool pool;
+    // One uncompression buffer per thread in `pool`
+    std::vector<std::vector<short> > scratch;
+    // One per thread in `pool`
+    std::vector<PedestalFinder> pedestal_finders{pool.size()};
+    // One per thread in `pool`, if there's a FIR filter
+    std::vector<FirFilter> fir_filters;
+};
+
+// Whether `ides[i]` is the first of `ides` from its track
+bool first_of_track(std::vector<sim::IDE> const& ides, size_t i)
+{
+    for(size_t j=0; j<i; ++j){
+        if(ides[j].trackID==ides[i].trackID) return false;
+    }
+    return true;
+}
+
+// Fill `truth` with the electrons arriving at each tick of each of
+// `simchs`, summed over all the IDEs at that tick, or per track if
+// `withTrackIDs` is true. The SimChannels are done in parallel on
+// `pool`: the first pass counts the rows each one needs, so that the
+// second can write each one's rows straight into its own part of the
+// columns
+void process_truth(std::vector<sim::SimChannel const*> const& simchs, bool withTrackIDs,
+                   ThreadPool& pool, TruthColumns& truth)
+{
+    std::vector<size_t> offsets(simchs.size()+1, 0);
+    pool.parallel_for(simchs.size(), [&](size_t isimch, unsigned int){
+        size_t n=0;
+        for(auto const& tdcinfo: simchs[isimch]->TDCIDEMap()){
+            if(!withTrackIDs){ ++n; continue; }
+            auto const& ides=tdcinfo.second;
+            for(size_t i=0; i<ides.size(); ++i) n+=first_of_track(ides, i);
+        }
+        offsets[isimch+1]=n;
+    }, 64);
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    truth.resize(offsets.back(), withTrackIDs);
+    pool.parallel_for(simchs.size(), [&](size_t isimch, unsigned int){
+        const int channel=simchs[isimch]->Channel();
+        size_t row=offsets[isimch];
+        for(auto const& tdcinfo: simchs[isimch]->TDCIDEMap()){
+            auto const& ides=tdcinfo.second;
+            // Each track's first IDE at this tick starts a row, and
+            // takes the electrons of all of the track's IDEs
+            for(size_t i=0; i<ides.size(); ++i){
+                if(withTrackIDs && !first_of_track(ides, i)) continue;
+                double electrons=0;
+                for(size_t j=i; j<ides.size(); ++j){
+                    if(!withTrackIDs || ides[j].trackID==ides[i].trackID){
+                        electrons+=ides[j].numElectrons;
+                    }
+                }
+                truth.channels[row]=channel;
+                truth.tdcs[row]=tdcinfo.first;
+                truth.electrons[row]=electrons;
+                if(withTrackIDs) truth.trackIDs[row]=ides[i].trackID;
+                ++row;
+                if(!withTrackIDs) break;
             }
-            fout << std::endl;
         }
+    }, 64);
+}
+
+// Fill `charge` with the electrons arriving at each tick of each row
+// of `samples`, from `simchs`, so that it lines up with the waveforms
+// row for row and tick for tick. Rows with no SimChannel are all zero.
+// The SimChannels are done in parallel on `pool`, which is safe
+// because each channel has only one SimChannel
+void fill_charge(std::vector<sim::SimChannel const*> const& simchs, WaveformMatrix<short> const& samples,
+                 ThreadPool& pool, WaveformMatrix<float>& charge)
+{
+    charge.nsamples=samples.nsamples;
+    charge.events=samples.events;
+    charge.channels=samples.channels;
+    charge.samples.assign(samples.samples.size(), 0);
+
+    // The row of `samples` that holds each channel, or -1
+    int max_channel=-1;
+    for(int channel: samples.channels) max_channel=std::max(max_channel, channel);
+    std::vector<int> channel_row(max_channel+1, -1);
+    for(size_t i=0; i<samples.channels.size(); ++i){
+        channel_row[samples.channels[i]]=i;
     }
-    break;
-    
-    case Format::Numpy:
-    {
-        // Do nothing if the vector is empty
-        if(v.empty() || v[0].empty()) break;
-        // cnpy needs a single contiguous array of data, so do that conversion
-        std::vector<T> tmp;
-        tmp.reserve(v.size()*v[0].size());
-        for(auto const& v1 : v){
-            for(auto const& s : v1){
-                tmp.push_back(s);
+
+    pool.parallel_for(simchs.size(), [&](size_t isimch, unsigned int){
+        const size_t channel=simchs[isimch]->Channel();
+        if(channel>=channel_row.size() || channel_row[channel]<0) return;
+        float* row=charge.row(channel_row[channel]);
+        for(auto const& tdcinfo: simchs[isimch]->TDCIDEMap()){
+            if(tdcinfo.first>=charge.nsamples) continue;
+            for(sim::IDE const& ide: tdcinfo.second){
+                row[tdcinfo.first]+=ide.numElectrons;
+            }
+        }
+    }, 64);
+}
+
+// Uncompress the digits in `in` and convert them into rows ready to be
+// written out, along with whatever else `opts` asks for. Runs on the
+// worker threads, so must not touch the EventSource
+EventOutput process_event(EventData const& in, ProcessOptions const& opts, DigitWorkspace& ws)
+{
+    ChannelMask const* channelMask=opts.channelMask;
+
+    EventOutput out;
+    out.seq=in.seq;
+    out.event=in.event;
+    out.timestamp=in.timestamp;
+    out.suffix=in.suffix;
+
+    // The channels to write, or null for all of them
+    ChannelMask signalMask;
+    ChannelMask const* wanted=channelMask;
+    if(opts.onlySignal){
+        signalMask.add_channels_of(in.simchs);
+        if(channelMask) signalMask.intersect(*channelMask);
+        wanted=&signalMask;
+    }
+
+    std::vector<sim::SimChannel const*> simchs;
+    for(auto&& simch: in.simchs){
+        if(channelMask && !channelMask->contains(simch.Channel())) continue;
+        simchs.push_back(&simch);
+    }
+    if(opts.doTruth){
+        process_truth(simchs, opts.truthTrackIDs, ws.pool, out.truth);
+    }
+
+    if(in.digits.empty()){
+        std::cout << "Digits vector is empty" << std::endl;
+    }
+
+    // First pass: pick out the digits we're going to write, so that
+    // each one can be given its output row up front
+    std::vector<raw::RawDigit const*> selected;
+    selected.reserve(in.digits.size());
+    size_t waveform_nsamples=0;
+    int n_truncated=0;
+    for(auto&& digit: in.digits){
+
+        // Skip unwanted channels here, so that they're never uncompressed
+        if(wanted && !wanted->contains(digit.Channel())){
+            continue;
+        }
+
+        // Check that the waveform has the same number of samples as all
+        // the previous waveforms. The first one with any samples sets it
+        if(waveform_nsamples==0){ waveform_nsamples=digit.Samples(); }
+        else{
+            if(digit.Samples()!=waveform_nsamples){
+                if(n_truncated<10){
+                    std::cerr << "Channel " << digit.Channel() << " (offline APA " << apa_of_channel(digit.Channel()) << ") has " << digit.Samples() << " samples but all previous channels had " << waveform_nsamples << " samples" << std::endl;
+                }
+                if(n_truncated==100){
+                    std::cerr << "(More errors suppressed)" << std::endl;
+                }
+                ++n_truncated;
             }
         }
-        cnpy::npy_save(outfile, &tmp[0], {v.size(), v[0].size()}, append ? "a" : "w");
+        selected.push_back(&digit);
+    } // end loop over digits (=?channels)
+    if(n_truncated!=0){
+        std::cerr << "Truncated " << n_truncated << " channels with the wrong number of samples" << std::endl;
+    }
+    // Sorting the pointers puts each digit straight into its row in
+    // channel order, so the samples themselves never have to be moved
+    if(opts.sortChannels){
+        std::stable_sort(selected.begin(), selected.end(), [](raw::RawDigit const* a, raw::RawDigit const* b){
+            return a->Channel()<b->Channel();
+        });
     }
-    break;
+
+    // Second pass: uncompress the selected digits in parallel, each
+    // into its own output row. The pedestals are found while the row
+    // is still in cache, and so are the hits, unless there's a filter
+    // to go first
+    out.samples.nsamples=waveform_nsamples;
+    out.samples.resize(selected.size());
+    if(opts.doPedestals) out.pedestals.resize(selected.size());
+    std::vector<std::vector<WaveformHit> > row_hits(opts.hitThreshold>0 ? selected.size() : 0);
+    const bool doFilter=!opts.firTaps.empty();
+    // The level of row `i` away from any signal: the pedestal, unless
+    // it's been subtracted, scaled by the filter's gain at zero frequency
+    const float firGain=std::accumulate(opts.firTaps.begin(), opts.firTaps.end(), 0.f);
+    auto baseline=[&](size_t i)->short{
+        const short pedestal=opts.pedsub ? 0 : out.pedestals.samples[i];
+        return doFilter ? (short)std::lround(pedestal*firGain) : pedestal;
+    };
+    // The hit finder only looks for positive pulses, so it's no use on
+    // the bipolar signals of the induction planes
+    auto findHits=[&](size_t i){
+        return opts.hitThreshold>0 && plane_of_channel(out.samples.channels[i])==Plane::Z;
+    };
+    ws.pool.parallel_for(selected.size(), [&](size_t idigit, unsigned int ithread){
+        raw::RawDigit const& digit=*selected[idigit];
+        // assign() reuses the buffer's existing allocation
+        std::vector<short>& uncompressed=ws.scratch[ithread];
+        uncompressed.assign(digit.Samples(), 0);
+        raw::Uncompress(digit.ADCs(), uncompressed, digit.Compression());
+
+        out.samples.events[idigit]=in.event;
+        out.samples.channels[idigit]=digit.Channel();
+        short* row=out.samples.row(idigit);
+        // A digit with no samples is written as zeros
+        if(uncompressed.empty()){
+            std::fill(row, row+waveform_nsamples, 0);
+        }
+        else{
+            for(size_t i=0; i<waveform_nsamples; ++i){
+                row[i]=uncompressed[ std::min(i, uncompressed.size()-1) ];
+            }
+        }
+
+        if(opts.doPedestals){
+            const short pedestal=ws.pedestal_finders[ithread].median(row, out.samples.nsamples);
+            out.pedestals.events[idigit]=in.event;
+            out.pedestals.channels[idigit]=digit.Channel();
+            out.pedestals.samples[idigit]=pedestal;
+            if(opts.pedsub) subtract_pedestal(row, out.samples.nsamples, pedestal);
+            if(findHits(idigit) && !doFilter){
+                find_hits(row, out.samples.nsamples, baseline(idigit), opts.hitThreshold, row_hits[idigit]);
+            }
+        }
+    }, 16);
+    if(doFilter){
+        fir_filter_rows(out.samples.nrows(), out.samples.nsamples,
+                        [&](size_t i){ return out.samples.row(i); }, ws.fir_filters, ws.pool,
+                        [&](size_t i){
+                            if(findHits(i)){
+                                find_hits(out.samples.row(i), out.samples.nsamples, baseline(i), opts.hitThreshold, row_hits[i]);
+                            }
+                        });
     }
+    if(opts.hitThreshold>0){
+        out.hits=hit_rows(row_hits, out.samples.channels);
+    }
+
+    if(opts.doCharge){
+        fill_charge(simchs, out.samples, ws.pool, out.charge);
+    }
+
+    if(opts.roiThreshold>0){
+        std::vector<short> baselines(out.samples.nrows());
+        for(size_t i=0; i<baselines.size(); ++i) baselines[i]=baseline(i);
+        out.sparse=zero_suppress(out.samples, baselines, opts.roiThreshold, opts.roiPre, opts.roiPost, ws.pool);
+        // Don't hold on to the full waveforms while the event waits to be written
+        std::vector<short>().swap(out.samples.samples);
+    }
+
+    return out;
 }
 
-// Write `nevents` events of data from `filename` to text files. The
-// raw waveforms are written to `outfile`, while the true energy
-// depositions are written to `truth_outfile` (unless it is an empty
-// string, in which case no truth file is produced). If `onlySignal`
-// is true, then only channels with some true energy deposition are
-// written out; otherwise all channels are written out.
-// 
-// Each line in `outfile` has the format:
-//
-// event_no channel_no sample_0 sample_1 ... sample_N
+// The truth for event number `seq` in the row layout of the text and
+// numpy truth files: each row is the event number, the channel number,
+// the tick, the number of electrons, and then the track ID if there is
+// one
+WaveformMatrix<float> truth_rows(TruthColumns const& truth, int seq)
+{
+    const bool withTrackIDs=!truth.trackIDs.empty();
+    WaveformMatrix<float> ret(withTrackIDs ? 3 : 2);
+    ret.resize(truth.size());
+    std::fill(ret.events.begin(), ret.events.end(), seq);
+    ret.channels=truth.channels;
+    for(size_t i=0; i<truth.size(); ++i){
+        float* row=ret.row(i);
+        row[0]=truth.tdcs[i];
+        row[1]=truth.electrons[i];
+        if(withTrackIDs) row[2]=truth.trackIDs[i];
+    }
+    return ret;
+}
+
+// Write the truth as an npz file with an array for each column:
+// "channels", "tdcs", "electrons", and "trackids" if there are track
+// IDs, with `backend` (see output_file.h)
+void save_truth_columns(std::string const& filename, TruthColumns const& truth,
+                        int compressionLevel, unsigned int nthreads, IoBackend backend)
+{
+    std::vector<cnpy::NpzMember> members;
+    members.push_back(cnpy::npz_member("channels", truth.channels.data(), {truth.size()}));
+    members.push_back(cnpy::npz_member("tdcs", truth.tdcs.data(), {truth.size()}));
+    members.push_back(cnpy::npz_member("electrons", truth.electrons.data(), {truth.size()}));
+    if(!truth.trackIDs.empty()){
+        members.push_back(cnpy::npz_member("trackids", truth.trackIDs.data(), {truth.size()}));
+    }
+    save_npz_members(filename, members, compressionLevel, nthreads, backend);
+}
+
+// Where extract_larsoft_waveforms writes its output, and in what form.
+// Each output other than `outfile` is only written if its name isn't
+// empty
+struct OutputOptions
+{
+    Format format=Format::Text;
+    // The raw waveforms. As text, each line has the format:
+    //
+    // event_no channel_no sample_0 sample_1 ... sample_N
+    //
+    // As numpy, a file per event with the samples, and the event and
+    // channel numbers (see output.h). Format::NumpySplit gives an npz
+    // file with the samples as int16 and the numbers in separate
+    // arrays. With Format::Container, all of the events go into this
+    // one file
+    std::string outfile;
+    // The true energy depositions. As text, each line has the format:
+    //
+    // event_no channel_no tdc electrons
+    //
+    // where `electrons` is the number of electrons arriving on the
+    // channel at that tick. With Format::NumpySplit, an npz file per
+    // event, named like the waveform files, with each of those columns
+    // other than the event number as a separate array (see
+    // save_truth_columns). With Format::Container, a container file
+    std::string truth_outfile;
+    // The number of electrons arriving at each tick of each channel, as
+    // a float matrix with the same rows and ticks as the waveforms, in
+    // files named and laid out like the waveform files. This is the
+    // truth as dense labels for the waveforms
+    std::string charge_outfile;
+    // The pedestal of each channel, in files named and laid out like
+    // the waveform files, with one sample per row
+    std::string pedestal_outfile;
+    // The hits found in the waveforms of the collection plane channels
+    // (see ProcessOptions::hitThreshold), in files named like the
+    // waveform files, in the same layout as extract_larsoft_hits
+    std::string hits_outfile;
+    // With Format::Container, add the events to the end of `outfile`
+    // rather than replacing it
+    bool append=false;
+    // Put the RDTimeStamp of each event into its file names, and with
+    // Format::Container, into the index in place of the art event time
+    bool timestampInFilename=false;
+    // With Format::Numpy, give each event's file a channel index next
+    // to it (see channel_index.h), so that readers can find the rows
+    // for particular channels without reading the whole file
+    bool channelIndex=false;
+    // Other than Sharding::None, sort the rows of each event by channel
+    // and split them into one shard per APA and plane, either in
+    // separate files or as separate arrays of the npz file (see
+    // output.h), so that each plane can be read already in channel order
+    Sharding sharding=Sharding::None;
+    // The zlib level that npz files are deflated at
+    int compressionLevel=0;
+    // How the per-event numpy files are written (see output_file.h)
+    IoBackend backend=IoBackend::Stdio;
+};
+
+// Which events of the input extract_larsoft_waveforms writes: the first
+// `nevents` of the file after skipping `nskip`, or if `selection` isn't
+// empty, the first `nevents` of the events in `selection` after
+// skipping `nskip` of those. Either way, the reader goes straight to
+// the entries it wants (see event_selection.h)
+struct SelectionOptions
+{
+    int nevents=0;
+    int nskip=0;
+    EventSelection selection;
+    // If not null, the index of the input file (see event_index.h), from
+    // which the entries, including their trigger types, are chosen
+    // without reading the file
+    std::vector<EventIndexEntry> const* eventIndex=nullptr;
+    // If not -1, only the events with this trigger type are written
+    int triggerType=-1;
+};
+
+// The threads extract_larsoft_waveforms uses at each stage
+struct ThreadOptions
+{
+    // Worker threads that uncompress and convert events
+    unsigned int nthreads=1;
+    // Threads each worker uses to uncompress the digits within its event
+    unsigned int ndigitthreads=1;
+    // Threads used to deflate npz files
+    unsigned int ncompressthreads=1;
+    // Threads used to format text output (see text_writer.h)
+    unsigned int nformatthreads=1;
+    // The number of events the output thread can hold (see async_writer.h)
+    unsigned int noutputbuffers=2;
+};
+
+// Write the events of `filename` picked by `select` to the files in
+// `outputs`, with the digits with tag `tag` processed as in `opts`,
+// apart from the settings that depend on the outputs,
+// which are set here. `filename` can also be a synthetic input, eg
+// "synthetic:events=20", whose events are made up rather than read
+// (see synthetic_source.h)
 //
-// Each line in `truth_outfile` has the format
+// The work is split into a pipeline: this thread reads events from
+// the input file, `threads.nthreads` worker threads uncompress and
+// convert them, and a writer thread puts them back in the order they
+// were read, and hands them to an output thread (see async_writer.h).
+// The stages are linked by bounded queues so that reading, converting
+// and writing of different events overlap
 //
-// event_no channel_no tdc total_charge
-void
+// Returns the number of events written
+int
 extract_larsoft_waveforms(std::string const& tag,
                           std::string const& filename,
-                          std::string const& outfile,
-                          std::string const& truth_outfile,
-                          Format format,
-                          int nevents, int nskip, bool onlySignal,
-                          int triggerType,
-                          bool timestampInFilename)
+                          OutputOptions const& outputs,
+                          SelectionOptions const& select,
+                          ProcessOptions opts,
+                          ThreadOptions const& threads)
 {
     InputTag daq_tag{ tag };
-    // Create a vector of length 1, containing the given filename.
-    vector<string> filenames(1, filename);
 
-    int iev=0;
-    for (gallery::Event ev(filenames); !ev.atEnd(); ev.next()) {
-        vector<vector<int> > samples;
-        vector<vector<float> > trueIDEs;
-
-        std::set<int> channelsWithSignal;
-        if(iev<nskip) continue;
-        if(iev>=nevents+nskip) break;
-        if(triggerType!=-1){
-            auto& timestamp=*ev.getValidHandle<std::vector<raw::RDTimeStamp>>(InputTag{"timingrawdecoder:daq:DecoderandReco"});
-            assert(timestamp.size()==1);
-            if(timestamp[0].GetFlags()!=triggerType){
-                std::cout << "Skipping event " << ev.eventAuxiliary().event()  << " with trigger type " << timestamp[0].GetFlags() << std::endl;
-                continue;
-            }
-            else{
-                std::cout << "Using event " << ev.eventAuxiliary().event()  << " with trigger type " << timestamp[0].GetFlags() << std::endl;
+    const bool doTruth=(outputs.truth_outfile!="");
+    const bool doCharge=(outputs.charge_outfile!="");
+    const bool doPedestals=(outputs.pedestal_outfile!="");
+    const bool doHits=(outputs.hits_outfile!="");
+
+    opts.doTruth=doTruth;
+    opts.doCharge=doCharge;
+    opts.sortChannels=(outputs.sharding!=Sharding::None);
+    opts.doPedestals=doPedestals || opts.pedsub || opts.roiThreshold>0 || doHits;
+    if(!doHits) opts.hitThreshold=0;
+    // Allow a couple of events per worker to be in flight, so that
+    // the workers don't wait on the reader or the writer, without
+    // holding the whole file in memory
+    BoundedQueue<EventData> to_workers(2*threads.nthreads);
+    BoundedQueue<EventOutput> to_writer(2*threads.nthreads);
+    // The workers finish events out of order, and the writer holds on
+    // to each one until the ones before it are done. So that one slow
+    // event can't leave all of the later ones piling up behind it, an
+    // event is only handed out once it's within this many of the next
+    // one to be written
+    const size_t max_in_flight=4*threads.nthreads;
+
+    // The first exception thrown by any stage, to be rethrown here
+    // once all the threads have been shut down
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    // The number of events handed to the output so far. `progress` is
+    // signalled when it goes up, or when there's an error
+    size_t nwritten=0;
+    std::condition_variable progress;
+    auto set_error=[&](std::exception_ptr e){
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if(!error) error=e;
+        progress.notify_all();
+    };
+    auto failed=[&](){
+        std::lock_guard<std::mutex> lock(error_mutex);
+        return bool(error);
+    };
+
+    // Opened here so that we find out about problems with the output
+    // files before doing any work, and before starting any threads, so
+    // that a failure to open one is just an exception for the caller
+    auto open_writer=[&](std::string const& name){
+        return std::unique_ptr<EventWriter>(new EventWriter(name, outputs.format, outputs.append, outputs.compressionLevel, threads.ncompressthreads,
+                                                            outputs.sharding, outputs.backend, threads.nformatthreads));
+    };
+    std::unique_ptr<EventWriter> event_writer=open_writer(outputs.outfile);
+    std::unique_ptr<EventWriter> charge_writer;
+    if(doCharge) charge_writer=open_writer(outputs.charge_outfile);
+    std::unique_ptr<EventWriter> pedestal_writer;
+    if(doPedestals) pedestal_writer=open_writer(outputs.pedestal_outfile);
+    std::unique_ptr<EventWriter> hits_writer;
+    if(doHits) hits_writer=open_writer(outputs.hits_outfile);
+    std::unique_ptr<ContainerWriter> truth_container;
+    if(doTruth && outputs.format==Format::Container){
+        truth_container.reset(new ContainerWriter(outputs.truth_outfile, outputs.append));
+    }
+
+    std::vector<std::thread> workers;
+    for(unsigned int i=0; i<threads.nthreads; ++i){
+        workers.emplace_back([&](){
+            DigitWorkspace ws(threads.ndigitthreads, opts.firTaps);
+            EventData in;
+            while(to_workers.pop(in)){
+                try{
+                    to_writer.push(process_event(in, opts, ws));
+                }
+                catch(...){
+                    set_error(std::current_exception());
+                    to_workers.close();
+                }
             }
+        });
+    }
+
+    // Writes one event's output. Run on the output thread, in the
+    // order the events were read
+    auto write_event=[&](EventOutput const& done){
+        std::cout << "Writing event " << done.event << " to file " << event_writer->filename(done.event, done.suffix) << std::endl;
+        if(opts.roiThreshold>0){
+            save_sparse_waveforms(event_writer->filename(done.event, done.suffix), done.sparse,
+                                  outputs.compressionLevel, threads.ncompressthreads, outputs.backend);
         }
-        std::cout << "Event " << ev.eventAuxiliary().id() << std::endl;
-        if(truth_outfile!=""){
-            //------------------------------------------------------------------
-            // Get the SimChannels so we can see where the actual energy depositions were
-            auto& simchs=*ev.getValidHandle<std::vector<sim::SimChannel>>(InputTag{"largeant"});
-        
-            for(auto&& simch: simchs){
-                channelsWithSignal.insert(simch.Channel());
-                if(truth_outfile!=""){
-                    double charge=0;
-                    for (const auto& TDCinfo: simch.TDCIDEMap()) {
-                        for (const sim::IDE& ide: TDCinfo.second) {
-                            charge += ide.numElectrons;
-                        } // for IDEs
-                        auto const tdc = TDCinfo.first;
-                        trueIDEs.push_back(std::vector<float>{(float)iev, (float)simch.Channel(), (float)tdc, (float)charge});
-                    } // for TDCs
-                } // if fout_truth
-            } // loop over SimChannels
-        }
-
-        int waveform_nsamples=-1;
-        int n_truncated=0;
-        //------------------------------------------------------------------
-        // Look at the digits (ie, TPC waveforms)
-        auto& digits =
-            *ev.getValidHandle<vector<raw::RawDigit>>(daq_tag);
-        if(digits.empty()){
-            std::cout << "Digits vector is empty" << std::endl;
-        }
-        for(auto&& digit: digits){
-
-            if(onlySignal && channelsWithSignal.find(digit.Channel())==channelsWithSignal.end()){
-                continue;
+        else{
+            event_writer->write<int>(done.event, done.timestamp, done.suffix, done.samples);
+        }
+        if(outputs.channelIndex && outputs.format==Format::Numpy && outputs.sharding==Sharding::None){
+            save_channel_index(channel_index_filename(event_writer->filename(done.event, done.suffix)),
+                               make_channel_index(done.samples.channels));
+        }
+        if(charge_writer){
+            charge_writer->write<float>(done.event, done.timestamp, done.suffix, done.charge);
+        }
+        if(hits_writer){
+            hits_writer->write<int>(done.event, done.timestamp, done.suffix, done.hits);
+        }
+        if(pedestal_writer){
+            pedestal_writer->write<int>(done.event, done.timestamp, done.suffix, done.pedestals);
+        }
+        if(truth_container){
+            truth_container->write_event(done.event, done.timestamp, truth_rows(done.truth, done.seq));
+        }
+        // Arrays in an npz file can't be appended to, so
+        // the split format gets a truth file per event
+        else if(doTruth && outputs.format==Format::NumpySplit){
+            save_truth_columns(event_filename(outputs.truth_outfile, done.event, done.suffix), done.truth,
+                               outputs.compressionLevel, threads.ncompressthreads, outputs.backend);
+        }
+        else if(doTruth){
+            save_to_file(outputs.truth_outfile, truth_rows(done.truth, done.seq), outputs.format, done.seq!=0,
+                         outputs.compressionLevel, threads.ncompressthreads, IoBackend::Stdio, threads.nformatthreads);
+        }
+    };
+
+    // The writer thread puts the events back in order and hands them to
+    // the output thread, so that one event is written while the next is
+    // put together
+    AsyncWriter output(threads.noutputbuffers);
+    std::thread writer([&](){
+        // The workers finish events in any order, so hold on to
+        // each one until all of the events before it have been written
+        std::map<size_t, EventOutput> pending;
+        size_t next_seq=0;
+        EventOutput out;
+        while(to_writer.pop(out)){
+            // Once anything has failed, the events still arriving are
+            // dropped, so that the output stops at the failure instead
+            // of having gaps in it. They're still popped, so that the
+            // workers don't wait forever for room
+            if(failed()) continue;
+            pending.emplace(out.seq, std::move(out));
+            for(auto it=pending.find(next_seq); it!=pending.end() && !failed(); it=pending.find(next_seq)){
+                auto done=std::make_shared<EventOutput>(std::move(it->second));
+                pending.erase(it);
+                ++next_seq;
+                try{
+                    output.submit([&write_event, done](){ write_event(*done); });
+                }
+                catch(...){
+                    set_error(std::current_exception());
+                    to_workers.close();
+                }
+                std::lock_guard<std::mutex> lock(error_mutex);
+                nwritten=next_seq;
+                progress.notify_all();
             }
+        }
+        try{
+            output.finish();
+        }
+        catch(...){
+            set_error(std::current_exception());
+        }
+    });
 
-            // Check that the waveform has the same number of samples as all the previous waveforms
-            if(waveform_nsamples<0){ waveform_nsamples=digit.Samples(); }
-            else{
-                if(digit.Samples()!=waveform_nsamples){
-                    if(n_truncated<10){
-                        std::cerr << "Channel " << digit.Channel() << " (offline APA " << (digit.Channel()/2560) << ") has " << digit.Samples() << " samples but all previous channels had " << waveform_nsamples << " samples" << std::endl;
-                    }
-                    if(n_truncated==100){
-                        std::cerr << "(More errors suppressed)" << std::endl;
-                    }
-                    ++n_truncated;
+    int iev=0;
+    try{
+        std::unique_ptr<EventSource> source=open_event_source(filename);
+        EventSource& ev=*source;
+        const std::vector<long long> entries=select.eventIndex ?
+            select_indexed_entries(*select.eventIndex, ev.numberOfEventsInFile(), select.selection, select.nskip, select.triggerType) :
+            select_entries(ev, select.selection, select.nskip);
+        for(long long entry: entries){
+            if(iev>=select.nevents) break;
+            // Wait for room before reading the event
+            {
+                std::unique_lock<std::mutex> lock(error_mutex);
+                progress.wait(lock, [&]{ return error || (size_t)iev<nwritten+max_in_flight; });
+                if(error) break;
+            }
+            ev.goToEntry(entry);
+            // With an index, the entries already have the right trigger type
+            if(select.triggerType!=-1 && !select.eventIndex){
+                auto& timestamp=ev.timestamps(trigger_flags_tag);
+                assert(timestamp.size()==1);
+                if(timestamp[0].GetFlags()!=select.triggerType){
+                    std::cout << "Skipping event " << ev.eventAuxiliary().event()  << " with trigger type " << timestamp[0].GetFlags() << std::endl;
+                    continue;
+                }
+                else{
+                    std::cout << "Using event " << ev.eventAuxiliary().event()  << " with trigger type " << timestamp[0].GetFlags() << std::endl;
                 }
             }
+            std::cout << "Event " << ev.eventAuxiliary().id() << std::endl;
 
-            std::vector<short> uncompressed(digit.Samples(), 0);
-            raw::Uncompress(digit.ADCs(), uncompressed, digit.Compression());
+            EventData data;
+            data.seq=iev;
+            data.event=ev.eventAuxiliary().event();
+            if(doTruth || doCharge || opts.onlySignal){
+                //------------------------------------------------------------------
+                // Get the SimChannels so we can see where the actual energy depositions were
+                data.simchs=ev.sim_channels(InputTag{"largeant"});
+            }
+            //------------------------------------------------------------------
+            // Look at the digits (ie, TPC waveforms)
+            data.digits=ev.raw_digits(daq_tag);
 
-            samples.push_back({(int)ev.eventAuxiliary().event(), (int)digit.Channel()});
-            for(size_t i=0; i<waveform_nsamples; ++i){
-                int sample=uncompressed[ std::min(i, uncompressed.size()-1) ];
-                samples.back().push_back(sample);
+            std::ostringstream timestampStr;
+            data.timestamp=ev.eventAuxiliary().time().value();
+            if(outputs.timestampInFilename){
+                data.timestamp=event_timestamp(ev, entry, select.eventIndex);
+                timestampStr << "_t0x" << std::hex << data.timestamp;
             }
-        } // end loop over digits (=?channels)
-        if(n_truncated!=0){
-            std::cerr << "Truncated " << n_truncated << " channels with the wrong number of samples" << std::endl;
-        }
-        std::string this_outfile(outfile);
-        size_t dotpos=outfile.find_last_of(".");
-        if(dotpos==std::string::npos){
-            dotpos=outfile.length();
-        }
-        std::ostringstream iss, timestampStr;
-        if(timestampInFilename){
-            auto& rdtimestamps=*ev.getValidHandle<std::vector<raw::RDTimeStamp>>(InputTag{"timing:daq:RunRawDecoder"});
-            assert(rdtimestamps.size()==1);
-            // std::cout << "eventAuxiliary value is " << ev.eventAuxiliary().time().value() << std::endl;
-            timestampStr << "_t0x" << std::hex << rdtimestamps[0].GetTimeStamp();
-        }
-        iss << outfile.substr(0, dotpos) << "_evt" << ev.eventAuxiliary().event() << timestampStr.str() <<  outfile.substr(dotpos, outfile.length()-dotpos);
-        std::cout << "Writing event " << ev.eventAuxiliary().event() << " to file " << iss.str() << std::endl;
-        save_to_file<int>(iss.str(), samples, format, false);
-        if(truth_outfile!="") save_to_file<float>(truth_outfile, trueIDEs, format, iev!=0);
-        ++iev;
-    } // end loop over events
+            data.suffix=timestampStr.str();
+
+            // push() only fails if a later stage has given up
+            if(!to_workers.push(std::move(data))) break;
+            ++iev;
+        } // end loop over events
+    }
+    catch(...){
+        set_error(std::current_exception());
+    }
+
+    to_workers.close();
+    for(auto& w: workers) w.join();
+    to_writer.close();
+    writer.join();
+    output.print_stats(std::cout);
+
+    if(error) std::rethrow_exception(error);
+    return iev;
+}
+
+// The channels of the APAs in `apas`, a list of numbers and ranges
+// like "1,3-5" (or all APAs if it's empty), and the planes in
+// `planes`, a list like "u,z" (or all planes if it's empty). For the
+// collection plane, only the wires on `face` are included. Throws if
+// any of them can't be parsed
+ChannelMask make_channel_mask(std::string const& apas, std::string const& planes, std::string const& face)
+{
+    std::vector<int> apaList;
+    std::istringstream apaStream(apas);
+    for(std::string item; std::getline(apaStream, item, ','); ){
+        size_t dash=item.find('-');
+        int first=std::stoi(item.substr(0, dash));
+        int last=(dash==std::string::npos) ? first : std::stoi(item.substr(dash+1));
+        for(int apa=first; apa<=last; ++apa) apaList.push_back(apa);
+    }
+    if(apas.empty()){
+        for(int apa=0; apa<max_napas; ++apa) apaList.push_back(apa);
+    }
+
+    std::vector<Plane> planeList;
+    std::istringstream planeStream(planes);
+    for(std::string item; std::getline(planeStream, item, ','); ){
+        if(item=="u") planeList.push_back(Plane::U);
+        else if(item=="v") planeList.push_back(Plane::V);
+        else if(item=="z") planeList.push_back(Plane::Z);
+        else throw std::invalid_argument("unknown plane \""+item+"\"");
+    }
+    if(planes.empty()){
+        planeList={Plane::U, Plane::V, Plane::Z};
+    }
+
+    Face faceValue;
+    if(face=="both") faceValue=Face::Both;
+    else if(face=="wall") faceValue=Face::Wall;
+    else if(face=="cryo") faceValue=Face::Cryo;
+    else throw std::invalid_argument("unknown face \""+face+"\"");
+
+    ChannelMask ret;
+    for(int apa: apaList){
+        for(Plane plane: planeList){
+            ret.add_plane(apa, plane, faceValue);
+        }
+    }
+    return ret;
 }
 
 int main(int argc, char** argv)
@@ -200,16 +843,50 @@ int main(int argc, char** argv)
     po::options_description desc("Allowed options");
     desc.add_options()
         ("help,h", "produce help message")
-        ("input,i", po::value<string>(), "input file name")
-        ("output,o", po::value<string>(), "base output file name. Individual output files will be created for each event, with \"_evtN\" inserted before the extension, or at the end if there is no extension")
+        ("input,i", po::value<vector<string> >()->multitoken(), "input file name(s). Names with wildcards are expanded as globs. With more than one input file, \"_\" and each input file's name without its extension are inserted before the extension of the output file names")
+        ("input-list", po::value<string>()->default_value(""), "file listing more input files, one per line")
+        ("jobs", po::value<unsigned int>()->default_value(1), "number of input files to process at once, each in a process of its own. 0 means one per core")
+        ("batch-summary", po::value<string>()->default_value(""), "also write the table of events and throughput per input file to this file")
+        ("output,o", po::value<string>(), "base output file name. Individual output files will be created for each event, with \"_evtN\" inserted before the extension, or at the end if there is no extension, unless --container is given")
         ("truth,t", po::value<string>()->default_value(""), "truth output file name")
+        ("truth-trackid", "with --truth, write the electrons from each track at each tick separately, with the track ID")
+        ("pedsub", "subtract each channel's pedestal (its median ADC value) from its samples")
+        ("pedestals", po::value<string>()->default_value(""), "base output file name for the pedestal of each channel, with one row per channel as for --output")
+        ("hits", po::value<string>()->default_value(""), "base output file name for hits found in the waveforms of the collection plane channels, in the same layout as extract_larsoft_hits. Files are named as for --output")
+        ("hit-threshold", po::value<int>()->default_value(20), "threshold for --hits, in ADC counts above the pedestal")
+        ("roi-threshold", po::value<int>()->default_value(0), "with --split, zero-suppress the waveforms, keeping only the regions of interest around ticks at least this many ADC counts from the pedestal. 0 means write every tick")
+        ("roi-pre", po::value<int>()->default_value(10), "number of ticks to keep before each region of interest")
+        ("roi-post", po::value<int>()->default_value(10), "number of ticks to keep after each region of interest")
+        ("fir-taps", po::value<string>(), "filter the waveforms, after --pedsub and before --hits and --roi-threshold, with a FIR filter whose taps are the whitespace-separated numbers in this file")
+        ("fir-lowpass", po::value<unsigned int>(), "filter the waveforms with a windowed-sinc low-pass FIR filter with this many taps, like scipy.signal.firwin, instead of --fir-taps")
+        ("fir-cutoff", po::value<double>()->default_value(0.1), "cutoff of --fir-lowpass, as a fraction of the Nyquist frequency")
+        ("charge", po::value<string>()->default_value(""), "base output file name for the true charge at each tick of each channel, as a matrix matching the waveforms row for row. Files are named and laid out as for --output")
         ("tag,g", po::value<string>()->default_value("daq"), "input tag (aka \"module label\") of input digits")
         ("nevent,n", po::value<int>()->default_value(1), "number of events to save")
         ("nskip,k", po::value<int>()->default_value(0), "number of events to skip")
+        ("events", po::value<string>(), "only extract these events, given as a comma-separated list of \"[run:[subrun:]]event\", where event can be a range like \"100-200\" and run and subrun can be \"*\". --nskip and --nevent then count the selected events, and all of them are extracted unless --nevent is given")
+        ("event-list", po::value<string>(), "file of events to extract, in the same format as --events, separated by commas or whitespace")
+        ("make-event-index", "instead of extracting events, write an index of the ID, trigger flags and timestamp of each event of each input file, next to it or in --event-index-dir. Later runs then use the index to go straight to the events they want (see event_index.h)")
+        ("event-index-dir", po::value<string>()->default_value(""), "directory for the event indexes, instead of next to the input files")
         ("numpy", "use numpy output format instead of text")
+        ("split", "use numpy npz output format with the samples stored as int16 in an array \"samples\", and the event and channel numbers in separate arrays \"events\" and \"channels\"")
         ("onlysignal", "only output channels with true signal")
         ("trig", po::value<int>()->default_value(-1), "select events with given trigger type")
         ("ts", "add event timestamp to filename")
+        ("threads,j", po::value<unsigned int>()->default_value(4), "number of worker threads used to uncompress and convert events. Each one holds a few events in memory. 0 means the cores shared between the --jobs")
+        ("digit-threads", po::value<unsigned int>()->default_value(1), "number of threads each worker uses to uncompress the digits within an event. 0 means one per core")
+        ("output-backend", po::value<string>()->default_value("stdio"), "how the per-event numpy and split numpy files are written: \"stdio\", \"direct\" (with O_DIRECT, bypassing the page cache) or \"uring\" (with O_DIRECT through io_uring, if built with -DWITH_IO_URING=ON)")
+        ("output-buffers", po::value<unsigned int>()->default_value(2), "number of events that can be held for the output thread, including the one being written")
+        ("container", "write all events to the single file given by --output, with an index of the events at the end, instead of one file per event. Samples are stored as int16. Not the default, since the python readers, --split, --shard, --roi-threshold and --channel-index need one file per event")
+        ("append", "with --container, add the events to the end of an existing container file instead of replacing it")
+        ("compress", po::value<int>()->default_value(0), "zlib compression level (1-9) for --split output. 0 means no compression")
+        ("compress-threads", po::value<unsigned int>()->default_value(0), "number of threads used to compress --split output. 0 means the cores shared between the --jobs")
+        ("format-threads", po::value<unsigned int>()->default_value(1), "number of threads used to format text output. 0 means one per core")
+        ("apa", po::value<string>(), "only write the channels of these APAs, given as a comma-separated list of numbers and ranges, eg \"1,3-5\". --apa, --plane and --face also restrict the truth, charge and --onlysignal outputs to the selected channels")
+        ("plane", po::value<string>(), "only write the channels of these planes (any of u, v and z, separated by commas)")
+        ("face", po::value<string>()->default_value("both"), "with --apa, or --plane including z, only write the collection wires on this face of each APA: wall, cryo or both")
+        ("channel-index", "with --numpy, also write an index of which row holds each channel next to each event's file, with \"_chidx\" inserted before the extension")
+        ("shard", po::value<string>(), "sort each event's rows by channel and split them by APA and plane: \"files\" writes each plane to its own file, with eg \"_apa3_z\" inserted before the extension, and \"arrays\" (with --split) writes each plane as separate arrays in the npz file, eg \"apa3_z_samples\"")
         ;
 
     po::variables_map vm;
@@ -221,29 +898,205 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    if(!vm.count("input")){
+    EventSelection selection;
+    try{
+        if(vm.count("events")) selection.add(vm["events"].as<string>());
+        if(vm.count("event-list")) selection.add_file(vm["event-list"].as<string>());
+    }
+    catch(std::exception const& e){
+        cout << "Invalid event selection: " << e.what() << endl;
+        return 1;
+    }
+    // With a list of events, the default is to extract all of them
+    const int nevents=(!selection.empty() && vm["nevent"].defaulted()) ? std::numeric_limits<int>::max() : vm["nevent"].as<int>();
+
+    IoBackend backend;
+    try{
+        backend=parse_io_backend(vm["output-backend"].as<string>());
+    }
+    catch(std::exception const& e){
+        cout << "Invalid --output-backend: " << e.what() << endl;
+        return 1;
+    }
+
+    std::vector<std::string> inputs;
+    try{
+        inputs=expand_inputs(vm.count("input") ? vm["input"].as<vector<string> >() : vector<string>(),
+                             vm["input-list"].as<string>());
+        check_unique_stems(inputs);
+    }
+    catch(std::exception const& e){
+        cout << e.what() << endl;
+        return 1;
+    }
+    if(inputs.empty()){
         cout << "No input file specified" << endl;
         cout << desc << endl;
         return 1;
     }
+    // With more than one input file, each gets its own output files
+    const bool batch=inputs.size()>1;
 
-    if(!vm.count("output")){
+    if(!vm.count("output") && !vm.count("make-event-index")){
         cout << "No output file specified" << endl;
         cout << desc << endl;
         return 1;
     }
 
-    extract_larsoft_waveforms(vm["tag"].as<string>(),
-                              vm["input"].as<string>(),
-                              vm["output"].as<string>(),
-                              vm["truth"].as<string>(),
-                              vm.count("numpy") ? Format::Numpy : Format::Text,
-                              vm["nevent"].as<int>(),
-                              vm["nskip"].as<int>(),
-                              vm.count("onlysignal"),
-                              vm["trig"].as<int>(),
-                              vm.count("ts"));
-    return 0;
+    // Channels not selected by --apa and --plane are never uncompressed
+    ChannelMask channelMask;
+    const bool useMask=vm.count("apa") || vm.count("plane");
+    // Whether the collection plane is selected
+    bool withZ=!vm.count("plane");
+    std::istringstream planes(vm.count("plane") ? vm["plane"].as<string>() : "");
+    for(std::string item; std::getline(planes, item, ','); ){
+        if(item=="z") withZ=true;
+    }
+    // --face only picks between the collection wires of the selected
+    // planes, so on its own, or without the collection plane, it would
+    // do nothing
+    if(vm["face"].as<string>()!="both" && (!useMask || !withZ)){
+        cout << "--face needs --apa, or --plane including z" << endl;
+        return 1;
+    }
+    // Hits are only found on the collection plane
+    if(vm["hits"].as<string>()!="" && !withZ){
+        cout << "--hits needs --plane to include z" << endl;
+        return 1;
+    }
+    if(useMask){
+        try{
+            channelMask=make_channel_mask(vm.count("apa") ? vm["apa"].as<string>() : "",
+                                          vm.count("plane") ? vm["plane"].as<string>() : "",
+                                          vm["face"].as<string>());
+        }
+        catch(std::exception const& e){
+            cout << "Invalid channel selection: " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    if(vm.count("append") && !vm.count("container")){
+        cout << "--append needs --container" << endl;
+        return 1;
+    }
+    if(vm.count("channel-index") && (!vm.count("numpy") || vm.count("split") || vm.count("container") || vm.count("shard"))){
+        cout << "--channel-index needs --numpy, and can't be used with --split, --container or --shard" << endl;
+        return 1;
+    }
+    if(vm["roi-threshold"].as<int>()>0 && (!vm.count("split") || vm.count("container") || vm.count("shard"))){
+        cout << "--roi-threshold needs --split, and can't be used with --container or --shard" << endl;
+        return 1;
+    }
+    if(vm["hits"].as<string>()!="" && vm["hit-threshold"].as<int>()<=0){
+        cout << "--hit-threshold must be positive" << endl;
+        return 1;
+    }
+    if(vm["roi-pre"].as<int>()<0 || vm["roi-post"].as<int>()<0){
+        cout << "--roi-pre and --roi-post can't be negative" << endl;
+        return 1;
+    }
+
+    std::vector<float> firTaps;
+    try{
+        if(vm.count("fir-taps") && vm.count("fir-lowpass")){
+            throw std::invalid_argument("--fir-taps and --fir-lowpass can't both be given");
+        }
+        if(vm.count("fir-taps")){
+            firTaps=read_fir_taps(vm["fir-taps"].as<string>());
+        }
+        if(vm.count("fir-lowpass")){
+            firTaps=lowpass_fir_taps(vm["fir-lowpass"].as<unsigned int>(), vm["fir-cutoff"].as<double>());
+        }
+    }
+    catch(std::exception const& e){
+        cout << "Invalid FIR filter: " << e.what() << endl;
+        return 1;
+    }
+
+    Sharding sharding=Sharding::None;
+    if(vm.count("shard")){
+        const string shard=vm["shard"].as<string>();
+        if(shard=="files") sharding=Sharding::Files;
+        else if(shard=="arrays") sharding=Sharding::Arrays;
+        else{
+            cout << "Unknown --shard mode \"" << shard << "\"" << endl;
+            return 1;
+        }
+        if(vm.count("container")){
+            cout << "--shard can't be used with --container" << endl;
+            return 1;
+        }
+        if(sharding==Sharding::Arrays && !vm.count("split")){
+            cout << "--shard arrays needs --split" << endl;
+            return 1;
+        }
+    }
+
+    // The jobs run at once share the cores between them, so that
+    // "one per core" thread counts don't oversubscribe the machine
+    const unsigned int njobs=std::min<size_t>(default_nthreads(vm["jobs"].as<unsigned int>()), inputs.size());
+
+    OutputOptions outputs;
+    outputs.format=vm.count("container") ? Format::Container :
+                   vm.count("split") ? Format::NumpySplit :
+                   vm.count("numpy") ? Format::Numpy : Format::Text;
+    outputs.append=vm.count("append");
+    outputs.timestampInFilename=vm.count("ts");
+    outputs.channelIndex=vm.count("channel-index");
+    outputs.sharding=sharding;
+    outputs.compressionLevel=vm["compress"].as<int>();
+    outputs.backend=backend;
+
+    SelectionOptions select;
+    select.nevents=nevents;
+    select.nskip=vm["nskip"].as<int>();
+    select.selection=selection;
+    select.triggerType=vm["trig"].as<int>();
+
+    ProcessOptions processing;
+    processing.onlySignal=vm.count("onlysignal");
+    processing.truthTrackIDs=vm.count("truth-trackid");
+    processing.channelMask=useMask ? &channelMask : nullptr;
+    processing.pedsub=vm.count("pedsub");
+    processing.roiThreshold=vm["roi-threshold"].as<int>();
+    processing.roiPre=vm["roi-pre"].as<int>();
+    processing.roiPost=vm["roi-post"].as<int>();
+    processing.hitThreshold=vm["hit-threshold"].as<int>();
+    processing.firTaps=firTaps;
+
+    ThreadOptions threads;
+    threads.nthreads=default_nthreads(vm["threads"].as<unsigned int>(), njobs);
+    threads.ndigitthreads=default_nthreads(vm["digit-threads"].as<unsigned int>());
+    threads.ncompressthreads=default_nthreads(vm["compress-threads"].as<unsigned int>(), njobs);
+    threads.nformatthreads=default_nthreads(vm["format-threads"].as<unsigned int>());
+    threads.noutputbuffers=vm["output-buffers"].as<unsigned int>();
+
+    auto process=[&](std::string const& input)->int64_t{
+        auto outname=[&](std::string const& outfile){
+            return batch ? batch_output_filename(outfile, input) : outfile;
+        };
+        const std::string indexFile=event_index_filename(input, vm["event-index-dir"].as<string>());
+        if(vm.count("make-event-index")){
+            return write_event_index(*open_event_source(input), input, indexFile);
+        }
+        std::vector<EventIndexEntry> eventIndex;
+        SelectionOptions inputSelect=select;
+        if(have_event_index(indexFile)){
+            eventIndex=load_event_index(indexFile);
+            inputSelect.eventIndex=&eventIndex;
+        }
+        OutputOptions inputOutputs=outputs;
+        inputOutputs.outfile=outname(vm["output"].as<string>());
+        inputOutputs.truth_outfile=outname(vm["truth"].as<string>());
+        inputOutputs.charge_outfile=outname(vm["charge"].as<string>());
+        inputOutputs.pedestal_outfile=outname(vm["pedestals"].as<string>());
+        inputOutputs.hits_outfile=outname(vm["hits"].as<string>());
+        return extract_larsoft_waveforms(vm["tag"].as<string>(), input, inputOutputs, inputSelect, processing, threads);
+    };
+    const auto start=steady_clock::now();
+    const std::vector<BatchResult> results=run_batch(inputs, njobs, process);
+    return report_batch(results, duration<double>(steady_clock::now()-start).count(), vm["batch-summary"].as<string>());
 }
 
 // Local Variables:
@@ -0,0 +1,194 @@
+#ifndef FIR_FILTER_H
+#define FIR_FILTER_H
+
+// FIR filtering of waveforms, eg the low-pass filters that
+// waveform_utils.make_filter designs in python
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "parallel.h"
+#include "waveform_matrix.h"
+
+// The taps of a low-pass filter with `ntaps` taps and cutoff `cutoff`
+// as a fraction of the Nyquist frequency, designed by windowing a sinc
+// with a Hamming window and scaling to unit gain at zero frequency.
+// These are the same taps as scipy.signal.firwin(ntaps, cutoff) gives
+inline std::vector<float> lowpass_fir_taps(size_t ntaps, double cutoff)
+{
+    if(ntaps==0 || cutoff<=0 || cutoff>=1){
+        throw std::runtime_error("lowpass_fir_taps: need at least one tap and a cutoff between 0 and 1");
+    }
+    std::vector<double> taps(ntaps);
+    double sum=0;
+    for(size_t k=0; k<ntaps; ++k){
+        const double m=k-0.5*(ntaps-1);
+        const double x=M_PI*cutoff*m;
+        const double sinc=(m==0) ? 1 : std::sin(x)/x;
+        const double window=(ntaps==1) ? 1 : 0.54-0.46*std::cos(2*M_PI*k/(ntaps-1));
+        taps[k]=cutoff*sinc*window;
+        sum+=taps[k];
+    }
+    std::vector<float> ret(ntaps);
+    for(size_t k=0; k<ntaps; ++k) ret[k]=taps[k]/sum;
+    return ret;
+}
+
+// The taps in the text file `filename`: whitespace-separated numbers
+inline std::vector<float> read_fir_taps(std::string const& filename)
+{
+    std::ifstream fin(filename);
+    if(!fin){
+        throw std::runtime_error("Unable to open FIR taps file "+filename);
+    }
+    std::vector<float> ret;
+    float tap;
+    while(fin >> tap) ret.push_back(tap);
+    if(!fin.eof() || ret.empty()){
+        throw std::runtime_error("FIR taps file "+filename+" should contain only numbers");
+    }
+    return ret;
+}
+
+// Applies a FIR filter to rows of samples, in place. Each output tick
+// is centred on the input tick, ie, tick `i` of the output is the sum
+// of taps[k]*input[i+delay()-k], so that for symmetric taps the
+// waveform isn't shifted in time. Ticks off either end of the input
+// are taken to have the value of the nearest end tick.
+//
+// Several rows are filtered at once: they're copied into a buffer with
+// the rows interleaved tick by tick, so that the innermost loop runs
+// across the rows with a fixed length, so that it can be vectorized.
+// The buffer is reused from call to call, so use one FirFilter per thread
+class FirFilter
+{
+public:
+    // The number of rows filtered at once
+    static constexpr size_t lanes=16;
+    // The number of output ticks worked on at once
+    static constexpr size_t tile_ticks=256;
+
+    explicit FirFilter(std::vector<float> taps)
+        : m_taps(std::move(taps)), m_acc(tile_ticks*lanes)
+    {
+        if(m_taps.empty()){
+            throw std::runtime_error("FirFilter: need at least one tap");
+        }
+    }
+
+    size_t ntaps() const { return m_taps.size(); }
+    size_t delay() const { return (m_taps.size()-1)/2; }
+
+    // Filter the `nrows` rows at `rows`, which have `nsamples` samples
+    // each. Integer samples are rounded to the nearest value that fits
+    template<class T>
+    void filter_rows(T* const* rows, size_t nrows, size_t nsamples)
+    {
+        if(nsamples==0) return;
+        // The input ticks that the output ticks need run from
+        // -(ntaps-1-delay) to nsamples-1+delay
+        const size_t before=ntaps()-1-delay();
+        const size_t nticks=before+nsamples+delay();
+        m_buffer.resize(nticks*lanes);
+
+        for(size_t first=0; first<nrows; first+=lanes){
+            const size_t nlanes=std::min(lanes, nrows-first);
+            // Unused lanes get a copy of the first row, so that every
+            // lane holds ordinary numbers
+            for(size_t lane=0; lane<lanes; ++lane){
+                const T* row=rows[first+(lane<nlanes ? lane : 0)];
+                for(size_t t=0; t<nticks; ++t){
+                    const size_t tick=std::min(nsamples-1, t>before ? t-before : 0);
+                    m_buffer[t*lanes+lane]=row[tick];
+                }
+            }
+
+            // Each tap adds a multiple of a run of the buffer to a
+            // whole tile of output ticks at once, over a tile small
+            // enough to stay in cache
+            for(size_t tile=0; tile<nsamples; tile+=tile_ticks){
+                const size_t ntile=std::min(tile_ticks, nsamples-tile);
+                std::fill(m_acc.begin(), m_acc.end(), 0.f);
+                for(size_t k=0; k<ntaps(); ++k){
+                    // Output tick i needs buffer tick i+ntaps-1-k
+                    accumulate(m_acc.data(), m_buffer.data()+(tile+ntaps()-1-k)*lanes, m_taps[k], ntile);
+                }
+                for(size_t i=0; i<ntile; ++i){
+                    for(size_t lane=0; lane<nlanes; ++lane){
+                        rows[first+lane][tile+i]=convert<T>(m_acc[i*lanes+lane]);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    // acc[i] += tap*x[i] for `nticks` ticks of all the lanes. The loop
+    // over the lanes has a fixed length, so the compiler can vectorize
+    // it, and saying that `acc` and `x` don't overlap saves it checking
+    // at run time
+    static void accumulate(float* __restrict acc, const float* __restrict x, float tap, size_t nticks)
+    {
+        for(size_t i=0; i<nticks; ++i){
+            for(size_t lane=0; lane<lanes; ++lane){
+                acc[i*lanes+lane]+=tap*x[i*lanes+lane];
+            }
+        }
+    }
+
+    template<class T>
+    static T convert(float value)
+    {
+        if constexpr(std::is_integral<T>::value){
+            const float lo=std::numeric_limits<T>::min();
+            const float hi=std::numeric_limits<T>::max();
+            return (T)std::lround(std::min(hi, std::max(lo, value)));
+        }
+        else{
+            return value;
+        }
+    }
+
+    std::vector<float> m_taps;
+    std::vector<float> m_buffer;
+    std::vector<float> m_acc;
+};
+
+// Filter the `nrows` rows `row(i)`, which have `nsamples` samples
+// each, in groups of FirFilter::lanes rows split between the threads of
+// `pool`, using `filters[ithread]` on thread `ithread`. Then `after(i)`
+// is called on the same thread for each row `i` of the group, while the
+// row is still in cache
+template<class R, class F>
+void fir_filter_rows(size_t nrows, size_t nsamples, R&& row, std::vector<FirFilter>& filters,
+                     ThreadPool& pool, F&& after)
+{
+    using T=typename std::remove_pointer<decltype(row(size_t(0)))>::type;
+    const size_t ngroups=(nrows+FirFilter::lanes-1)/FirFilter::lanes;
+    pool.parallel_for(ngroups, [&](size_t igroup, unsigned int ithread){
+        const size_t first=igroup*FirFilter::lanes;
+        const size_t n=std::min(FirFilter::lanes, nrows-first);
+        T* rows[FirFilter::lanes];
+        for(size_t i=0; i<n; ++i) rows[i]=row(first+i);
+        filters[ithread].filter_rows(rows, n, nsamples);
+        for(size_t i=0; i<n; ++i) after(first+i);
+    });
+}
+
+// Filter every row of `m` with `taps`, with the rows split between the
+// threads of `pool`
+template<class T>
+void fir_filter(WaveformMatrix<T>& m, std::vector<float> const& taps, ThreadPool& pool)
+{
+    std::vector<FirFilter> filters(pool.size(), FirFilter(taps));
+    fir_filter_rows(m.nrows(), m.nsamples, [&](size_t i){ return m.row(i); }, filters, pool, [](size_t){});
+}
+
+#endif // include guard
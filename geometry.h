@@ -0,0 +1,148 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+// The ProtoDUNE-SP offline channel map, and ChannelMask, a set of
+// channels that can be built from parts of the detector
+
+#include <cstdint>
+#include <utility> // for std::pair
+#include <vector>
+
+// Each APA has 2560 channels: the U plane, then the V plane, then the
+// collection (Z) plane. The collection plane has wires on both faces
+// of the APA, 480 on each: on even-numbered APAs the wall-facing wires
+// come first, and on odd-numbered APAs the cryostat-facing ones do
+constexpr int channels_per_apa=2560;
+constexpr int channels_per_collection_face=480;
+
+// ProtoDUNE-SP has 6 APAs. Much of the MC uses the 1x2x6 far detector
+// workspace geometry instead, which has 12 APAs, numbered the same way
+constexpr int protodune_napas=6;
+constexpr int workspace_napas=12;
+constexpr int max_napas=workspace_napas;
+
+enum class Plane { U, V, Z };
+
+// Which face of the APA, for the collection plane
+enum class Face { Both, Wall, Cryo };
+
+constexpr const char* plane_name(Plane plane)
+{
+    return plane==Plane::U ? "u" : plane==Plane::V ? "v" : "z";
+}
+
+constexpr int plane_first_channel(Plane plane)
+{
+    return plane==Plane::U ? 0 : plane==Plane::V ? 800 : 1600;
+}
+
+constexpr int plane_nchannels(Plane plane)
+{
+    return plane==Plane::Z ? 960 : 800;
+}
+
+constexpr int apa_of_channel(int channel)
+{
+    return channel/channels_per_apa;
+}
+
+constexpr Plane plane_of_channel(int channel)
+{
+    return channel%channels_per_apa<plane_first_channel(Plane::V) ? Plane::U :
+           channel%channels_per_apa<plane_first_channel(Plane::Z) ? Plane::V : Plane::Z;
+}
+
+// The channel numbers [first, last) of `plane` on APA `apa`. For the
+// collection plane, `face` picks the wires on one face of the APA
+constexpr std::pair<int, int> plane_channel_range(int apa, Plane plane, Face face=Face::Both)
+{
+    const int first=apa*channels_per_apa+plane_first_channel(plane);
+    const bool wall_first=(apa%2==0);
+    return (plane!=Plane::Z || face==Face::Both) ? std::pair<int, int>(first, first+plane_nchannels(plane)) :
+           ((face==Face::Wall)==wall_first) ? std::pair<int, int>(first, first+channels_per_collection_face) :
+           std::pair<int, int>(first+channels_per_collection_face, first+2*channels_per_collection_face);
+}
+
+static_assert(plane_first_channel(Plane::Z)+plane_nchannels(Plane::Z)==channels_per_apa, "The planes must fill the APA");
+static_assert(plane_channel_range(1, Plane::Z, Face::Wall).first==channels_per_apa+2080, "Odd APAs have their wall-facing wires second");
+
+// A set of channel numbers, stored as one bit per channel, so that
+// checking whether a channel is in it is a shift and a mask. Channels
+// beyond the highest one added, and negative channels, are not in it
+class ChannelMask
+{
+public:
+    bool contains(int channel) const
+    {
+        const uint64_t c=(uint32_t)channel;
+        return channel>=0 && c<m_nbits && ((m_bits[c>>6]>>(c&63))&1);
+    }
+
+    bool empty() const
+    {
+        for(uint64_t word: m_bits) if(word) return false;
+        return true;
+    }
+
+    ChannelMask& add(int channel)
+    {
+        if(channel<0) return *this;
+        grow(channel+1);
+        m_bits[channel>>6]|=uint64_t(1)<<(channel&63);
+        return *this;
+    }
+
+    // Add the channels [first, last)
+    ChannelMask& add_range(int first, int last)
+    {
+        if(first<0) first=0;
+        if(last<=first) return *this;
+        grow(last);
+        for(int c=first; c<last; ++c){
+            m_bits[c>>6]|=uint64_t(1)<<(c&63);
+        }
+        return *this;
+    }
+
+    ChannelMask& add_apa(int apa)
+    {
+        return add_range(apa*channels_per_apa, (apa+1)*channels_per_apa);
+    }
+
+    ChannelMask& add_plane(int apa, Plane plane, Face face=Face::Both)
+    {
+        std::pair<int, int> r=plane_channel_range(apa, plane, face);
+        return add_range(r.first, r.second);
+    }
+
+    // Add the channels of anything with a Channel() method, eg the
+    // SimChannels of an event
+    template<class Container>
+    ChannelMask& add_channels_of(Container const& things)
+    {
+        for(auto const& thing: things) add(thing.Channel());
+        return *this;
+    }
+
+    // Keep only the channels that are also in `other`
+    ChannelMask& intersect(ChannelMask const& other)
+    {
+        for(size_t i=0; i<m_bits.size(); ++i){
+            m_bits[i]&=(i<other.m_bits.size()) ? other.m_bits[i] : 0;
+        }
+        return *this;
+    }
+
+private:
+    void grow(uint64_t nbits)
+    {
+        if(nbits<=m_nbits) return;
+        m_nbits=nbits;
+        m_bits.resize((nbits+63)/64, 0);
+    }
+
+    uint64_t m_nbits=0;
+    std::vector<uint64_t> m_bits;
+};
+
+#endif // include guard
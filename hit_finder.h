@@ -0,0 +1,120 @@
+#ifndef HIT_FINDER_H
+#define HIT_FINDER_H
+
+// A simple hit finder that runs on the waveforms themselves, much like
+// a trigger primitive finder: a hit is a run of ticks at least some
+// threshold above the baseline. The hits come out in the same layout
+// as extract_larsoft_hits writes recob::Hits in
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "waveform_matrix.h"
+
+struct WaveformHit
+{
+    int start_tick;
+    // One past the last tick over threshold
+    int end_tick;
+    // The samples over threshold, minus the baseline, summed
+    int summed_adc;
+    // The width of the hit: the standard deviation of the tick,
+    // weighted by the samples minus the baseline
+    float rms;
+};
+
+// The ticks are looked at in blocks of this many. A block with nothing
+// over threshold is skipped after finding its maximum
+constexpr size_t hit_finder_block_ticks=32;
+
+// The largest of the hit_finder_block_ticks samples at `block`. The
+// loop has a fixed length, so that it can be vectorized
+inline int block_maximum(const short* block)
+{
+    int ret=block[0];
+    for(size_t i=0; i<hit_finder_block_ticks; ++i){
+        const int adc=block[i];
+        ret=adc>ret ? adc : ret;
+    }
+    return ret;
+}
+
+// Append to `hits` the hits in the `n` samples at `row`, which has
+// baseline `baseline`. Only positive excursions count, so this is for
+// the collection plane
+inline void find_hits(const short* row, size_t n, short baseline, int threshold,
+                      std::vector<WaveformHit>& hits)
+{
+    bool in_hit=false;
+    int start=0;
+    // The sums for the hit so far, with ticks counted from its start
+    int64_t sum=0, sum_t=0, sum_t2=0;
+    auto end_hit=[&](size_t end){
+        const double mean=double(sum_t)/sum;
+        const double variance=std::max(0.0, double(sum_t2)/sum-mean*mean);
+        hits.push_back(WaveformHit{start, (int)end, (int)sum, (float)std::sqrt(variance)});
+        in_hit=false;
+    };
+
+    for(size_t block=0; block<n; block+=hit_finder_block_ticks){
+        const size_t block_end=std::min(n, block+hit_finder_block_ticks);
+        int block_max=row[block];
+        if(block_end-block==hit_finder_block_ticks){
+            block_max=block_maximum(row+block);
+        }
+        else{
+            // The last, partial block
+            for(size_t i=block; i<block_end; ++i) block_max=std::max(block_max, (int)row[i]);
+        }
+        if(block_max-baseline<threshold){
+            if(in_hit) end_hit(block);
+            continue;
+        }
+        for(size_t i=block; i<block_end; ++i){
+            const int adc=row[i]-baseline;
+            if(adc>=threshold){
+                if(!in_hit){
+                    in_hit=true;
+                    start=i;
+                    sum=sum_t=sum_t2=0;
+                }
+                const int64_t t=i-start;
+                sum+=adc;
+                sum_t+=adc*t;
+                sum_t2+=adc*t*t;
+            }
+            else if(in_hit){
+                end_hit(i);
+            }
+        }
+    }
+    if(in_hit) end_hit(n);
+}
+
+// The rows of `hits`, found in the rows of channels `channels`, in the
+// layout extract_larsoft_hits writes: the channel number, then
+// StartTick, EndTick, SummedADC and RMS (truncated to an integer).
+// `hits[i]` are the hits of row `i`
+inline WaveformMatrix<int> hit_rows(std::vector<std::vector<WaveformHit> > const& hits,
+                                    std::vector<int> const& channels)
+{
+    size_t nhits=0;
+    for(auto const& row_hits: hits) nhits+=row_hits.size();
+    WaveformMatrix<int> ret(4);
+    ret.reserve(nhits);
+    for(size_t i=0; i<hits.size(); ++i){
+        for(WaveformHit const& hit: hits[i]){
+            int* row=ret.add_row(channels[i]);
+            row[0]=hit.start_tick;
+            row[1]=hit.end_tick;
+            row[2]=hit.summed_adc;
+            row[3]=hit.rms;
+        }
+    }
+    return ret;
+}
+
+#endif // include guard
@@ -0,0 +1,76 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A whole file mapped read-only into memory. Pages are only read from
+// disk when they're first touched, so opening even a very large file
+// is cheap, and parts of it that are never looked at are never read.
+// The mapping lasts as long as the MappedFile, so hold it in a
+// shared_ptr if views into it are handed out
+class MappedFile
+{
+public:
+    explicit MappedFile(std::string const& filename)
+        : m_filename(filename)
+    {
+        int fd=open(filename.c_str(), O_RDONLY);
+        if(fd<0){
+            throw std::runtime_error("Unable to open "+filename+": "+strerror(errno));
+        }
+        struct stat st;
+        if(fstat(fd, &st)!=0){
+            int err=errno;
+            close(fd);
+            throw std::runtime_error("Unable to stat "+filename+": "+strerror(err));
+        }
+        m_size=st.st_size;
+        // mmap() won't map an empty file, but there's nothing to map anyway
+        if(m_size>0){
+            void* p=mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p==MAP_FAILED){
+                int err=errno;
+                close(fd);
+                throw std::runtime_error("Unable to map "+filename+": "+strerror(err));
+            }
+            m_data=static_cast<const char*>(p);
+        }
+        // The mapping keeps the file open for us
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if(m_data) munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    std::string const& filename() const { return m_filename; }
+
+    // Tell the kernel how the mapping will be read, eg MADV_SEQUENTIAL
+    // to read ahead aggressively, or MADV_RANDOM to read only what's touched
+    void advise(int advice) const
+    {
+        if(m_data) madvise(const_cast<char*>(m_data), m_size, advice);
+    }
+
+private:
+    std::string m_filename;
+    const char* m_data=nullptr;
+    size_t m_size=0;
+};
+
+#endif // include guard
@@ -0,0 +1,341 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "cnpy.h"
+#include "container.h"
+#include "geometry.h"
+#include "output_file.h"
+#include "text_writer.h"
+#include "waveform_matrix.h"
+
+// Text and Numpy write one row per channel, with the event and channel
+// numbers in the first two columns, and the samples widened to the
+// output type. NumpySplit writes an npz file with the samples in their
+// native type in a 2D array "samples", and the event and channel
+// numbers in separate 1D arrays "events" and "channels". These three
+// formats write one file per event.
+//
+// Container writes all of the events to a single file, with an index
+// of events at the end (see container.h)
+enum class Format { Text, Numpy, NumpySplit, Container };
+
+// Name of the file for event `event` when writing one file per event:
+// `outfile` with "_evtN" and then `suffix` inserted before the
+// extension (or at the end if there is no extension)
+inline std::string event_filename(std::string const& outfile, unsigned int event, std::string const& suffix)
+{
+    size_t dotpos=outfile.find_last_of(".");
+    if(dotpos==std::string::npos){
+        dotpos=outfile.length();
+    }
+    std::ostringstream iss;
+    iss << outfile.substr(0, dotpos) << "_evt" << event << suffix << outfile.substr(dotpos, outfile.length()-dotpos);
+    return iss.str();
+}
+
+// The arrays of the NumpySplit layout for rows [first, last) of `m`,
+// pointing straight into `m`, named "samples", "events" and "channels"
+// after `prefix`. Metadata columns that are empty in `m` are omitted
+template<class T>
+void add_split_members(std::vector<cnpy::NpzMember>& members, std::string const& prefix,
+                       WaveformMatrix<T> const& m, size_t first, size_t last)
+{
+    const size_t nrows=last-first;
+    members.push_back(cnpy::npz_member(prefix+"samples", m.row(first), {nrows, m.nsamples}));
+    if(!m.events.empty()) members.push_back(cnpy::npz_member(prefix+"events", m.events.data()+first, {nrows}));
+    if(!m.channels.empty()) members.push_back(cnpy::npz_member(prefix+"channels", m.channels.data()+first, {nrows}));
+}
+
+// Write rows [first, last) of `m` to `outfile`, with the values
+// converted to type `U`. For Text and Numpy, each output row is the
+// event number, then the channel number, then the samples, with the
+// metadata columns omitted if they are empty in `m`. If `append` is
+// true, the rows are added to the end of any existing file (not
+// supported for NumpySplit).
+//
+// For NumpySplit, the arrays are deflated at zlib level
+// `compression_level` (0 means store them uncompressed), with the
+// compression spread over `nthreads` threads. For Text, the rows are
+// formatted on `nformatthreads` threads (see TextWriter).
+//
+// The rows are written straight out of `m`, so there's no need to
+// build a copy of the data in the output layout first.
+//
+// Numpy and NumpySplit files are written with `backend` (see
+// output_file.h), except when appending, which always uses stdio
+template<class U, class T>
+void save_rows_to_file_as(std::string const& outfile,
+                          WaveformMatrix<T> const& m,
+                          size_t first, size_t last,
+                          Format format,
+                          bool append,
+                          int compression_level=0,
+                          unsigned int nthreads=1,
+                          IoBackend backend=IoBackend::Stdio,
+                          unsigned int nformatthreads=1)
+{
+    const bool with_events=!m.events.empty();
+    const bool with_channels=!m.channels.empty();
+    last=std::min(last, m.nrows());
+    const size_t nrows=last>first ? last-first : 0;
+
+    switch(format){
+
+    case Format::Text:
+    {
+        // Append if asked to, eg for the truth file, which gets a
+        // block of rows for each event
+        TextWriter writer(outfile, append, nformatthreads);
+        writer.write_rows<U>(m, first, last);
+    }
+    break;
+
+    case Format::Numpy:
+    {
+        // Do nothing if there are no rows
+        if(nrows==0) break;
+        const size_t nmeta=(with_events ? 1 : 0) + (with_channels ? 1 : 0);
+        const std::vector<size_t> shape{nrows, nmeta+m.nsamples};
+        std::unique_ptr<OutputFile> file;
+        FILE* fp=nullptr;
+        if(backend!=IoBackend::Stdio && !append){
+            file=open_output_file(outfile, backend);
+            const std::vector<char> header=cnpy::create_npy_header<U>(shape);
+            file->write(header.data(), header.size());
+        }
+        else{
+            fp=cnpy::npy_open<U>(outfile, shape, append ? "a" : "w");
+        }
+        auto write=[&](const void* data, size_t nbytes){
+            if(file) file->write(static_cast<const char*>(data), nbytes);
+            else cnpy::fwrite_or_throw(data, nbytes, fp, outfile);
+        };
+        try{
+            if(nmeta==0 && std::is_same<T, U>::value){
+                write(m.row(first), nrows*m.nsamples*sizeof(U));
+            }
+            else{
+                // Build each row in the output layout in turn
+                std::vector<U> row(nmeta+m.nsamples);
+                for(size_t i=first; i<last; ++i){
+                    size_t icol=0;
+                    if(with_events) row[icol++]=m.events[i];
+                    if(with_channels) row[icol++]=m.channels[i];
+                    std::copy(m.row(i), m.row(i)+m.nsamples, row.begin()+icol);
+                    write(row.data(), row.size()*sizeof(U));
+                }
+            }
+        }
+        catch(...){
+            if(fp) fclose(fp);
+            throw;
+        }
+        if(file) file->close();
+        else cnpy::fclose_or_throw(fp, outfile);
+    }
+    break;
+
+    case Format::Container:
+        throw std::runtime_error("save_to_file: container files must be written with EventWriter");
+
+    case Format::NumpySplit:
+    {
+        if(append){
+            throw std::runtime_error("save_to_file: can't append to split numpy file "+outfile);
+        }
+        if(nrows==0) break;
+        // The samples keep their own type here, whatever U is
+        std::vector<cnpy::NpzMember> members;
+        add_split_members(members, "", m, first, last);
+        save_npz_members(outfile, members, compression_level, nthreads, backend);
+    }
+    break;
+    }
+}
+
+// Write all of `m` to `outfile`. See save_rows_to_file_as
+template<class U, class T>
+void save_to_file_as(std::string const& outfile,
+                     WaveformMatrix<T> const& m,
+                     Format format,
+                     bool append,
+                     int compression_level=0,
+                     unsigned int nthreads=1,
+                     IoBackend backend=IoBackend::Stdio,
+                     unsigned int nformatthreads=1)
+{
+    save_rows_to_file_as<U>(outfile, m, 0, m.nrows(), format, append, compression_level, nthreads, backend, nformatthreads);
+}
+
+// Write `m` to `outfile` with its values in their own type. See save_to_file_as
+template<class T>
+void save_to_file(std::string const& outfile,
+                  WaveformMatrix<T> const& m,
+                  Format format,
+                  bool append,
+                  int compression_level=0,
+                  unsigned int nthreads=1,
+                  IoBackend backend=IoBackend::Stdio,
+                  unsigned int nformatthreads=1)
+{
+    save_to_file_as<T>(outfile, m, format, append, compression_level, nthreads, backend, nformatthreads);
+}
+
+// The rows [begin, end) of a matrix sorted by channel that hold the
+// channels of one plane of one APA
+struct PlaneShard
+{
+    int apa;
+    Plane plane;
+    size_t begin;
+    size_t end;
+
+    // eg "apa3_z"
+    std::string name() const
+    {
+        return "apa"+std::to_string(apa)+"_"+plane_name(plane);
+    }
+};
+
+// Split rows with channel numbers `channels`, which must be sorted,
+// into one shard per APA and plane. Planes with no rows get no shard
+inline std::vector<PlaneShard> plane_shards(std::vector<int> const& channels)
+{
+    std::vector<PlaneShard> ret;
+    size_t begin=0;
+    while(begin<channels.size()){
+        const int apa=apa_of_channel(channels[begin]);
+        const Plane plane=plane_of_channel(channels[begin]);
+        const int last_channel=plane_channel_range(apa, plane).second;
+        // The channels are sorted, so the shard ends at the first
+        // channel beyond the plane
+        const size_t end=std::lower_bound(channels.begin()+begin, channels.end(), last_channel)-channels.begin();
+        ret.push_back(PlaneShard{apa, plane, begin, end});
+        begin=end;
+    }
+    return ret;
+}
+
+// Name of the file for shard `shard` of the event file `eventfile`:
+// "_" and the shard name inserted before the extension, eg
+// wf_evt100.npy -> wf_evt100_apa3_z.npy
+inline std::string shard_filename(std::string const& eventfile, PlaneShard const& shard)
+{
+    size_t dotpos=eventfile.find_last_of(".");
+    if(dotpos==std::string::npos){
+        dotpos=eventfile.length();
+    }
+    return eventfile.substr(0, dotpos)+"_"+shard.name()+eventfile.substr(dotpos);
+}
+
+// How EventWriter splits each event by APA and plane. With Files,
+// each shard goes to a file of its own named by shard_filename(), in
+// the writer's format. With Arrays (NumpySplit only), the event's npz
+// file has the arrays of the NumpySplit layout for each shard, with
+// the shard name and "_" in front of their names, eg "apa3_z_samples"
+enum class Sharding { None, Files, Arrays };
+
+// Writes the output for each event in `format`: either to a file of
+// its own named by event_filename(), or, for Format::Container, all
+// to the single container file `outfile`
+class EventWriter
+{
+public:
+    // `append`, `compression_level`, `nthreads`, `backend` and
+    // `nformatthreads` are as for save_to_file_as, except that
+    // `append` applies to the container file as a whole for
+    // Format::Container. With `sharding`, each event is split into one
+    // shard per APA and plane, and the rows given to write() must be
+    // sorted by channel
+    EventWriter(std::string const& outfile, Format format, bool append=false,
+                int compression_level=0, unsigned int nthreads=1,
+                Sharding sharding=Sharding::None,
+                IoBackend backend=IoBackend::Stdio,
+                unsigned int nformatthreads=1)
+        : m_outfile(outfile), m_format(format), m_append(append),
+          m_compression_level(compression_level), m_nthreads(nthreads),
+          m_sharding(sharding), m_backend(backend), m_nformatthreads(nformatthreads)
+    {
+        if(sharding==Sharding::Arrays && format!=Format::NumpySplit){
+            throw std::runtime_error("EventWriter: shards can only be written as arrays in split numpy files");
+        }
+        if(sharding!=Sharding::None && format==Format::Container){
+            throw std::runtime_error("EventWriter: container files can't be sharded");
+        }
+        if(format==Format::Container){
+            m_container.reset(new ContainerWriter(outfile, append));
+        }
+    }
+
+    // The file that event `event` will be written to
+    std::string filename(unsigned int event, std::string const& suffix) const
+    {
+        return m_format==Format::Container ? m_outfile : event_filename(m_outfile, event, suffix);
+    }
+
+    // Write the rows of `m` as event `event`. `suffix` is added to
+    // the per-event file name (see event_filename), while `timestamp`
+    // goes in the container index. The per-event formats convert the
+    // values to U as save_to_file_as does; containers keep them as T
+    template<class U, class T>
+    void write(unsigned int event, uint64_t timestamp, std::string const& suffix,
+               WaveformMatrix<T> const& m)
+    {
+        if(m_container){
+            m_container->write_event(event, timestamp, m);
+        }
+        else if(m_sharding!=Sharding::None){
+            write_shards<U>(filename(event, suffix), m);
+        }
+        else{
+            save_to_file_as<U>(filename(event, suffix), m, m_format, m_append,
+                               m_compression_level, m_nthreads, m_backend, m_nformatthreads);
+        }
+    }
+
+private:
+    template<class U, class T>
+    void write_shards(std::string const& eventfile, WaveformMatrix<T> const& m)
+    {
+        if(!std::is_sorted(m.channels.begin(), m.channels.end()) || m.channels.size()!=m.nrows()){
+            throw std::runtime_error("EventWriter: rows must be sorted by channel to write shards of "+eventfile);
+        }
+        const std::vector<PlaneShard> shards=plane_shards(m.channels);
+        if(m_sharding==Sharding::Files){
+            for(PlaneShard const& shard: shards){
+                save_rows_to_file_as<U>(shard_filename(eventfile, shard), m, shard.begin, shard.end,
+                                        m_format, m_append, m_compression_level, m_nthreads, m_backend,
+                                        m_nformatthreads);
+            }
+        }
+        else if(!shards.empty()){
+            std::vector<cnpy::NpzMember> members;
+            for(PlaneShard const& shard: shards){
+                add_split_members(members, shard.name()+"_", m, shard.begin, shard.end);
+            }
+            save_npz_members(eventfile, members, m_compression_level, m_nthreads, m_backend);
+        }
+    }
+
+    std::string m_outfile;
+    Format m_format;
+    bool m_append;
+    int m_compression_level;
+    unsigned int m_nthreads;
+    Sharding m_sharding;
+    IoBackend m_backend;
+    unsigned int m_nformatthreads;
+    std::unique_ptr<ContainerWriter> m_container;
+};
+
+#endif // include guard
@@ -0,0 +1,279 @@
+#ifndef OUTPUT_FILE_H
+#define OUTPUT_FILE_H
+
+// Ways of writing a whole output file from start to finish. The plain
+// stdio writes that cnpy does go through the page cache, which on the
+// shared network filesystems we write to often costs more than making
+// the data. IoBackend::Direct writes with O_DIRECT from aligned
+// buffers instead, and IoBackend::Uring does the same, but keeps one
+// buffer being written by io_uring while the next one is filled. The
+// io_uring backend is only there if the tools are built with
+// -DWITH_IO_URING=ON, which needs liburing
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef WAVEFORM_TOOLS_IO_URING
+#include <liburing.h>
+#endif
+
+#include "cnpy.h"
+
+enum class IoBackend { Stdio, Direct, Uring };
+
+// The backend named `name`: "stdio", "direct" or "uring". Throws if
+// there's no such backend in this build
+inline IoBackend parse_io_backend(std::string const& name)
+{
+    if(name=="stdio") return IoBackend::Stdio;
+    if(name=="direct") return IoBackend::Direct;
+    if(name=="uring"){
+#ifdef WAVEFORM_TOOLS_IO_URING
+        return IoBackend::Uring;
+#else
+        throw std::invalid_argument("this build doesn't support io_uring: rebuild with -DWITH_IO_URING=ON");
+#endif
+    }
+    throw std::invalid_argument("unknown output backend \""+name+"\"");
+}
+
+// A file being written from start to finish
+class OutputFile
+{
+public:
+    virtual ~OutputFile() {}
+    // Append the `n` bytes at `data` to the file
+    virtual void write(const char* data, size_t n)=0;
+    // Write out anything buffered and close the file. Throws if any of
+    // the writes failed
+    virtual void close()=0;
+};
+
+// O_DIRECT transfers must start at, and be a multiple of, the
+// device's logical block size in length, which is at most this
+constexpr size_t direct_io_alignment=4096;
+// The size of each buffer that O_DIRECT writes are made from
+constexpr size_t direct_io_buffer_bytes=4<<20;
+
+// Writes through buffers aligned for O_DIRECT. The last, partial
+// block is padded out to a whole block when it's written, and the
+// file is then truncated back to its true length. Filesystems that
+// don't support O_DIRECT (eg tmpfs) get ordinary writes, from the same
+// buffers. Subclasses say how a full buffer is written
+class AlignedOutputFile : public OutputFile
+{
+public:
+    explicit AlignedOutputFile(std::string const& filename, size_t nbuffers)
+        : m_filename(filename)
+    {
+        m_fd=open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if(m_fd<0 && errno==EINVAL){
+            static std::atomic<bool> warned{false};
+            if(!warned.exchange(true)){
+                std::cerr << "O_DIRECT isn't supported for " << filename << ", so using ordinary writes" << std::endl;
+            }
+            m_fd=open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if(m_fd<0){
+            throw std::runtime_error("Unable to open output file "+filename+": "+strerror(errno));
+        }
+        for(size_t i=0; i<nbuffers; ++i){
+            void* p=nullptr;
+            if(posix_memalign(&p, direct_io_alignment, direct_io_buffer_bytes)!=0){
+                ::close(m_fd);
+                throw std::bad_alloc();
+            }
+            m_buffers.emplace_back(static_cast<char*>(p), &free);
+        }
+    }
+
+    ~AlignedOutputFile()
+    {
+        if(m_fd>=0) ::close(m_fd);
+    }
+
+    void write(const char* data, size_t n) override
+    {
+        while(n>0){
+            const size_t ncopy=std::min(n, direct_io_buffer_bytes-m_used);
+            memcpy(buffer()+m_used, data, ncopy);
+            m_used+=ncopy;
+            data+=ncopy;
+            n-=ncopy;
+            if(m_used==direct_io_buffer_bytes) flush();
+        }
+    }
+
+    void close() override
+    {
+        const size_t length=m_offset+m_used;
+        const size_t padded=(m_used+direct_io_alignment-1)/direct_io_alignment*direct_io_alignment;
+        memset(buffer()+m_used, 0, padded-m_used);
+        m_used=padded;
+        flush();
+        finish_writes();
+        if(ftruncate(m_fd, length)!=0 || ::close(m_fd)!=0){
+            m_fd=-1;
+            throw std::runtime_error("Unable to finish writing "+m_filename+": "+strerror(errno));
+        }
+        m_fd=-1;
+    }
+
+protected:
+    // Write the `n` bytes of buffer `ibuffer` at `offset`. The buffer
+    // can't be filled again until the write is done
+    virtual void write_buffer(size_t ibuffer, size_t n, size_t offset)=0;
+    // Wait for all of the writes to be done
+    virtual void finish_writes() {}
+
+    const char* buffer_at(size_t ibuffer) const { return m_buffers[ibuffer].get(); }
+
+    void check(ssize_t ret, size_t n)
+    {
+        if(ret<0 || (size_t)ret!=n){
+            throw std::runtime_error("Error writing "+m_filename+": "+(ret<0 ? strerror(errno) : "short write"));
+        }
+    }
+
+    std::string m_filename;
+    int m_fd=-1;
+
+private:
+    char* buffer() { return m_buffers[m_current].get(); }
+
+    void flush()
+    {
+        if(m_used==0) return;
+        write_buffer(m_current, m_used, m_offset);
+        m_offset+=m_used;
+        m_used=0;
+        m_current=(m_current+1)%m_buffers.size();
+    }
+
+    std::vector<std::unique_ptr<char, void(*)(void*)> > m_buffers;
+    size_t m_current=0;
+    size_t m_used=0;
+    size_t m_offset=0;
+};
+
+// IoBackend::Direct: each buffer is written with pwrite() once it's full
+class DirectOutputFile : public AlignedOutputFile
+{
+public:
+    explicit DirectOutputFile(std::string const& filename)
+        : AlignedOutputFile(filename, 1)
+    {}
+
+protected:
+    void write_buffer(size_t ibuffer, size_t n, size_t offset) override
+    {
+        check(pwrite(m_fd, buffer_at(ibuffer), n, offset), n);
+    }
+};
+
+#ifdef WAVEFORM_TOOLS_IO_URING
+// IoBackend::Uring: each full buffer is handed to io_uring, and the
+// other one is filled while it's written. A buffer is only waited for
+// when it comes round to be filled again
+class UringOutputFile : public AlignedOutputFile
+{
+public:
+    explicit UringOutputFile(std::string const& filename)
+        : AlignedOutputFile(filename, 2)
+    {
+        const int ret=io_uring_queue_init(4, &m_ring, 0);
+        if(ret<0){
+            throw std::runtime_error("io_uring_queue_init failed: "+std::string(strerror(-ret)));
+        }
+    }
+
+    ~UringOutputFile()
+    {
+        try{ finish_writes(); } catch(...) {}
+        io_uring_queue_exit(&m_ring);
+    }
+
+protected:
+    void write_buffer(size_t ibuffer, size_t n, size_t offset) override
+    {
+        io_uring_sqe* sqe=io_uring_get_sqe(&m_ring);
+        io_uring_prep_write(sqe, m_fd, buffer_at(ibuffer), n, offset);
+        io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(ibuffer));
+        io_uring_submit(&m_ring);
+        m_pending[ibuffer]=n;
+        // The other buffer is filled next, so its write must be done.
+        // The writes can complete in either order
+        while(m_pending[1-ibuffer]>0) wait_one();
+    }
+
+    void finish_writes() override
+    {
+        while(m_pending[0]>0 || m_pending[1]>0) wait_one();
+    }
+
+private:
+    void wait_one()
+    {
+        io_uring_cqe* cqe=nullptr;
+        const int ret=io_uring_wait_cqe(&m_ring, &cqe);
+        if(ret<0){
+            throw std::runtime_error("io_uring_wait_cqe failed: "+std::string(strerror(-ret)));
+        }
+        const size_t ibuffer=reinterpret_cast<size_t>(io_uring_cqe_get_data(cqe));
+        const int res=cqe->res;
+        io_uring_cqe_seen(&m_ring, cqe);
+        const size_t n=m_pending[ibuffer];
+        m_pending[ibuffer]=0;
+        if(res<0) errno=-res;
+        check(res, n);
+    }
+
+    io_uring m_ring;
+    // The length of the write in flight from each buffer, or 0
+    size_t m_pending[2]={0, 0};
+};
+#endif
+
+// Open `filename` for writing from scratch with `backend`, which
+// mustn't be IoBackend::Stdio: those writes are done by cnpy itself
+inline std::unique_ptr<OutputFile> open_output_file(std::string const& filename, IoBackend backend)
+{
+    switch(backend){
+    case IoBackend::Direct:
+        return std::unique_ptr<OutputFile>(new DirectOutputFile(filename));
+#ifdef WAVEFORM_TOOLS_IO_URING
+    case IoBackend::Uring:
+        return std::unique_ptr<OutputFile>(new UringOutputFile(filename));
+#endif
+    default:
+        throw std::invalid_argument("open_output_file: no OutputFile for this backend");
+    }
+}
+
+// Write `members` to the new npz file `filename`, deflated at zlib
+// level `compression_level` using `nthreads` threads, with `backend`
+inline void save_npz_members(std::string const& filename, std::vector<cnpy::NpzMember> const& members,
+                             int compression_level, unsigned int nthreads, IoBackend backend)
+{
+    if(backend==IoBackend::Stdio){
+        cnpy::npz_save_members(filename, members, "w", compression_level, nthreads);
+        return;
+    }
+    std::unique_ptr<OutputFile> file=open_output_file(filename, backend);
+    cnpy::npz_save_members([&](const char* data, size_t n){ file->write(data, n); },
+                           members, compression_level, nthreads);
+    file->close();
+}
+
+#endif // include guard
@@ -0,0 +1,211 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility> // for std::move
+#include <vector>
+
+// Number of worker threads to use when the user asks for "as many as
+// there are cores" (by passing 0)
+inline unsigned int default_nthreads(unsigned int requested)
+{
+    if(requested>0) return requested;
+    unsigned int n=std::thread::hardware_concurrency();
+    return n>0 ? n : 1;
+}
+
+// The same, but for each of `njobs` processes running at once, which
+// share the cores between them
+inline unsigned int default_nthreads(unsigned int requested, unsigned int njobs)
+{
+    if(requested>0) return requested;
+    return std::max(default_nthreads(0)/std::max(njobs, 1u), 1u);
+}
+
+// A fixed-capacity FIFO for passing work between the stages of a
+// pipeline. push() blocks while the queue is full, so a fast producer
+// can't run arbitrarily far ahead of a slow consumer. pop() blocks
+// while the queue is empty. Once close() has been called, pop()
+// returns the items that are left and then returns false
+template<class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : m_capacity(capacity>0 ? capacity : 1)
+    {}
+
+    // Add `item` to the queue, waiting for space if necessary.
+    // Returns false (and drops the item) if the queue has been closed.
+    // If `waited` isn't null, it's set to whether the queue was full
+    bool push(T item, bool* waited=nullptr)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if(waited) *waited=!m_closed && m_items.size()>=m_capacity;
+        m_not_full.wait(lock, [this]{ return m_closed || m_items.size()<m_capacity; });
+        if(m_closed) return false;
+        m_items.push_back(std::move(item));
+        m_not_empty.notify_one();
+        return true;
+    }
+
+    // Take the item at the front of the queue into `item`, waiting
+    // for one to arrive if necessary. Returns false when the queue
+    // is closed and empty
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_empty.wait(lock, [this]{ return m_closed || !m_items.empty(); });
+        if(m_items.empty()) return false;
+        item=std::move(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+
+    // Signal that no more items will be pushed. Wakes up everyone
+    // waiting on the queue
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed=true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+    }
+
+private:
+    size_t m_capacity;
+    bool m_closed=false;
+    std::deque<T> m_items;
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+};
+
+// A fixed set of threads for running parallel loops. The threads are
+// kept alive between loops, so that per-thread state (eg scratch
+// buffers indexed by the thread index passed to the loop body) can be
+// reused from one loop to the next without being reallocated.
+//
+// The calling thread takes part in each loop as thread index 0, so a
+// pool of size 1 starts no threads and runs everything inline.
+// parallel_for() is not reentrant: only one thread may call it on a
+// given pool at a time
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int nthreads)
+        : m_size(nthreads>0 ? nthreads : 1)
+    {
+        for(unsigned int i=1; i<m_size; ++i){
+            m_threads.emplace_back(&ThreadPool::run, this, i);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop=true;
+        }
+        m_start.notify_all();
+        for(auto& t: m_threads) t.join();
+    }
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    // The number of threads taking part in each loop, including the caller
+    unsigned int size() const { return m_size; }
+
+    // Call `body(i, ithread)` for each `i` in [0, n), spread over the
+    // threads in the pool, and wait for all of the calls to finish.
+    // `ithread` is in [0, size()) and identifies the thread making
+    // the call. Indices are handed out `grain` at a time. If any call
+    // throws, the first exception is rethrown here
+    template<class F>
+    void parallel_for(size_t n, F&& body, size_t grain=1)
+    {
+        if(n==0) return;
+        grain=std::max<size_t>(grain, 1);
+        if(m_size==1 || n<=grain){
+            for(size_t i=0; i<n; ++i) body(i, 0u);
+            return;
+        }
+
+        std::atomic<size_t> next(0);
+        m_job=[&](unsigned int ithread){
+            for(size_t begin=next.fetch_add(grain); begin<n; begin=next.fetch_add(grain)){
+                size_t end=std::min(begin+grain, n);
+                for(size_t i=begin; i<end; ++i) body(i, ithread);
+            }
+        };
+        m_error=nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_nbusy=m_size-1;
+            ++m_generation;
+        }
+        m_start.notify_all();
+
+        run_job(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this]{ return m_nbusy==0; });
+        m_job=nullptr;
+        if(m_error) std::rethrow_exception(m_error);
+    }
+
+private:
+    void run_job(unsigned int ithread)
+    {
+        try{
+            m_job(ithread);
+        }
+        catch(...){
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(!m_error) m_error=std::current_exception();
+        }
+    }
+
+    void run(unsigned int ithread)
+    {
+        size_t seen=0;
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_start.wait(lock, [&]{ return m_stop || m_generation!=seen; });
+                if(m_stop) return;
+                seen=m_generation;
+            }
+            run_job(ithread);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                --m_nbusy;
+            }
+            m_done.notify_one();
+        }
+    }
+
+    unsigned int m_size;
+    std::vector<std::thread> m_threads;
+    std::function<void(unsigned int)> m_job;
+    std::exception_ptr m_error;
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    size_t m_generation=0;
+    unsigned int m_nbusy=0;
+    bool m_stop=false;
+};
+
+#endif // include guard
@@ -0,0 +1,83 @@
+#ifndef PEDESTAL_H
+#define PEDESTAL_H
+
+// Per-channel pedestals, estimated as the median ADC value of the
+// waveform, as waveform_utils.pedsub does in python
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The ADCs are 12 bits, so a histogram with one bin per ADC value is
+// small enough to find the median from directly
+constexpr int adc_histogram_bins=1<<12;
+
+// Finds the median of waveforms by filling a histogram of their ADC
+// values in one pass and walking it to the middle value, rather than
+// sorting. The histogram is kept between calls so that it is only
+// allocated once: use one PedestalFinder per thread
+class PedestalFinder
+{
+public:
+    PedestalFinder()
+        : m_counts(adc_histogram_bins, 0)
+    {}
+
+    // The median of the `n` values at `adcs`. For even `n`, this is
+    // the lower of the two middle values, so that it's a whole number
+    // of ADC counts. Values outside the 12-bit range are handled, but
+    // more slowly
+    short median(const short* adcs, size_t n)
+    {
+        if(n==0) return 0;
+        int lo=adc_histogram_bins;
+        int hi=-1;
+        for(size_t i=0; i<n; ++i){
+            const int adc=adcs[i];
+            if(adc<0 || adc>=adc_histogram_bins){
+                // Empty the bins we've filled, and fall back to sorting
+                if(hi>=lo) std::fill(m_counts.begin()+lo, m_counts.begin()+hi+1, 0);
+                return median_by_sorting(adcs, n);
+            }
+            ++m_counts[adc];
+            lo=std::min(lo, adc);
+            hi=std::max(hi, adc);
+        }
+        // Only the bins between the lowest and highest values can be
+        // non-empty, so only they need to be walked and then emptied
+        const size_t k=(n-1)/2;
+        size_t seen=0;
+        int ret=hi;
+        for(int adc=lo; adc<=hi; ++adc){
+            seen+=m_counts[adc];
+            if(seen>k){
+                ret=adc;
+                break;
+            }
+        }
+        std::fill(m_counts.begin()+lo, m_counts.begin()+hi+1, 0);
+        return ret;
+    }
+
+private:
+    short median_by_sorting(const short* adcs, size_t n)
+    {
+        m_scratch.assign(adcs, adcs+n);
+        std::nth_element(m_scratch.begin(), m_scratch.begin()+(n-1)/2, m_scratch.end());
+        return m_scratch[(n-1)/2];
+    }
+
+    std::vector<uint32_t> m_counts;
+    std::vector<short> m_scratch;
+};
+
+// Subtract `pedestal` from each of the `n` values at `adcs`
+inline void subtract_pedestal(short* adcs, size_t n, short pedestal)
+{
+    for(size_t i=0; i<n; ++i){
+        adcs[i]-=pedestal;
+    }
+}
+
+#endif // include guard
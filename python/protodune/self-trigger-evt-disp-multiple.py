@@ -89,10 +89,7 @@ if __name__=="__main__":
             
     else:
         for f in args.filenames.split(","):
-            if f.endswith("npy"):
-                files.append(np.load(f))
-            else:
-                files.append(np.loadtxt(f).astype(np.int32))
+            files.append(wutil.load_waveforms(f))
     
     # "Offline" format has a channel per row, with the first column
     # being the event number, and the second column being the channel
@@ -38,7 +38,7 @@ if __name__=="__main__":
     parser.add_argument("--figsize", nargs=2, default=[6.4, 4.8], metavar=("width", "height"),
                         help="Set width and height of figure, if saved")
     args=parser.parse_args()
-    a=np.load(args.filename) if args.filename.endswith("npy") else np.loadtxt(args.filename).astype(np.int32)
+    a=wutil.load_waveforms(args.filename)
 
     # "Offline" format has a channel per row, with the first column
     # being the event number, and the second column being the channel
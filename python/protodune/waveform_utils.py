@@ -1,9 +1,68 @@
+import os
 import numpy as np
 import matplotlib.pyplot as plt
 from scipy.signal import firwin
 from mpl_toolkits.axes_grid1 import make_axes_locatable
 
+def is_split(all_chans):
+    """
+    Is `all_chans` in the split layout written by
+    `extract_larsoft_waveforms --split` (ie, something indexable by
+    "events", "channels" and "samples", such as the object np.load
+    returns for the npz file), rather than a 2D array with the event
+    and channel numbers in the first two columns?
+    """
+    return not isinstance(all_chans, np.ndarray)
+
+def combine_split(events, channels, samples):
+    """
+    Convert arrays in the split layout to a single 2D int32 array with
+    the event and channel numbers in the first two columns
+    """
+    return np.hstack([events.reshape(-1,1).astype(np.int32),
+                      channels.reshape(-1,1).astype(np.int32),
+                      samples.astype(np.int32)])
+
+def densify(a):
+    """
+    The full waveforms from the zero-suppressed arrays `a` written by
+    `extract_larsoft_waveforms --roi-threshold` (see roi.h), as a 2D
+    int16 array with one row per channel, in the same order as
+    a["channels"]
+    """
+    nrows=len(a["channels"])
+    ret=np.repeat(a["baselines"].reshape(-1,1), int(a["nsamples"][0]), axis=1)
+    roi_offsets=a["roi_offsets"]
+    roi_starts=a["roi_starts"]
+    value_offsets=a["value_offsets"]
+    values=a["values"]
+    for i in range(nrows):
+        for j in range(roi_offsets[i], roi_offsets[i+1]):
+            n=value_offsets[j+1]-value_offsets[j]
+            ret[i,roi_starts[j]:roi_starts[j]+n]=values[value_offsets[j]:value_offsets[j+1]]
+    return ret
+
+def load_waveforms(filename):
+    """
+    Load the output of extract_larsoft_waveforms from `filename` in
+    any of its formats (text, numpy, split npz, or zero-suppressed
+    npz), and return a 2D array with one row per channel, with the
+    event and channel numbers in the first two columns
+    """
+    if not (filename.endswith("npy") or filename.endswith("npz")):
+        return np.loadtxt(filename).astype(np.int32)
+    a=np.load(filename)
+    if is_split(a) and "roi_offsets" in a:
+        return combine_split(a["events"], a["channels"], densify(a))
+    if is_split(a):
+        return combine_split(a["events"], a["channels"], a["samples"])
+    return a
+
 def get_channel(all_chans, chan):
+    if is_split(all_chans):
+        index=np.argwhere(all_chans["channels"]==chan)
+        assert(index.shape==(1,1))
+        return all_chans["samples"][index[0,0]]
     index=np.argwhere(all_chans[:,1]==chan)
     assert(index.shape==(1,1))
     return all_chans[index[0,0],2:]
@@ -12,7 +71,11 @@ def get_collection_channel(all_chans, apa, collindex):
     chan=2560*apa+1600+collindex
     return get_channel(all_chans, chan)
     
-def get_apa(all_chans, apanum, planetype="z", wallorcryo="both"):
+def apa_channel_range(apanum, planetype="z", wallorcryo="both"):
+    """
+    The channel numbers [first, last) of plane `planetype` of APA
+    `apanum`, or of just its wall- or cryostat-facing collection wires
+    """
     assert(planetype in ("u", "v", "z"))
     assert(wallorcryo in ("wall", "cryo", "both"))
     assert(wallorcryo=="both" or planetype=="z")
@@ -24,8 +87,7 @@ def get_apa(all_chans, apanum, planetype="z", wallorcryo="both"):
     wall_end   = 480 if apanum%2==0 else 960
     cryo_start = 480 if apanum%2==0 else   0
     cryo_end   = 960 if apanum%2==0 else 480
-    chans=all_chans[:,1]
-    
+
     first_chan=2560*apanum+starts[planetype]
     last_chan=2560*apanum+ends[planetype]
     if wallorcryo=="wall":
@@ -34,12 +96,26 @@ def get_apa(all_chans, apanum, planetype="z", wallorcryo="both"):
     elif wallorcryo=="cryo":
         first_chan=2560*apanum+starts[planetype]+cryo_start
         last_chan=2560*apanum+starts[planetype]+cryo_end
+    return first_chan, last_chan
+
+def get_apa(all_chans, apanum, planetype="z", wallorcryo="both"):
+    first_chan, last_chan=apa_channel_range(apanum, planetype, wallorcryo)
+    # For the split layout, only the rows we want get converted to
+    # the combined layout, which saves converting the whole array
+    chans=all_chans["channels"] if is_split(all_chans) else all_chans[:,1]
+    
     apachanbool=np.logical_and((chans>=first_chan),
                                (chans<last_chan))
     apaindices=np.argwhere(apachanbool)
     if apaindices.size==0:
         raise Exception("No channels in input for apa %d view %s wall/cryo %s" % (apanum, planetype, wallorcryo))
-    apavals=np.vstack(all_chans[apaindices])
+    if is_split(all_chans):
+        rows=apaindices.ravel()
+        apavals=combine_split(all_chans["events"][rows],
+                              all_chans["channels"][rows],
+                              all_chans["samples"][rows])
+    else:
+        apavals=np.vstack(all_chans[apaindices])
     # The channels in the npy aren't ordered by channel number, but
     # however they came out of the electronics, so fix that. (Order by
     # offline channel number is effectively order-in-space for
@@ -66,9 +142,98 @@ def pedsub(vals):
     tmp=np.hstack([np.zeros((nchans,2)), np.tile(peds, [nticks,1]).T])
     return vals-tmp
 
+def channel_index_filename(filename):
+    """
+    The name of the channel index that `extract_larsoft_waveforms
+    --numpy --channel-index` writes next to `filename`
+    """
+    base,ext=os.path.splitext(filename)
+    return base+"_chidx"+ext
+
+def shard_name(apanum, planetype):
+    """
+    The name `extract_larsoft_waveforms --shard` gives the shard for
+    plane `planetype` of APA `apanum`
+    """
+    return "apa%d_%s" % (apanum, planetype)
+
+def shard_filename(filename, apanum, planetype):
+    """
+    The file that `extract_larsoft_waveforms --shard files` writes
+    the shard for plane `planetype` of APA `apanum` of `filename` to
+    """
+    base,ext=os.path.splitext(filename)
+    return base+"_"+shard_name(apanum, planetype)+ext
+
+def load_apa_shard(filename, apanum, planetype="z", wallorcryo="both"):
+    """
+    The rows for the APA from the shards written by
+    `extract_larsoft_waveforms --shard`, or None if `filename` wasn't
+    sharded. The shards are already sorted by channel, so the rows for
+    one face of the APA are a slice, and there's nothing to sort
+    """
+    first_chan, last_chan=apa_channel_range(apanum, planetype, wallorcryo)
+    name=shard_name(apanum, planetype)
+    if filename.endswith("npz") and os.path.exists(filename):
+        a=np.load(filename)
+        if name+"_samples" not in a:
+            return None
+        channels=a[name+"_channels"]
+        begin,end=np.searchsorted(channels, [first_chan, last_chan])
+        return combine_split(a[name+"_events"][begin:end], channels[begin:end],
+                             a[name+"_samples"][begin:end])
+    shard_file=shard_filename(filename, apanum, planetype)
+    if not os.path.exists(shard_file):
+        return None
+    if shard_file.endswith("npz"):
+        # --shard files --split: each shard file has the split layout
+        a=np.load(shard_file)
+        channels=a["channels"]
+        begin,end=np.searchsorted(channels, [first_chan, last_chan])
+        return combine_split(a["events"][begin:end], channels[begin:end],
+                             a["samples"][begin:end])
+    if not shard_file.endswith("npy"):
+        return None
+    data=np.load(shard_file, mmap_mode="r")
+    begin,end=np.searchsorted(data[:,1], [first_chan, last_chan])
+    return np.array(data[begin:end])
+
+def load_apa(filename, apanum, planetype="z", wallorcryo="both"):
+    """
+    Like get_apa, but reading the channels straight from the numpy
+    file `filename`. If it was written in shards, only the shard for
+    the plane is read. If it has a channel index next to it, only the
+    rows for the APA are read from disk. Otherwise the whole file is
+    loaded and passed to get_apa
+    """
+    apavals=load_apa_shard(filename, apanum, planetype, wallorcryo)
+    if apavals is not None:
+        if len(apavals)==0:
+            raise Exception("No channels in input for apa %d view %s wall/cryo %s" % (apanum, planetype, wallorcryo))
+        return apavals
+
+    index_file=channel_index_filename(filename)
+    if not (filename.endswith("npy") and os.path.exists(index_file)):
+        # np.load gives us the split layout directly for npz files
+        return get_apa(np.load(filename), apanum, planetype, wallorcryo)
+
+    first_chan, last_chan=apa_channel_range(apanum, planetype, wallorcryo)
+    # The index is sorted by channel number, so the APA is one slice of it
+    index=np.load(index_file)
+    begin,end=np.searchsorted(index[:,0], [first_chan, last_chan])
+    if begin==end:
+        raise Exception("No channels in input for apa %d view %s wall/cryo %s" % (apanum, planetype, wallorcryo))
+    # Read the rows in file order, which is what mmap likes, and then
+    # put them back in channel order
+    rows=index[begin:end,1]
+    order=np.argsort(rows, kind="stable")
+    data=np.load(filename, mmap_mode="r")
+    apavals=np.empty((len(rows), data.shape[1]), dtype=data.dtype)
+    apavals[order]=data[rows[order]]
+    return apavals
+
 def get_pedsub_apa_from_file(filename, apanum, planetype="z", wallorcryo="both"):
-    all_chans=np.load(filename)
-    this_apa=get_apa(all_chans, apanum, planetype, wallorcryo)
+    this_apa=load_apa(filename, apanum, planetype, wallorcryo)
     return pedsub(this_apa)
 
 def split_contig(raw):
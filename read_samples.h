@@ -1,13 +1,28 @@
 #ifndef READ_SAMPLES_H
 #define READ_SAMPLES_H
 
+#include <algorithm>
+#include <charconv>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <iostream>
+#include <memory>
 #include <utility> // for std::pair
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "channel_index.h"
 #include "cnpy.h"
+#include "container.h"
+#include "fir_filter.h"
+#include "geometry.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "roi.h"
+#include "waveform_matrix.h"
 
 // A struct to hold waveforms with sample type `T`
 template<class T>
@@ -20,104 +35,742 @@ struct Waveforms
     std::vector<std::vector<T> > samples;
 };
 
+// The first two entries in each row of the files are the event number
+// and channel number. We're going to hack things and pretend that
+// everything comes from one events with way more channels than there
+// actually are, so I don't have to separate out events later. The
+// simulated geometry is 1x2x6, ie 12 APAs, so just offset the channel
+// number by (evt no)*(channels per APA)*(1*2*6)
+inline int modified_channel(int evtno, int chno)
+{
+    return evtno*channels_per_apa*workspace_napas+chno;
+}
+
+// Parse the whitespace-separated numbers in the line [begin, end) into
+// `out`, which has room for `n` values. Returns the number of values
+// in the line, which may be more than `n`, in which case the extra
+// values aren't stored. Returns -1 if the line has something in it
+// that isn't a number
+template<class T>
+long parse_text_row(const char* begin, const char* end, T* out, size_t n)
+{
+    long count=0;
+    const char* p=begin;
+    while(true){
+        while(p<end && (*p==' ' || *p=='\t' || *p=='\r')) ++p;
+        if(p==end) return count;
+        T value;
+        std::from_chars_result res=std::from_chars(p, end, value);
+        if(res.ec!=std::errc()) return -1;
+        if((size_t)count<n) out[count]=value;
+        ++count;
+        p=res.ptr;
+    }
+}
+
+// Does the line [begin, end) have anything but whitespace in it?
+inline bool is_blank_line(const char* begin, const char* end)
+{
+    for(const char* p=begin; p<end; ++p){
+        if(*p!=' ' && *p!='\t' && *p!='\r') return false;
+    }
+    return true;
+}
+
+// Call `f(begin, end)` for each non-blank line in [begin, end), and
+// stop early if it returns false
+template<class F>
+void for_each_text_line(const char* begin, const char* end, F&& f)
+{
+    for(const char* p=begin; p<end; ){
+        const char* eol=static_cast<const char*>(memchr(p, '\n', end-p));
+        if(!eol) eol=end;
+        if(!is_blank_line(p, eol) && !f(p, eol)) return;
+        p=eol+1;
+    }
+}
+
+// Read up to `max_channels` channels from the text file `inputfile`
+// produced by `extract_larsoft_waveforms` into a contiguous matrix,
+// using `nthreads` threads (0 means one per core). The channel
+// numbers are as they are in the file, ie not modified.
+//
+// The file is mapped and split into line-aligned chunks. The lines in
+// each chunk are counted in parallel, which tells us which output row
+// each chunk starts at, and then the chunks are parsed in parallel,
+// each straight into its own rows
+template<class T>
+WaveformMatrix<T> read_samples_text_matrix(const char* inputfile, unsigned int max_channels, unsigned int nthreads=0)
+{
+    MappedFile file(inputfile);
+    file.advise(MADV_SEQUENTIAL);
+    const char* begin=file.data();
+    const char* end=begin+file.size();
+
+    // Get the number of samples from the first line instead of hardcoding it
+    size_t nsamples=0;
+    bool found_first=false;
+    for_each_text_line(begin, end, [&](const char* b, const char* e){
+        long n=parse_text_row<T>(b, e, nullptr, 0);
+        if(n<2){
+            std::cerr << "First line of " << inputfile << " doesn't start with an event and channel number" << std::endl;
+            exit(1);
+        }
+        nsamples=n-2;
+        found_first=true;
+        return false;
+    });
+    WaveformMatrix<T> ret(nsamples);
+    if(!found_first) return ret;
+
+    ThreadPool pool(default_nthreads(nthreads));
+    // A few chunks per thread, to even out the load, but not so many
+    // that they're tiny
+    const size_t min_chunk_bytes=1<<20;
+    size_t nchunks=std::max<size_t>(1, std::min<size_t>(4*pool.size(), file.size()/min_chunk_bytes));
+    std::vector<const char*> chunk_begin(nchunks+1, end);
+    chunk_begin[0]=begin;
+    for(size_t i=1; i<nchunks; ++i){
+        // Move each boundary forward to the start of the next line
+        const char* p=std::max(begin+i*(file.size()/nchunks), chunk_begin[i-1]);
+        const char* eol=static_cast<const char*>(memchr(p, '\n', end-p));
+        chunk_begin[i]=eol ? eol+1 : end;
+    }
+
+    // First pass: count the lines in each chunk
+    std::vector<size_t> chunk_row(nchunks+1, 0);
+    pool.parallel_for(nchunks, [&](size_t ichunk, unsigned int){
+        size_t n=0;
+        for_each_text_line(chunk_begin[ichunk], chunk_begin[ichunk+1],
+                           [&](const char*, const char*){ ++n; return true; });
+        chunk_row[ichunk+1]=n;
+    });
+    for(size_t i=0; i<nchunks; ++i) chunk_row[i+1]+=chunk_row[i];
+    size_t nrows=chunk_row[nchunks];
+    if(max_channels>0 && max_channels<nrows) nrows=max_channels;
+    ret.resize(nrows);
+
+    // Second pass: parse each chunk into its rows. Remember the first
+    // bad row, so that we can report it after the parallel part
+    const size_t no_error=(size_t)-1;
+    std::vector<size_t> bad_row(nchunks, no_error);
+    std::vector<long> bad_count(nchunks, 0);
+    pool.parallel_for(nchunks, [&](size_t ichunk, unsigned int){
+        size_t irow=chunk_row[ichunk];
+        for_each_text_line(chunk_begin[ichunk], chunk_begin[ichunk+1], [&](const char* b, const char* e){
+            if(irow>=nrows) return false;
+            // The event and channel number go in their own columns,
+            // and then the samples are parsed straight into the row
+            int head[2];
+            const char* p=b;
+            bool head_ok=true;
+            for(int i=0; i<2 && head_ok; ++i){
+                while(p<e && (*p==' ' || *p=='\t' || *p=='\r')) ++p;
+                std::from_chars_result res=std::from_chars(p, e, head[i]);
+                head_ok=(res.ec==std::errc());
+                p=res.ptr;
+            }
+            long count=-1;
+            if(head_ok){
+                ret.events[irow]=head[0];
+                ret.channels[irow]=head[1];
+                count=parse_text_row<T>(p, e, ret.row(irow), nsamples);
+            }
+            if(count!=(long)nsamples){
+                bad_row[ichunk]=irow;
+                bad_count[ichunk]=count;
+                return false;
+            }
+            ++irow;
+            return true;
+        });
+    });
+    for(size_t i=0; i<nchunks; ++i){
+        if(bad_row[i]!=no_error){
+            if(bad_count[i]<0){
+                std::cerr << "Couldn't parse line for channel " << bad_row[i] << " in " << inputfile << std::endl;
+            }
+            else{
+                std::cerr << "Got " << bad_count[i] << " samples on channel " << bad_row[i] << ": expected " << nsamples << std::endl;
+            }
+            exit(1);
+        }
+    }
+
+    return ret;
+}
+
 // Read up to `max_channels` channels from `inputfile` produced by `extract_larsoft_waveforms`
 template<class T>
 Waveforms<T> read_samples_text(const char* inputfile, unsigned int max_channels)
 {
     Waveforms<T> ret;
 
-    // We do all this rigmarole because we want to get the number of
-    // samples from the input file instead of hardcoding it
-
-    std::ifstream ifstr(inputfile);
-    T sample;
-    unsigned int ichan=0; // channel counter
-    unsigned int nsamples=0;
-    // Each line in the input file is the set of samples for a given channel
-    std::string input_line;
-    while(std::getline(ifstr, input_line)){
-        std::istringstream istr(input_line);
-
-        std::vector<T> chan_samples;
-        // The first two entries in each line are the event number and
-        // channel number. We're going to hack things and pretend that
-        // everything comes from one events with way more channels than
-        // there actually are, so I don't have to separate out events
-        // later. The simulated geometry is 1x2x6, ie 12 APAs, so just
-        // offset the channel number by (evt no)*(channels per
-        // APA)*(1*2*6)
-        int evtno;
-        istr >> evtno;
-        int chno;
-        istr >> chno;
-        const int channels_per_apa=2560;
-        int modified_chno=evtno*channels_per_apa*12+chno;
-        ret.channels.push_back(modified_chno);
-        // Now read the actual samples
-        while(istr >> sample){
-            chan_samples.push_back(sample);
-        }
-        // Make sure we get the same number of samples on each line (ie, for each channel)
-        if(ichan==0){
-            nsamples=chan_samples.size();
+    WaveformMatrix<T> m=read_samples_text_matrix<T>(inputfile, max_channels);
+    const size_t nchannels=m.nrows();
+    ret.channels.reserve(nchannels);
+    ret.samples.resize(nchannels);
+    for(size_t ichan=0; ichan<nchannels; ++ichan){
+        ret.channels.push_back(modified_channel(m.events[ichan], m.channels[ichan]));
+        ret.samples[ichan].assign(m.row(ichan), m.row(ichan)+m.nsamples);
+    }
+
+    return ret;
+}
+
+// Is `inputfile` a zip archive (ie, an npz file) rather than a plain npy file?
+inline bool is_npz_file(const char* inputfile)
+{
+    std::ifstream ifstr(inputfile, std::ios::binary);
+    char magic[4]={0, 0, 0, 0};
+    ifstr.read(magic, 4);
+    return magic[0]=='P' && magic[1]=='K' && magic[2]==0x03 && magic[3]==0x04;
+}
+
+// The 1D array `name` in `npz`, converted to T, and inflated on
+// `nthreads` threads if it's compressed
+template<class T>
+std::vector<T> load_npz_vector(cnpy::NpzFile const& npz, std::string const& name, unsigned int nthreads=1)
+{
+    cnpy::NpyInfo info=npz.info(name);
+    cnpy::NpyArray arr=npz.load(name, nthreads);
+    std::vector<T> ret(arr.num_vals);
+    if(!ret.empty()){
+        cnpy::convert_npy_data(arr.data<char>(), info.type, info.word_size, ret.size(), ret.data());
+    }
+    return ret;
+}
+
+// Read the zero-suppressed waveforms from an npz file produced by
+// `extract_larsoft_waveforms --roi-threshold` (see roi.h). Nothing is
+// densified: use densify() or densify_row() on the result to get the
+// full waveforms of all of the channels, or just the ones needed
+inline SparseWaveforms read_samples_sparse(const char* inputfile)
+{
+    SparseWaveforms ret;
+    try{
+        cnpy::NpzFile npz(inputfile);
+        ret.nsamples=load_npz_vector<int64_t>(npz, "nsamples").at(0);
+        ret.events=load_npz_vector<int>(npz, "events");
+        ret.channels=load_npz_vector<int>(npz, "channels");
+        ret.baselines=load_npz_vector<short>(npz, "baselines");
+        ret.roi_offsets=load_npz_vector<int64_t>(npz, "roi_offsets");
+        ret.roi_starts=load_npz_vector<int>(npz, "roi_starts");
+        ret.value_offsets=load_npz_vector<int64_t>(npz, "value_offsets");
+        // The values are most of the file, so inflate them on all the cores
+        ret.values=load_npz_vector<short>(npz, "values", default_nthreads(0));
+    }
+    catch(std::exception const& e){
+        std::cerr << inputfile << " is not a zero-suppressed waveform file: " << e.what() << std::endl;
+        exit(1);
+    }
+
+    // Check the offsets, so that densifying can't go out of bounds
+    const size_t nrows=ret.channels.size();
+    bool ok=ret.events.size()==nrows && ret.baselines.size()==nrows &&
+        ret.roi_offsets.size()==nrows+1 && ret.value_offsets.size()==ret.nrois()+1 &&
+        ret.roi_offsets.front()==0 && ret.roi_offsets.back()==(int64_t)ret.nrois() &&
+        ret.value_offsets.front()==0 && ret.value_offsets.back()==(int64_t)ret.values.size();
+    for(size_t i=0; ok && i<nrows; ++i){
+        ok=ret.roi_offsets[i]<=ret.roi_offsets[i+1];
+    }
+    for(size_t j=0; ok && j<ret.nrois(); ++j){
+        ok=ret.value_offsets[j]<=ret.value_offsets[j+1] && ret.roi_starts[j]>=0 &&
+            ret.roi_starts[j]+(ret.value_offsets[j+1]-ret.value_offsets[j])<=(int64_t)ret.nsamples;
+    }
+    if(!ok){
+        std::cerr << inputfile << " has inconsistent ROI offsets" << std::endl;
+        exit(1);
+    }
+    return ret;
+}
+
+// Read up to `max_channels` channels from an npz file produced by
+// `extract_larsoft_waveforms --split`, which has the samples in a 2D
+// array "samples" (usually int16), and the event and channel numbers
+// in 1D arrays "events" and "channels". Zero-suppressed files (see
+// read_samples_sparse) are densified
+template<class T>
+Waveforms<T> read_samples_npz(const char* inputfile, unsigned int max_channels)
+{
+    Waveforms<T> ret;
+
+    // Only the arrays we need are read, so any others in the file cost nothing
+    cnpy::NpzFile npz(inputfile);
+    if(npz.contains("roi_offsets")){
+        SparseWaveforms sparse=read_samples_sparse(inputfile);
+        size_t nchannels=sparse.nrows();
+        if(max_channels>0 && max_channels<nchannels) nchannels=max_channels;
+        ret.samples.resize(nchannels);
+        for(size_t ichan=0; ichan<nchannels; ++ichan){
+            ret.channels.push_back(modified_channel(sparse.events[ichan], sparse.channels[ichan]));
+            ret.samples[ichan].resize(sparse.nsamples);
+            densify_row(sparse, ichan, ret.samples[ichan].data());
+        }
+        return ret;
+    }
+    if(!npz.contains("samples") || !npz.contains("channels") || !npz.contains("events")){
+        std::cerr << inputfile << " doesn't contain samples, channels and events arrays" << std::endl;
+        exit(1);
+    }
+    // The samples are most of the file, so inflate them on all the cores
+    cnpy::NpyArray samples=npz.load("samples", default_nthreads(0));
+    cnpy::NpyArray channels_arr=npz.load("channels");
+    cnpy::NpyArray events_arr=npz.load("events");
+    const int* channels=channels_arr.data<int>();
+    const int* events=events_arr.data<int>();
+
+    size_t nchannels=samples.shape[0];
+    if(max_channels>0 && max_channels<nchannels) nchannels=max_channels;
+    size_t nsamples=samples.shape[1];
+    ret.samples.resize(nchannels);
+    for(size_t ichan=0; ichan<nchannels; ++ichan){
+        ret.channels.push_back(modified_channel(events[ichan], channels[ichan]));
+
+        const size_t offset=ichan*nsamples;
+        if(samples.word_size==2){
+            const short* row=samples.data<short>()+offset;
+            ret.samples[ichan].assign(row, row+nsamples);
+        }
+        else if(samples.word_size==4){
+            const int* row=samples.data<int>()+offset;
+            ret.samples[ichan].assign(row, row+nsamples);
         }
         else{
-            if(chan_samples.size() != nsamples){
-                std::cerr << "Got " << ret.samples[ichan].size() << " samples on channel " << ichan << ": expected " << nsamples << std::endl;
-                exit(1);
-            }
+            std::cerr << "Unsupported sample size " << samples.word_size << " in " << inputfile << std::endl;
+            exit(1);
         }
-        ret.samples.push_back(chan_samples);
-        ++ichan;
+    }
+
+    return ret;
+}
+
+// Open `inputfile` for reading, exiting if that fails
+inline int open_or_exit(const char* inputfile)
+{
+    int fd=open(inputfile, O_RDONLY);
+    if(fd<0){
+        std::cerr << "Unable to open " << inputfile << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    return fd;
+}
+
+// Read exactly `n` bytes at `offset` in `fd`, which is open on
+// `inputfile`, into `dst`
+inline void read_file_at(int fd, const char* inputfile, char* dst, size_t n, size_t offset)
+{
+    while(n>0){
+        ssize_t nread=pread(fd, dst, n, offset);
+        if(nread<0 && errno==EINTR) continue;
+        if(nread<=0){
+            std::cerr << "Failed to read " << inputfile << ": " << (nread<0 ? strerror(errno) : "file is too short") << std::endl;
+            exit(1);
+        }
+        dst+=nread;
+        n-=nread;
+        offset+=nread;
+    }
+}
+
+// Read the header of the numpy file open as `fd`, and check that it's
+// a 2D array of rows of event number, channel number and samples
+inline cnpy::NpyInfo read_waveform_npy_header(int fd, const char* inputfile)
+{
+    // Read the fixed part of the header to find out how long the rest is
+    std::vector<char> header(12);
+    read_file_at(fd, inputfile, header.data(), header.size(), 0);
+    size_t header_len=0;
+    if(header[6]==1){
+        uint16_t len;
+        memcpy(&len, &header[8], sizeof(len));
+        header_len=10+len;
+    }
+    else{
+        uint32_t len;
+        memcpy(&len, &header[8], sizeof(len));
+        header_len=12+len;
+    }
+    header.resize(header_len);
+    read_file_at(fd, inputfile, header.data(), header.size(), 0);
 
-        if(max_channels>0 && ichan>=max_channels) break;
+    cnpy::NpyInfo info;
+    try{
+        info=cnpy::parse_npy_info(header.data(), header.size());
     }
-    // Check we filled all the channels
-    if(ret.samples.back().size()!=nsamples){
-        std::cerr << "Didn't read all the channels" << std::endl;
+    catch(std::runtime_error const& e){
+        std::cerr << inputfile << ": " << e.what() << std::endl;
         exit(1);
     }
+    if(info.fortran_order || info.shape.size()!=2 || info.shape[1]<2){
+        std::cerr << inputfile << " is not a 2D array of rows of event number, channel number and samples" << std::endl;
+        exit(1);
+    }
+    return info;
+}
+
+// Reads a numpy file produced by `extract_larsoft_waveforms --numpy` a
+// block of channels at a time, so that the memory used is the same
+// however big the file is. Each block is read with one pread() into a
+// buffer that is reused from block to block, and then converted to T
+// into a WaveformMatrix, which is also reused if the caller passes the
+// same one each time:
+//
+//   WaveformBlockReader<short> reader("wf.npy", 1000);
+//   WaveformMatrix<short> block;
+//   while(reader.next(block)){ ... }
+//
+// The channel numbers in the blocks are as they are in the file, ie
+// not modified
+template<class T>
+class WaveformBlockReader
+{
+public:
+    // Read `block_channels` channels at a time, stopping after
+    // `max_channels` channels if it is nonzero
+    WaveformBlockReader(const char* inputfile, size_t block_channels, unsigned int max_channels=0)
+        : m_filename(inputfile), m_block_channels(std::max<size_t>(block_channels, 1))
+    {
+        m_fd=open_or_exit(inputfile);
+        posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        m_info=read_waveform_npy_header(m_fd, inputfile);
+        m_nrows=m_info.shape[0];
+        if(max_channels>0 && max_channels<m_nrows) m_nrows=max_channels;
+        m_row_bytes=m_info.shape[1]*m_info.word_size;
+    }
+
+    ~WaveformBlockReader()
+    {
+        close(m_fd);
+    }
+
+    WaveformBlockReader(WaveformBlockReader const&) = delete;
+    WaveformBlockReader& operator=(WaveformBlockReader const&) = delete;
+
+    // Number of channels that will be read in total
+    size_t nrows() const { return m_nrows; }
+    size_t nsamples() const { return m_info.shape[1]-2; }
+
+    // Read the next block of channels into `block`, replacing what's
+    // in it. Returns false, leaving `block` alone, once all of the
+    // channels have been read
+    bool next(WaveformMatrix<T>& block)
+    {
+        if(m_next_row>=m_nrows) return false;
+        const size_t n=std::min(m_block_channels, m_nrows-m_next_row);
+        m_buffer.resize(n*m_row_bytes);
+        read_file_at(m_fd, m_filename.c_str(), m_buffer.data(), m_buffer.size(), m_info.header_size+m_next_row*m_row_bytes);
+
+        block.nsamples=nsamples();
+        block.resize(n);
+        for(size_t i=0; i<n; ++i){
+            const char* row=m_buffer.data()+i*m_row_bytes;
+            cnpy::convert_npy_data(row, m_info.type, m_info.word_size, 1, &block.events[i]);
+            cnpy::convert_npy_data(row+m_info.word_size, m_info.type, m_info.word_size, 1, &block.channels[i]);
+            cnpy::convert_npy_data(row+2*m_info.word_size, m_info.type, m_info.word_size, block.nsamples, block.row(i));
+        }
+        m_next_row+=n;
+        return true;
+    }
+
+private:
+    std::string m_filename;
+    int m_fd=-1;
+    cnpy::NpyInfo m_info;
+    size_t m_block_channels;
+    size_t m_nrows=0;
+    size_t m_row_bytes=0;
+    size_t m_next_row=0;
+    // The raw bytes of the current block, as they are in the file
+    std::vector<char> m_buffer;
+};
+
+// Read up to `max_channels` channels from a numpy file produced by
+// `extract_larsoft_waveforms`, in either the plain numpy format, where
+// each row is the event number, channel number and samples, or the
+// split npz format
+template<class T>
+Waveforms<T> read_samples_npy(const char* inputfile, unsigned int max_channels)
+{
+    if(is_npz_file(inputfile)) return read_samples_npz<T>(inputfile, max_channels);
+
+    Waveforms<T> ret;
+
+    // Read the channels a block at a time, so that only the channels
+    // we want are read, and the whole file is never in memory twice
+    WaveformBlockReader<T> reader(inputfile, 1024, max_channels);
+    WaveformMatrix<T> block;
+    ret.channels.reserve(reader.nrows());
+    ret.samples.reserve(reader.nrows());
+    while(reader.next(block)){
+        for(size_t i=0; i<block.nrows(); ++i){
+            // The first two entries in each line are the event number and
+            // channel number
+            ret.channels.push_back(modified_channel(block.events[i], block.channels[i]));
+            ret.samples.emplace_back(block.row(i), block.row(i)+block.nsamples);
+        }
+    }
 
     return ret;
 }
 
+// Read up to `max_channels` channels of event number `event` from a
+// container file produced by the extractors' `--container` option.
+// The container's index is used to go straight to the event, so this
+// doesn't depend on how many other events are in the file. To read
+// many events from one file, use a ContainerReader directly, so that
+// the index is only read once
 template<class T>
-Waveforms<T> read_samples_npy(const char* inputfile, unsigned int max_channels)
+Waveforms<T> read_samples_container(const char* inputfile, int64_t event, unsigned int max_channels)
 {
     Waveforms<T> ret;
 
-    cnpy::NpyArray arr = cnpy::npy_load(inputfile);
-    int nchannels=max_channels>0 ? max_channels : arr.shape[0];
-    int nsamples=arr.shape[1];
-    int nadcsamples=nsamples-2;
+    ContainerReader reader(inputfile);
+    WaveformMatrix<T> m=reader.read_event<T>(event);
+    size_t nchannels=m.nrows();
+    if(max_channels>0 && max_channels<nchannels) nchannels=max_channels;
     ret.samples.resize(nchannels);
-    for(int ichan=0; ichan<nchannels; ++ichan){
-        // The first two entries in each line are the event number and
-        // channel number. We're going to hack things and pretend that
-        // everything comes from one events with way more channels than
-        // there actually are, so I don't have to separate out events
-        // later. The simulated geometry is 1x2x6, ie 12 APAs, so just
-        // offset the channel number by (evt no)*(channels per
-        // APA)*(1*2*6)
-        int evtno=arr.data<int>()[ichan*nsamples+0];
-        int chno=arr.data<int>()[ichan*nsamples+1];
-        const int channels_per_apa=2560;
-        int modified_chno=evtno*channels_per_apa*12+chno;
-        ret.channels.push_back(modified_chno);
-        
-        for(int isample=2; isample<nsamples; ++isample){
-            int sample=arr.data<int>()[ichan*nsamples+isample];
-            ret.samples[ichan].push_back((T)sample);
-        }
-    }
-
-    // Check we filled all the channels
-    if(ret.samples.back().size()!=nadcsamples){
-        std::cerr << "Didn't read all the channels" << std::endl;
+    for(size_t ichan=0; ichan<nchannels; ++ichan){
+        ret.channels.push_back(modified_channel(event, m.channels[ichan]));
+        ret.samples[ichan].assign(m.row(ichan), m.row(ichan)+m.nsamples);
+    }
+
+    return ret;
+}
+
+// One channel's samples in a mapped file. `samples` points straight
+// into the mapping, so it's only valid while the WaveformView it came
+// from (or a copy of it) exists
+template<class T>
+struct WaveformRowView
+{
+    // Channel number, modified as by modified_channel()
+    int channel;
+    const T* samples;
+    size_t nsamples;
+
+    const T* begin() const { return samples; }
+    const T* end() const { return samples+nsamples; }
+    T operator[](size_t i) const { return samples[i]; }
+};
+
+// A numpy file produced by `extract_larsoft_waveforms --numpy`, mapped
+// into memory. Nothing is copied or read up front: each row is read
+// from disk by the OS the first time it's looked at
+template<class T>
+struct WaveformView
+{
+    std::shared_ptr<MappedFile> file;
+    // Start of the array in the mapping. Each row is the event
+    // number, the channel number, then `nsamples` samples
+    const T* data=nullptr;
+    size_t nrows=0;
+    size_t nsamples=0;
+
+    size_t row_length() const { return nsamples+2; }
+
+    WaveformRowView<T> row(size_t ichan) const
+    {
+        const T* r=data+ichan*row_length();
+        return WaveformRowView<T>{modified_channel(r[0], r[1]), r+2, nsamples};
+    }
+};
+
+// Map up to `max_channels` channels of `inputfile`, a numpy file
+// produced by `extract_larsoft_waveforms --numpy`, without reading or
+// copying any of the samples. T must be the type stored in the file
+// (int, for files from the extractors), since the samples are used
+// in place
+template<class T>
+WaveformView<T> read_samples_mmap(const char* inputfile, unsigned int max_channels)
+{
+    WaveformView<T> ret;
+    ret.file=std::make_shared<MappedFile>(inputfile);
+    const char* base=ret.file->data();
+
+    cnpy::NpyInfo info;
+    try{
+        info=cnpy::parse_npy_info(base, ret.file->size());
+    }
+    catch(std::runtime_error const& e){
+        std::cerr << inputfile << ": " << e.what() << std::endl;
+        exit(1);
+    }
+    if(info.type!=cnpy::map_type(typeid(T)) || info.word_size!=sizeof(T)){
+        std::cerr << inputfile << " has samples of type " << info.type << info.word_size << ", which doesn't match the requested type" << std::endl;
+        exit(1);
+    }
+    if(info.fortran_order || info.shape.size()!=2 || info.shape[1]<2){
+        std::cerr << inputfile << " is not a 2D array of rows of event number, channel number and samples" << std::endl;
+        exit(1);
+    }
+    if(info.header_size+info.num_vals()*sizeof(T)>ret.file->size()){
+        std::cerr << inputfile << " is shorter than its header says" << std::endl;
+        exit(1);
+    }
+    if(info.header_size%alignof(T)!=0){
+        std::cerr << inputfile << " has misaligned data" << std::endl;
         exit(1);
     }
 
+    ret.data=reinterpret_cast<const T*>(base+info.header_size);
+    ret.nrows=info.shape[0];
+    if(max_channels>0 && max_channels<ret.nrows) ret.nrows=max_channels;
+    ret.nsamples=info.shape[1]-2;
     return ret;
 }
 
+// Call `read(first_row, nrows, buffer)` to read each run of rows in
+// `selected` that are next to each other in the file, up to a few
+// megabytes at a time, and then `store(i, row)` for each entry
+// selected[i], with `row` pointing to its `row_bytes` bytes in the
+// buffer. The runs are read in file order, whatever order `selected`
+// is in
+template<class R, class S>
+void read_row_runs(std::vector<ChannelIndexEntry> const& selected, size_t row_bytes, R&& read, S&& store)
+{
+    std::vector<size_t> order(selected.size());
+    for(size_t i=0; i<order.size(); ++i) order[i]=i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b){ return selected[a].row<selected[b].row; });
+
+    const size_t max_run_rows=std::max<size_t>(1, (4<<20)/std::max<size_t>(row_bytes, 1));
+    std::vector<char> buffer;
+    for(size_t i=0; i<order.size(); ){
+        size_t j=i+1;
+        while(j<order.size() && j-i<max_run_rows &&
+              selected[order[j]].row==selected[order[j-1]].row+1) ++j;
+        buffer.resize((j-i)*row_bytes);
+        read(selected[order[i]].row, j-i, buffer.data());
+        for(size_t k=i; k<j; ++k){
+            store(order[k], buffer.data()+(k-i)*row_bytes);
+        }
+        i=j;
+    }
+}
+
+// Check that the rows in `selected` are all in a file with `nrows` rows
+inline void check_selected_rows(std::vector<ChannelIndexEntry> const& selected, size_t nrows, const char* inputfile)
+{
+    for(auto const& e: selected){
+        if(e.row<0 || (size_t)e.row>=nrows){
+            std::cerr << "Channel index for " << inputfile << " points to row " << e.row << ", but the file only has " << nrows << " rows" << std::endl;
+            exit(1);
+        }
+    }
+}
+
+// Read only the channels in `mask` from `inputfile`, produced by
+// `extract_larsoft_waveforms` in the numpy or split npz format, into a
+// matrix with the rows in channel order. The channel numbers are as
+// they are in the file, ie not modified. Only the selected rows are
+// read from disk, and rows that are next to each other in the file are
+// read together.
+//
+// For numpy files, the rows are found with the channel index written
+// next to the file by `--channel-index` (see channel_index.h). If
+// there isn't one, the whole file has to be read once to get the
+// channel numbers. For split npz files, the "channels" array does the
+// job of the index, and if the file is compressed, only the pieces of
+// the samples that hold the selected rows are inflated
+template<class T>
+WaveformMatrix<T> read_samples_channels(const char* inputfile, ChannelMask const& mask)
+{
+    if(is_npz_file(inputfile)){
+        try{
+            cnpy::NpzFile npz(inputfile);
+            if(!npz.contains("samples") || !npz.contains("channels") || !npz.contains("events")){
+                std::cerr << inputfile << " doesn't contain samples, channels and events arrays" << std::endl;
+                exit(1);
+            }
+            const std::vector<int> events=load_npz_vector<int>(npz, "events");
+            const std::vector<ChannelIndexEntry> selected=select_channels(make_channel_index(load_npz_vector<int>(npz, "channels")), mask);
+            const cnpy::NpyInfo info=npz.info("samples");
+            if(info.shape.size()!=2 || info.shape[0]!=events.size()){
+                std::cerr << inputfile << " has samples of the wrong shape" << std::endl;
+                exit(1);
+            }
+            check_selected_rows(selected, events.size(), inputfile);
+
+            WaveformMatrix<T> ret(info.shape[1]);
+            ret.resize(selected.size());
+            const size_t row_bytes=info.shape[1]*info.word_size;
+            read_row_runs(selected, row_bytes,
+                          [&](size_t first, size_t n, char* buffer){
+                              npz.read_data("samples", first*row_bytes, n*row_bytes, buffer);
+                          },
+                          [&](size_t i, const char* row){
+                              ret.events[i]=events[selected[i].row];
+                              ret.channels[i]=selected[i].channel;
+                              cnpy::convert_npy_data(row, info.type, info.word_size, ret.nsamples, ret.row(i));
+                          });
+            return ret;
+        }
+        catch(std::runtime_error const& e){
+            std::cerr << inputfile << ": " << e.what() << std::endl;
+            exit(1);
+        }
+    }
+
+    std::vector<ChannelIndexEntry> index;
+    const std::string index_file=channel_index_filename(inputfile);
+    if(access(index_file.c_str(), R_OK)==0){
+        try{
+            index=load_channel_index(index_file);
+        }
+        catch(std::runtime_error const& e){
+            std::cerr << e.what() << std::endl;
+            exit(1);
+        }
+    }
+    else{
+        std::vector<int> channels;
+        WaveformBlockReader<int> reader(inputfile, 1024);
+        WaveformMatrix<int> block;
+        while(reader.next(block)){
+            channels.insert(channels.end(), block.channels.begin(), block.channels.end());
+        }
+        index=make_channel_index(channels);
+    }
+
+    const int fd=open_or_exit(inputfile);
+    const cnpy::NpyInfo info=read_waveform_npy_header(fd, inputfile);
+    const std::vector<ChannelIndexEntry> selected=select_channels(index, mask);
+    check_selected_rows(selected, info.shape[0], inputfile);
+
+    WaveformMatrix<T> ret(info.shape[1]-2);
+    ret.resize(selected.size());
+    const size_t row_bytes=info.shape[1]*info.word_size;
+    read_row_runs(selected, row_bytes,
+                  [&](size_t first, size_t n, char* buffer){
+                      read_file_at(fd, inputfile, buffer, n*row_bytes, info.header_size+first*row_bytes);
+                  },
+                  [&](size_t i, const char* row){
+                      cnpy::convert_npy_data(row, info.type, info.word_size, 1, &ret.events[i]);
+                      cnpy::convert_npy_data(row+info.word_size, info.type, info.word_size, 1, &ret.channels[i]);
+                      cnpy::convert_npy_data(row+2*info.word_size, info.type, info.word_size, ret.nsamples, ret.row(i));
+                  });
+    close(fd);
+    return ret;
+}
+
+// Filter each waveform in `w` with the FIR filter `taps` (see
+// fir_filter.h), in place, using `nthreads` threads (0 means one per
+// core). All of the waveforms must have the same number of samples
+template<class T>
+void filter_waveforms(Waveforms<T>& w, std::vector<float> const& taps, unsigned int nthreads=0)
+{
+    if(w.samples.empty()) return;
+    const size_t nsamples=w.samples[0].size();
+    for(auto const& row: w.samples){
+        if(row.size()!=nsamples){
+            std::cerr << "filter_waveforms: waveforms have different numbers of samples" << std::endl;
+            exit(1);
+        }
+    }
+    ThreadPool pool(default_nthreads(nthreads));
+    std::vector<FirFilter> filters(pool.size(), FirFilter(taps));
+    fir_filter_rows(w.samples.size(), nsamples, [&](size_t i){ return w.samples[i].data(); },
+                    filters, pool, [](size_t){});
+}
+
 #endif // include guard
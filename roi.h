@@ -0,0 +1,153 @@
+#ifndef ROI_H
+#define ROI_H
+
+// Zero-suppressed waveforms: only the regions of interest (ROIs) around
+// samples that stand out from the channel's baseline are kept, with
+// some padding either side, and everything else is taken to be at the
+// baseline
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <utility> // for std::pair
+#include <vector>
+
+#include "cnpy.h"
+#include "output_file.h"
+#include "parallel.h"
+#include "waveform_matrix.h"
+
+// The ROIs of an event's channels, in a CSR-like layout: the ROIs of
+// row `i` are ROIs roi_offsets[i] to roi_offsets[i+1]-1, and the
+// samples of ROI `j`, starting at tick roi_starts[j], are
+// values[value_offsets[j]] to values[value_offsets[j+1]-1]
+struct SparseWaveforms
+{
+    // Number of ticks in each channel's full waveform
+    size_t nsamples=0;
+    // One entry per row (ie, per channel)
+    std::vector<int> events;
+    std::vector<int> channels;
+    // The value of the ticks outside the ROIs
+    std::vector<short> baselines;
+    std::vector<int64_t> roi_offsets;
+    // One entry per ROI
+    std::vector<int> roi_starts;
+    std::vector<int64_t> value_offsets;
+    std::vector<short> values;
+
+    size_t nrows() const { return channels.size(); }
+    size_t nrois() const { return roi_starts.size(); }
+};
+
+// Append to `rois` the ticks [begin, end) of each ROI of the `n`
+// samples at `row`: the ticks at least `threshold` away from
+// `baseline`, with `pre` ticks before and `post` ticks after. ROIs
+// whose padding would overlap are merged
+inline void find_rois(const short* row, size_t n, short baseline, int threshold,
+                      int pre, int post, std::vector<std::pair<int, int> >& rois)
+{
+    auto is_signal=[&](size_t i){ return std::abs(row[i]-baseline)>=threshold; };
+    size_t i=0;
+    while(i<n){
+        while(i<n && !is_signal(i)) ++i;
+        if(i==n) break;
+        const size_t begin=i>(size_t)pre ? i-pre : 0;
+        // Keep going until the gap to the next signal tick is too big
+        // for the padding to bridge
+        size_t last=i;
+        for(++i; i<n && i<=last+post+pre; ++i){
+            if(is_signal(i)) last=i;
+        }
+        rois.emplace_back(begin, std::min(n, last+post+1));
+    }
+}
+
+// Zero-suppress `m`, whose row `i` has the baseline `baselines[i]`.
+// The rows are done in parallel on `pool`: the ROIs of each row are
+// found first, which says where each row's values go, and then the
+// values are copied in
+inline SparseWaveforms zero_suppress(WaveformMatrix<short> const& m, std::vector<short> const& baselines,
+                                     int threshold, int pre, int post, ThreadPool& pool)
+{
+    SparseWaveforms ret;
+    ret.nsamples=m.nsamples;
+    ret.events=m.events;
+    ret.channels=m.channels;
+    ret.baselines=baselines;
+
+    const size_t nrows=m.nrows();
+    std::vector<std::vector<std::pair<int, int> > > row_rois(nrows);
+    pool.parallel_for(nrows, [&](size_t i, unsigned int){
+        find_rois(m.row(i), m.nsamples, baselines[i], threshold, pre, post, row_rois[i]);
+    }, 16);
+
+    ret.roi_offsets.resize(nrows+1, 0);
+    ret.value_offsets.push_back(0);
+    for(size_t i=0; i<nrows; ++i){
+        for(auto const& roi: row_rois[i]){
+            ret.roi_starts.push_back(roi.first);
+            ret.value_offsets.push_back(ret.value_offsets.back()+roi.second-roi.first);
+        }
+        ret.roi_offsets[i+1]=ret.roi_starts.size();
+    }
+
+    ret.values.resize(ret.value_offsets.back());
+    pool.parallel_for(nrows, [&](size_t i, unsigned int){
+        for(int64_t j=ret.roi_offsets[i]; j<ret.roi_offsets[i+1]; ++j){
+            const short* begin=m.row(i)+ret.roi_starts[j];
+            std::copy(begin, begin+(ret.value_offsets[j+1]-ret.value_offsets[j]), ret.values.begin()+ret.value_offsets[j]);
+        }
+    }, 16);
+    return ret;
+}
+
+// Fill `out`, which has room for s.nsamples values, with the full
+// waveform of row `i` of `s`
+template<class T>
+void densify_row(SparseWaveforms const& s, size_t i, T* out)
+{
+    std::fill(out, out+s.nsamples, s.baselines[i]);
+    for(int64_t j=s.roi_offsets[i]; j<s.roi_offsets[i+1]; ++j){
+        std::copy(s.values.begin()+s.value_offsets[j], s.values.begin()+s.value_offsets[j+1], out+s.roi_starts[j]);
+    }
+}
+
+// The full waveforms of all of the rows of `s`
+template<class T>
+WaveformMatrix<T> densify(SparseWaveforms const& s)
+{
+    WaveformMatrix<T> ret(s.nsamples);
+    ret.resize(s.nrows());
+    ret.events=s.events;
+    ret.channels=s.channels;
+    for(size_t i=0; i<s.nrows(); ++i){
+        densify_row(s, i, ret.row(i));
+    }
+    return ret;
+}
+
+// Write `s` to the npz file `filename`, with an array for each member
+// of SparseWaveforms, named the same, and "nsamples" as a 1-element
+// array. The arrays are deflated at zlib level `compression_level`
+// using `nthreads` threads, and written with `backend` (see
+// output_file.h)
+inline void save_sparse_waveforms(std::string const& filename, SparseWaveforms const& s,
+                                  int compression_level=0, unsigned int nthreads=1,
+                                  IoBackend backend=IoBackend::Stdio)
+{
+    const int64_t nsamples=s.nsamples;
+    std::vector<cnpy::NpzMember> members;
+    members.push_back(cnpy::npz_member("nsamples", &nsamples, {1}));
+    members.push_back(cnpy::npz_member("events", s.events.data(), {s.events.size()}));
+    members.push_back(cnpy::npz_member("channels", s.channels.data(), {s.channels.size()}));
+    members.push_back(cnpy::npz_member("baselines", s.baselines.data(), {s.baselines.size()}));
+    members.push_back(cnpy::npz_member("roi_offsets", s.roi_offsets.data(), {s.roi_offsets.size()}));
+    members.push_back(cnpy::npz_member("roi_starts", s.roi_starts.data(), {s.roi_starts.size()}));
+    members.push_back(cnpy::npz_member("value_offsets", s.value_offsets.data(), {s.value_offsets.size()}));
+    members.push_back(cnpy::npz_member("values", s.values.data(), {s.values.size()}));
+    save_npz_members(filename, members, compression_level, nthreads, backend);
+}
+
+#endif // include guard
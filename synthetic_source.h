@@ -0,0 +1,343 @@
+#ifndef SYNTHETIC_SOURCE_H
+#define SYNTHETIC_SOURCE_H
+
+// Events made up on the spot rather than read from a file, so that the
+// extractors can be run, timed and compared against earlier versions
+// on a machine without any art/ROOT input files. An input named
+// "synthetic:" followed by a list of settings "key=value" separated by
+// commas, eg "synthetic:events=20,ticks=6000,compress=huffman", is read
+// from a SyntheticEventSource with those settings. The same settings
+// always give the same events
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lardataobj/RawData/raw.h"
+
+#include "event_source.h"
+
+// The settings of a synthetic input
+struct SyntheticConfig
+{
+    // Number of events, and the ID of the first one. The rest follow on
+    int events=10;
+    int run=1;
+    int subrun=1;
+    int first_event=1;
+    // The raw digits: `channels` channels of `ticks` ticks, each with
+    // a pedestal within 20 counts of `pedestal`, gaussian noise with
+    // an rms of `noise` counts, and the pulses of `tracks` straight
+    // tracks, each `amplitude` counts high on average. The digits are
+    // huffman compressed with "compress=huffman"
+    int channels=2560;
+    int ticks=6000;
+    int pedestal=900;
+    double noise=3;
+    int tracks=5;
+    double amplitude=50;
+    raw::Compress_t compression=raw::kNone;
+    // The photon detector waveforms: one from each of `opdets`
+    // channels, of `opticks` ticks, each with `photons` pulses on top
+    // of a baseline of 1500 counts
+    int opdets=24;
+    int opticks=1000;
+    int photons=5;
+    // The trigger flags of every event, for --trig
+    int trigger=12;
+    unsigned int seed=1;
+};
+
+const std::string synthetic_input_prefix="synthetic:";
+
+// Whether the input `input` is a synthetic one
+inline bool is_synthetic_input(std::string const& input)
+{
+    return input.compare(0, synthetic_input_prefix.size(), synthetic_input_prefix)==0;
+}
+
+// The settings in the synthetic input `input`. Settings that aren't
+// given keep their defaults. Throws std::invalid_argument if any of
+// them can't be parsed
+inline SyntheticConfig parse_synthetic_input(std::string const& input)
+{
+    SyntheticConfig config;
+    std::istringstream iss(input.substr(synthetic_input_prefix.size()));
+    for(std::string item; std::getline(iss, item, ','); ){
+        if(item.empty()) continue;
+        const size_t eq=item.find('=');
+        const std::string key=item.substr(0, eq);
+        const std::string value=(eq==std::string::npos) ? "" : item.substr(eq+1);
+        auto number=[&](double min)->double{
+            size_t pos=0;
+            double ret=0;
+            try{
+                ret=std::stod(value, &pos);
+            }
+            catch(std::exception const&){
+                pos=0;
+            }
+            if(value.empty() || pos!=value.size() || ret<min){
+                throw std::invalid_argument("bad synthetic input setting \""+item+"\"");
+            }
+            return ret;
+        };
+        if(key=="events") config.events=number(0);
+        else if(key=="run") config.run=number(0);
+        else if(key=="subrun") config.subrun=number(0);
+        else if(key=="first_event") config.first_event=number(0);
+        else if(key=="channels") config.channels=number(0);
+        else if(key=="ticks") config.ticks=number(1);
+        else if(key=="pedestal") config.pedestal=number(0);
+        else if(key=="noise") config.noise=number(0);
+        else if(key=="tracks") config.tracks=number(0);
+        else if(key=="amplitude") config.amplitude=number(0);
+        else if(key=="opdets") config.opdets=number(0);
+        else if(key=="opticks") config.opticks=number(1);
+        else if(key=="photons") config.photons=number(0);
+        else if(key=="trigger") config.trigger=number(0);
+        else if(key=="seed") config.seed=number(0);
+        else if(key=="compress"){
+            if(value=="none") config.compression=raw::kNone;
+            else if(value=="huffman") config.compression=raw::kHuffman;
+            else throw std::invalid_argument("bad synthetic input setting \""+item+"\": compress must be none or huffman");
+        }
+        else{
+            throw std::invalid_argument("unknown synthetic input setting \""+item+"\"");
+        }
+    }
+    return config;
+}
+
+// The events of a synthetic input. Each product is only made when it's
+// first asked for, from a random number generator seeded with the
+// seed and the entry, so any entry can be gone to directly. The tag
+// asked for is ignored, since there's only one product of each type.
+// There are no SimChannels, so the truth can't be extracted
+class SyntheticEventSource : public EventSource
+{
+public:
+    explicit SyntheticEventSource(SyntheticConfig const& config)
+        : m_config(config)
+    {
+        // Drawing a gaussian for every tick would make the events much
+        // more slowly than they're extracted, so the noise of each
+        // waveform is instead a stretch of this table, from a random
+        // starting point
+        std::mt19937 rng(m_config.seed);
+        std::normal_distribution<double> gaus(0, m_config.noise);
+        m_noise.resize(noise_table_size+std::max(m_config.ticks, m_config.opticks));
+        for(short& n: m_noise) n=std::lround(gaus(rng));
+        std::uniform_int_distribution<int> offset(-20, 20);
+        m_pedestals.resize(m_config.channels);
+        for(int& p: m_pedestals) p=m_config.pedestal+offset(rng);
+    }
+
+    long long numberOfEventsInFile() const override { return m_config.events; }
+
+    void goToEntry(long long entry) override
+    {
+        if(entry<0 || entry>=m_config.events){
+            throw std::out_of_range("synthetic input has no entry "+std::to_string(entry));
+        }
+        m_entry=entry;
+        // One event every 10ms, in 50MHz clock ticks
+        m_timestamp=entry*500000;
+        m_aux=art::EventAuxiliary(art::EventID(m_config.run, m_config.subrun, m_config.first_event+entry),
+                                  art::Timestamp(m_timestamp), false);
+        make_tracks();
+        m_haveDigits=m_haveWaveforms=m_haveHits=false;
+    }
+
+    art::EventAuxiliary const& eventAuxiliary() const override { return m_aux; }
+
+    std::vector<raw::RawDigit> const& raw_digits(art::InputTag const&) override
+    {
+        if(!m_haveDigits) make_digits();
+        m_haveDigits=true;
+        return m_digits;
+    }
+
+    std::vector<raw::OpDetWaveform> const& op_det_waveforms(art::InputTag const&) override
+    {
+        if(!m_haveWaveforms) make_waveforms();
+        m_haveWaveforms=true;
+        return m_waveforms;
+    }
+
+    std::vector<recob::Hit> const& hits(art::InputTag const&) override
+    {
+        if(!m_haveHits) make_hits();
+        m_haveHits=true;
+        return m_hits;
+    }
+
+    std::vector<sim::SimChannel> const& sim_channels(art::InputTag const&) override
+    {
+        throw std::runtime_error("synthetic events have no SimChannels");
+    }
+
+    std::vector<raw::RDTimeStamp> const& timestamps(art::InputTag const&) override
+    {
+        m_timestamps.assign(1, raw::RDTimeStamp(m_timestamp, m_config.trigger));
+        return m_timestamps;
+    }
+
+private:
+    static constexpr size_t noise_table_size=1<<16;
+
+    // A straight track across the channels [first_channel,
+    // last_channel], at tick `tick0` on the first channel, leaving a
+    // gaussian pulse on each channel
+    struct Track
+    {
+        int first_channel;
+        int last_channel;
+        double tick0;
+        double ticks_per_channel;
+        double amplitude;
+        double sigma;
+
+        double tick(int channel) const { return tick0+(channel-first_channel)*ticks_per_channel; }
+    };
+
+    // A generator for the product `product` of the current event
+    std::mt19937 generator(unsigned int product) const
+    {
+        std::seed_seq seq{m_config.seed, (unsigned int)m_entry, product};
+        return std::mt19937(seq);
+    }
+
+    void make_tracks()
+    {
+        std::mt19937 gen=generator(0);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        m_tracks.clear();
+        if(m_config.channels==0) return;
+        for(int i=0; i<m_config.tracks; ++i){
+            Track t;
+            t.first_channel=uniform(gen)*m_config.channels;
+            const int length=std::max(1.0, m_config.channels*(0.05+0.2*uniform(gen)));
+            t.last_channel=std::min(m_config.channels-1, t.first_channel+length);
+            t.tick0=uniform(gen)*m_config.ticks;
+            t.ticks_per_channel=6*uniform(gen)-3;
+            t.amplitude=m_config.amplitude*(0.5+uniform(gen));
+            t.sigma=1.5+1.5*uniform(gen);
+            m_tracks.push_back(t);
+        }
+    }
+
+    void make_digits()
+    {
+        std::mt19937 gen=generator(1);
+        std::uniform_int_distribution<size_t> offset(0, noise_table_size-1);
+        const int nticks=m_config.ticks;
+        m_digits.clear();
+        m_digits.reserve(m_config.channels);
+        std::vector<int> adcs(nticks);
+        for(int channel=0; channel<m_config.channels; ++channel){
+            const short* noise=m_noise.data()+offset(gen);
+            const int pedestal=m_pedestals[channel];
+            for(int i=0; i<nticks; ++i) adcs[i]=pedestal+noise[i];
+            for(Track const& t: m_tracks){
+                if(channel<t.first_channel || channel>t.last_channel) continue;
+                const double peak=t.tick(channel);
+                const int begin=std::max(0, (int)std::floor(peak-3*t.sigma));
+                const int end=std::min(nticks, (int)std::ceil(peak+3*t.sigma)+1);
+                for(int i=begin; i<end; ++i){
+                    const double x=(i-peak)/t.sigma;
+                    adcs[i]+=std::lround(t.amplitude*std::exp(-0.5*x*x));
+                }
+            }
+            // 12-bit ADCs
+            std::vector<short> adc(nticks);
+            for(int i=0; i<nticks; ++i) adc[i]=std::min(std::max(adcs[i], 0), 4095);
+            if(m_config.compression!=raw::kNone) raw::Compress(adc, m_config.compression);
+            m_digits.emplace_back(channel, nticks, std::move(adc), m_config.compression);
+        }
+    }
+
+    void make_waveforms()
+    {
+        std::mt19937 gen=generator(2);
+        std::uniform_int_distribution<size_t> offset(0, noise_table_size-1);
+        std::uniform_int_distribution<int> start(0, m_config.opticks-1);
+        std::uniform_real_distribution<double> height(10, 100);
+        m_waveforms.clear();
+        for(int opdet=0; opdet<m_config.opdets; ++opdet){
+            // The constructor only reserves room for the samples
+            raw::OpDetWaveform waveform(0, opdet, m_config.opticks);
+            waveform.resize(m_config.opticks);
+            const short* noise=m_noise.data()+offset(gen);
+            for(int i=0; i<m_config.opticks; ++i) waveform[i]=1500+noise[i];
+            // Each photon gives a fast rise and a slower exponential
+            // fall of 20 ticks
+            for(int p=0; p<m_config.photons; ++p){
+                const int t0=start(gen);
+                const double h=height(gen);
+                for(int i=t0; i<m_config.opticks && i<t0+100; ++i){
+                    waveform[i]+=std::lround(h*std::exp(-(i-t0)/20.0));
+                }
+            }
+            m_waveforms.push_back(std::move(waveform));
+        }
+    }
+
+    // A hit for each pulse of each track, as a hit finder would find
+    // it, in order of channel
+    void make_hits()
+    {
+        m_hits.clear();
+        for(int channel=0; channel<m_config.channels; ++channel){
+            for(Track const& t: m_tracks){
+                if(channel<t.first_channel || channel>t.last_channel) continue;
+                const double peak=t.tick(channel);
+                if(peak<0 || peak>=m_config.ticks) continue;
+                const float integral=t.amplitude*t.sigma*std::sqrt(2*M_PI);
+                m_hits.emplace_back(channel,
+                                    std::max(0, (int)std::floor(peak-3*t.sigma)),
+                                    std::min(m_config.ticks-1, (int)std::ceil(peak+3*t.sigma)),
+                                    peak, 1, t.sigma, t.amplitude, 1, integral, integral, 1,
+                                    1, 0, 1, 0, geo::kUnknown, geo::kMysteryType, geo::WireID());
+            }
+        }
+    }
+
+    SyntheticConfig m_config;
+    std::vector<short> m_noise;
+    std::vector<int> m_pedestals;
+
+    long long m_entry=-1;
+    uint64_t m_timestamp=0;
+    art::EventAuxiliary m_aux;
+    std::vector<Track> m_tracks;
+    bool m_haveDigits=false;
+    bool m_haveWaveforms=false;
+    bool m_haveHits=false;
+    std::vector<raw::RawDigit> m_digits;
+    std::vector<raw::OpDetWaveform> m_waveforms;
+    std::vector<recob::Hit> m_hits;
+    std::vector<raw::RDTimeStamp> m_timestamps;
+};
+
+// The source of the events of `input`: a SyntheticEventSource if it's
+// a synthetic input, or otherwise the art/ROOT file of that name
+inline std::unique_ptr<EventSource> open_event_source(std::string const& input)
+{
+    if(is_synthetic_input(input)){
+        return std::unique_ptr<EventSource>(new SyntheticEventSource(parse_synthetic_input(input)));
+    }
+#ifdef WAVEFORM_TOOLS_NO_GALLERY
+    throw std::runtime_error("Unable to read "+input+": this build only reads synthetic inputs (rebuild with -DWITH_GALLERY=ON)");
+#else
+    return std::unique_ptr<EventSource>(new GalleryEventSource(input));
+#endif
+}
+
+#endif // include guard
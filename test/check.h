@@ -0,0 +1,41 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+// What the tests check things with. CHECK(cond) reports the condition
+// and where it is if it's false, and check_result() is what main()
+// returns: nonzero if any check failed
+
+#include <cmath>
+#include <iostream>
+
+inline int& check_failures()
+{
+    static int nfailures=0;
+    return nfailures;
+}
+
+#define CHECK(cond) \
+    do{ \
+        if(!(cond)){ \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            ++check_failures(); \
+        } \
+    } while(0)
+
+// Whether `a` and `b` are within `tolerance` of each other
+inline bool close_to(double a, double b, double tolerance=1e-5)
+{
+    return std::fabs(a-b)<=tolerance;
+}
+
+inline int check_result()
+{
+    if(check_failures()!=0){
+        std::cerr << check_failures() << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
+
+#endif // include guard
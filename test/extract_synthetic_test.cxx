@@ -0,0 +1,110 @@
+// Run an extractor on a synthetic input, and check that the waveforms
+// it writes are those of the synthetic events. The first argument says
+// which extractor: "waveforms" for extract_larsoft_waveforms, whose
+// output should be the digits, or "photon" for
+// extract_photon_waveforms, whose output should be the optical
+// waveforms. The second is the path to it. Needs no input files, so it
+// can be run in a build without gallery
+
+#include "../read_samples.h"
+#include "../synthetic_source.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::map<int, std::vector<short> > WaveformsByChannel;
+
+// The waveforms of the current event of `ev`, as the extractor for
+// `kind` should write them
+WaveformsByChannel expected_waveforms(SyntheticEventSource& ev, std::string const& kind)
+{
+    WaveformsByChannel ret;
+    if(kind=="photon"){
+        for(auto const& waveform: ev.op_det_waveforms(art::InputTag{"daq"})){
+            ret[waveform.ChannelNumber()].assign(waveform.begin(), waveform.end());
+        }
+        return ret;
+    }
+    for(auto const& digit: ev.raw_digits(art::InputTag{"daq"})){
+        std::vector<short> adcs(digit.Samples());
+        raw::Uncompress(digit.ADCs(), adcs, digit.Compression());
+        ret[digit.Channel()]=adcs;
+    }
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc!=3 || (std::string(argv[1])!="waveforms" && std::string(argv[1])!="photon")){
+        std::cerr << "Usage: " << argv[0] << " waveforms|photon /path/to/extractor" << std::endl;
+        return 1;
+    }
+    const std::string kind=argv[1];
+    const std::string input=(kind=="photon") ?
+        "synthetic:events=2,opdets=8,opticks=200,photons=3" :
+        "synthetic:events=2,channels=64,ticks=100,compress=huffman";
+    const SyntheticConfig config=parse_synthetic_input(input);
+    const std::string outfile="synthetic_"+kind+".npy";
+    auto event_file=[&](int event){
+        return "synthetic_"+kind+"_evt"+std::to_string(event)+".npy";
+    };
+
+    std::string command=std::string(argv[2])+" -i "+input+" -n "+std::to_string(config.events)+
+        " -o "+outfile+" --numpy > /dev/null";
+    for(int i=0; i<config.events; ++i){
+        std::remove(event_file(config.first_event+i).c_str());
+    }
+    if(std::system(command.c_str())!=0){
+        std::cerr << "Failed to run " << command << std::endl;
+        return 1;
+    }
+
+    int nbad=0;
+    SyntheticEventSource ev(config);
+    for(int i=0; i<config.events; ++i){
+        ev.goToEntry(i);
+        const int event=ev.eventAuxiliary().event();
+        const std::string filename=event_file(event);
+
+        WaveformsByChannel extracted;
+        WaveformBlockReader<short> reader(filename.c_str(), 1024);
+        WaveformMatrix<short> block;
+        while(reader.next(block)){
+            for(size_t j=0; j<block.nrows(); ++j){
+                if(block.events[j]!=event){
+                    std::cerr << filename << " has event number " << block.events[j] << std::endl;
+                    ++nbad;
+                }
+                extracted[block.channels[j]].assign(block.row(j), block.row(j)+block.nsamples);
+            }
+        }
+
+        const WaveformsByChannel expected=expected_waveforms(ev, kind);
+        if(extracted.size()!=expected.size()){
+            std::cerr << filename << " has " << extracted.size() << " channels, not " << expected.size() << std::endl;
+            ++nbad;
+        }
+        for(auto const& channel: expected){
+            if(channel.second.empty()){
+                std::cerr << "Channel " << channel.first << " of the synthetic event " << event << " has no samples" << std::endl;
+                ++nbad;
+            }
+            auto it=extracted.find(channel.first);
+            if(it==extracted.end() || it->second!=channel.second){
+                std::cerr << "Channel " << channel.first << " of " << filename << " doesn't match the synthetic event" << std::endl;
+                ++nbad;
+            }
+        }
+    }
+
+    if(nbad!=0){
+        std::cerr << nbad << " problems with the extracted synthetic events" << std::endl;
+        return 1;
+    }
+    std::cout << "Extracted " << config.events << " synthetic events correctly" << std::endl;
+    return 0;
+}
@@ -0,0 +1,97 @@
+// Checks lowpass_fir_taps() against taps from scipy.signal.firwin, and
+// FirFilter against a plain convolution, including at the ends of the
+// rows and with a number of rows that isn't a multiple of the lanes
+
+#include "../fir_filter.h"
+#include "check.h"
+
+#include <random>
+#include <vector>
+
+// Tick `i` of `row`, which has `n` ticks, filtered with `taps` the
+// slow way, with the ticks off either end taken to be the end ticks
+double convolve(const float* row, size_t n, std::vector<float> const& taps, long i)
+{
+    const long delay=(taps.size()-1)/2;
+    double ret=0;
+    for(size_t k=0; k<taps.size(); ++k){
+        const long tick=std::min(std::max(i+delay-(long)k, 0L), (long)n-1);
+        ret+=taps[k]*row[tick];
+    }
+    return ret;
+}
+
+bool taps_close_to(std::vector<float> const& taps, std::vector<double> const& expected)
+{
+    if(taps.size()!=expected.size()) return false;
+    for(size_t k=0; k<taps.size(); ++k){
+        if(!close_to(taps[k], expected[k], 1e-7)) return false;
+    }
+    return true;
+}
+
+int main()
+{
+    // scipy.signal.firwin(3, 0.1), (5, 0.5) and (4, 0.2)
+    CHECK(taps_close_to(lowpass_fir_taps(3, 0.1), {0.06799017, 0.86401967, 0.06799017}));
+    CHECK(taps_close_to(lowpass_fir_taps(5, 0.5), {0, 0.20371237, 0.59257526, 0.20371237, 0}));
+    CHECK(taps_close_to(lowpass_fir_taps(4, 0.2), {0.04156529, 0.45843471, 0.45843471, 0.04156529}));
+    CHECK(taps_close_to(lowpass_fir_taps(1, 0.3), {1}));
+
+    // More rows than one group of lanes, but not a whole number of
+    // them, and more ticks than one tile, but not a whole number of
+    // them. Both odd and even numbers of taps, since those have
+    // different delays
+    const size_t nrows=FirFilter::lanes+3;
+    const size_t nsamples=FirFilter::tile_ticks+45;
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> noise(-50, 50);
+    for(size_t ntaps: {1, 8, 21}){
+        const std::vector<float> taps=lowpass_fir_taps(ntaps, 0.2);
+        WaveformMatrix<float> m(nsamples);
+        m.resize(nrows);
+        for(size_t i=0; i<nrows; ++i){
+            // A step, so that the ends of the row differ
+            for(size_t t=0; t<nsamples; ++t) m.row(i)[t]=(t<nsamples/2 ? 100 : 300)+10*i+noise(gen);
+        }
+        WaveformMatrix<float> filtered=m;
+        ThreadPool pool(3);
+        fir_filter(filtered, taps, pool);
+        bool same=true;
+        for(size_t i=0; i<nrows; ++i){
+            for(size_t t=0; t<nsamples; ++t){
+                same=same && close_to(filtered.row(i)[t], convolve(m.row(i), nsamples, taps, t), 1e-3);
+            }
+        }
+        CHECK(same);
+
+        // Integer rows are rounded, and clamped to the range of the type
+        WaveformMatrix<short> shorts(nsamples);
+        shorts.resize(nrows);
+        for(size_t i=0; i<nrows*nsamples; ++i) shorts.samples[i]=std::lround(m.samples[i]);
+        shorts.row(nrows-1)[0]=32767;
+        shorts.row(nrows-1)[1]=32767;
+        std::vector<float> as_float(shorts.samples.begin(), shorts.samples.end());
+        fir_filter(shorts, std::vector<float>(taps.size(), 1.f), pool);
+        same=true;
+        for(size_t i=0; i<nrows; ++i){
+            for(size_t t=0; t<nsamples; ++t){
+                const double expected=convolve(as_float.data()+i*nsamples, nsamples, std::vector<float>(taps.size(), 1.f), t);
+                same=same && shorts.row(i)[t]==std::lround(std::min(expected, 32767.0));
+            }
+        }
+        CHECK(same);
+    }
+
+    // A constant row stays constant, right up to its ends, with taps
+    // of unit gain
+    std::vector<float> flat(10, 7);
+    float* rows[1]={flat.data()};
+    FirFilter filter(lowpass_fir_taps(9, 0.3));
+    filter.filter_rows(rows, 1, flat.size());
+    bool constant=true;
+    for(float x: flat) constant=constant && close_to(x, 7, 1e-4);
+    CHECK(constant);
+
+    return check_result();
+}
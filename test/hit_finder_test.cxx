@@ -0,0 +1,65 @@
+// Checks find_hits() on a made-up row, with hits inside a block, across
+// a block boundary, ending on one, and in the partial last block
+
+#include "../hit_finder.h"
+#include "check.h"
+
+#include <vector>
+
+int main()
+{
+    static_assert(hit_finder_block_ticks==32, "The hits below are placed for 32-tick blocks");
+    const short baseline=10;
+    const int threshold=5;
+    // Three full blocks and a partial one of 4 ticks
+    std::vector<short> row(100, baseline);
+    auto add=[&](size_t first, std::vector<short> const& adcs){
+        for(size_t i=0; i<adcs.size(); ++i) row[first+i]+=adcs[i];
+    };
+    add(5, {10, 20, 10});
+    // Below threshold, and negative, so not hits
+    add(20, {4});
+    add(40, {-50});
+    // Across the boundary between the first and second blocks
+    add(30, {6, 6, 6, 6, 6});
+    // Ending with the second block, the rest of the third being quiet
+    add(62, {7, 7});
+    // In the partial last block, running to the end of the row
+    add(97, {8, 8, 8});
+
+    std::vector<WaveformHit> hits;
+    find_hits(row.data(), row.size(), baseline, threshold, hits);
+    CHECK(hits.size()==4);
+    if(hits.size()!=4) return check_result();
+
+    CHECK(hits[0].start_tick==5 && hits[0].end_tick==8);
+    CHECK(hits[0].summed_adc==40);
+    // Mean tick 1 from the start, so variance (0*10+1*20+4*10)/40-1
+    CHECK(close_to(hits[0].rms, std::sqrt(0.5)));
+
+    CHECK(hits[1].start_tick==30 && hits[1].end_tick==35);
+    CHECK(hits[1].summed_adc==30);
+    CHECK(close_to(hits[1].rms, std::sqrt(2.0)));
+
+    CHECK(hits[2].start_tick==62 && hits[2].end_tick==64);
+    CHECK(hits[2].summed_adc==14);
+    CHECK(close_to(hits[2].rms, 0.5));
+
+    CHECK(hits[3].start_tick==97 && hits[3].end_tick==100);
+    CHECK(hits[3].summed_adc==24);
+    CHECK(close_to(hits[3].rms, std::sqrt(2.0/3)));
+
+    // A quiet row has no hits, and the hits are appended to what's there
+    std::vector<short> quiet(70, baseline);
+    find_hits(quiet.data(), quiet.size(), baseline, threshold, hits);
+    CHECK(hits.size()==4);
+
+    // The rows in extract_larsoft_hits' layout
+    std::vector<std::vector<WaveformHit> > row_hits{hits, {}, {hits[1]}};
+    WaveformMatrix<int> rows=hit_rows(row_hits, {1600, 1601, 1602});
+    CHECK(rows.nrows()==5 && rows.nsamples==4 && rows.events.empty());
+    CHECK(rows.channels==std::vector<int>({1600, 1600, 1600, 1600, 1602}));
+    CHECK(rows.row(4)[0]==30 && rows.row(4)[1]==35 && rows.row(4)[2]==30 && rows.row(4)[3]==1);
+
+    return check_result();
+}
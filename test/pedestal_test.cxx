@@ -0,0 +1,57 @@
+// Checks PedestalFinder::median() against sorting, including the
+// fallback to sorting for values outside the 12-bit range
+
+#include "../pedestal.h"
+#include "check.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+// The lower of the middle values of `adcs`, by sorting
+short sorted_median(std::vector<short> adcs)
+{
+    std::sort(adcs.begin(), adcs.end());
+    return adcs[(adcs.size()-1)/2];
+}
+
+int main()
+{
+    PedestalFinder finder;
+    auto median=[&](std::vector<short> const& adcs){ return finder.median(adcs.data(), adcs.size()); };
+
+    CHECK(finder.median(nullptr, 0)==0);
+    CHECK(median({7})==7);
+    // Odd and even numbers of values. For even n, the lower middle value
+    CHECK(median({5, 1, 3})==3);
+    CHECK(median({4, 1, 3, 2})==2);
+    CHECK(median({7, 7, 7, 1})==7);
+    CHECK(median({0, 4095})==0);
+
+    // Out of range values fall back to sorting, whether they come first
+    // or after some of the histogram has been filled
+    CHECK(median({-5, 10, 3})==3);
+    CHECK(median({1, 2, 3, 5000})==2);
+    CHECK(median({2, 2, 2, 2, 2, -1})==2);
+    // ... and the bins filled before the fallback don't leak into the
+    // next call
+    CHECK(median({1, 3, 5, 7, 9})==5);
+
+    // Waveform-like rows, all in range and partly out of range
+    std::mt19937 gen(1);
+    std::normal_distribution<double> noise(900, 30);
+    for(size_t n: {6000, 5999}){
+        std::vector<short> adcs(n);
+        for(short& adc: adcs) adc=noise(gen);
+        CHECK(median(adcs)==sorted_median(adcs));
+        adcs[n/2]=-200;
+        adcs[n/3]=4200;
+        CHECK(median(adcs)==sorted_median(adcs));
+    }
+
+    std::vector<short> adcs{900, 905, 895};
+    subtract_pedestal(adcs.data(), adcs.size(), 900);
+    CHECK(adcs==std::vector<short>({0, 5, -5}));
+
+    return check_result();
+}
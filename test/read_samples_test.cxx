@@ -1,30 +1,162 @@
+// Checks the readers in read_samples.h on files written by output.h and
+// container.h, in each of the layouts that the extractors write. The
+// files are made up here, in the current directory, and removed at the
+// end
+
+#include "../output.h"
 #include "../read_samples.h"
-#include <iostream>
-#include <iomanip>
+#include "check.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
 
-void print_some(Waveforms<short>& w)
+// A made-up event of `nrows` channels from `first_channel` up, with
+// `nsamples` ticks. The rows aren't in channel order, and the samples
+// use more than 8 bits, and both signs
+WaveformMatrix<short> make_event(int event, int first_channel, size_t nrows, size_t nsamples)
 {
-    std::cout << "channel #s: ";
-    for(int i=0; i<10; ++i){
-        std::cout << w.channels[i] << " ";
+    WaveformMatrix<short> m(nsamples);
+    m.resize(nrows);
+    for(size_t i=0; i<nrows; ++i){
+        m.events[i]=event;
+        m.channels[i]=first_channel+(i*7)%nrows;
+        for(size_t t=0; t<nsamples; ++t) m.row(i)[t]=int((i*7919+t*31)%4096)-2048;
     }
-    std::cout << std::endl;
+    return m;
+}
+
+// Are `w` the rows of `m`, in the same order, with the channel numbers
+// modified the way the readers do it?
+bool same_rows(Waveforms<short> const& w, WaveformMatrix<short> const& m)
+{
+    if(w.channels.size()!=m.nrows() || w.samples.size()!=m.nrows()) return false;
+    for(size_t i=0; i<m.nrows(); ++i){
+        if(w.channels[i]!=modified_channel(m.events[i], m.channels[i])) return false;
+        if(w.samples[i]!=std::vector<short>(m.row(i), m.row(i)+m.nsamples)) return false;
+    }
+    return true;
+}
 
-    for(int i=0; i<10; ++i){
-        for(int j=0; j<10; ++j){
-            std::cout << std::setw(7) << w.samples[i][j] << " ";
+// The rows of `m` whose channels are in `mask`, in channel order
+WaveformMatrix<short> rows_in_mask(WaveformMatrix<short> const& m, ChannelMask const& mask)
+{
+    WaveformMatrix<short> ret(m.nsamples);
+    for(int channel=0; channel<=*std::max_element(m.channels.begin(), m.channels.end()); ++channel){
+        if(!mask.contains(channel)) continue;
+        for(size_t i=0; i<m.nrows(); ++i){
+            if(m.channels[i]!=channel) continue;
+            std::copy(m.row(i), m.row(i)+m.nsamples, ret.add_row(m.events[i], channel));
         }
-        std::cout << std::endl;
     }
-    std::cout << std::endl;
+    return ret;
+}
+
+bool same_matrix(WaveformMatrix<short> const& a, WaveformMatrix<short> const& b)
+{
+    return a.nsamples==b.nsamples && a.events==b.events && a.channels==b.channels && a.samples==b.samples;
 }
 
 int main()
 {
-    Waveforms<short> samples_text=read_samples_text<short>("deleteme", 0);
-    std::cout << "From text file: " << std::endl;
-    print_some(samples_text);
-    Waveforms<short> samples_npy=read_samples_npy<short>("deleteme.npy", 0);
-    std::cout << "From numpy file: " << std::endl;
-    print_some(samples_npy);
+    const std::vector<std::string> files{"read_samples_test.txt", "read_samples_test.npy",
+                                         "read_samples_test_split.npz", "read_samples_test_big.npz",
+                                         "read_samples_test.wfc"};
+    for(auto const& f: files) std::remove(f.c_str());
+    std::remove(channel_index_filename(files[1]).c_str());
+
+    const WaveformMatrix<short> m=make_event(100, 1600, 10, 50);
+
+    // Text
+    save_to_file(files[0], m, Format::Text, false);
+    CHECK(same_rows(read_samples_text<short>(files[0].c_str(), 0), m));
+
+    // Numpy, with the event and channel numbers and the samples all
+    // widened to int in each row
+    save_to_file_as<int>(files[1], m, Format::Numpy, false);
+    CHECK(same_rows(read_samples_npy<short>(files[1].c_str(), 0), m));
+    CHECK(read_samples_npy<short>(files[1].c_str(), 4).channels.size()==4);
+    WaveformView<int> view=read_samples_mmap<int>(files[1].c_str(), 0);
+    CHECK(view.nrows==m.nrows() && view.row(3).channel==modified_channel(100, m.channels[3]) &&
+          std::equal(m.row(3), m.row(3)+m.nsamples, view.row(3).samples));
+
+    // Split, with the samples as int16 in an array of their own
+    save_to_file(files[2], m, Format::NumpySplit, false);
+    CHECK(cnpy::NpzFile(files[2]).info("samples").word_size==sizeof(short));
+    CHECK(same_rows(read_samples_npy<short>(files[2].c_str(), 0), m));
+
+    // Blocks that don't divide the number of rows, and that get cut
+    // short by the maximum number of channels
+    for(unsigned int max_channels: {0, 6}){
+        WaveformBlockReader<short> reader(files[1].c_str(), 4, max_channels);
+        WaveformMatrix<short> block;
+        WaveformMatrix<short> all(m.nsamples);
+        std::vector<size_t> sizes;
+        while(reader.next(block)){
+            sizes.push_back(block.nrows());
+            all.events.insert(all.events.end(), block.events.begin(), block.events.end());
+            all.channels.insert(all.channels.end(), block.channels.begin(), block.channels.end());
+            all.samples.insert(all.samples.end(), block.samples.begin(), block.samples.end());
+        }
+        const size_t nrows=max_channels ? max_channels : m.nrows();
+        CHECK(sizes==(max_channels ? std::vector<size_t>({4, 2}) : std::vector<size_t>({4, 4, 2})));
+        CHECK(all.samples.size()==nrows*m.nsamples &&
+              std::equal(all.samples.begin(), all.samples.end(), m.samples.begin()) &&
+              std::equal(all.channels.begin(), all.channels.end(), m.channels.begin()));
+    }
+
+    // Some of the channels, in channel order, from the numpy file with
+    // and without a channel index, and from the split file
+    ChannelMask mask;
+    mask.add_range(1602, 1607);
+    mask.add(1609);
+    const WaveformMatrix<short> selected=rows_in_mask(m, mask);
+    CHECK(selected.nrows()==6);
+    CHECK(same_matrix(read_samples_channels<short>(files[1].c_str(), mask), selected));
+    save_channel_index(channel_index_filename(files[1]), make_channel_index(m.channels));
+    CHECK(same_matrix(read_samples_channels<short>(files[1].c_str(), mask), selected));
+    CHECK(same_matrix(read_samples_channels<short>(files[2].c_str(), mask), selected));
+
+    // A deflated split file with samples big enough to be deflated in
+    // several pieces, on several threads
+    const WaveformMatrix<short> big=make_event(101, 0, 600, 2000);
+    save_to_file(files[3], big, Format::NumpySplit, false, 1, 3);
+    cnpy::NpzFile npz(files[3]);
+    cnpy::NpzFile::Member const& member=npz.member("samples");
+    const size_t nbytes=big.samples.size()*sizeof(short);
+    CHECK(member.compr_method==8 && member.compr_bytes<nbytes);
+    // The header, and then the data
+    CHECK(member.piece_compr_bytes.size()>=3);
+    CHECK(same_rows(read_samples_npy<short>(files[3].c_str(), 0), big));
+
+    // Ranges starting partway into a piece: one within it, and one
+    // running on into the next
+    const char* raw=reinterpret_cast<const char*>(big.samples.data());
+    for(size_t offset: {member.piece_bytes+1234, member.piece_bytes-100}){
+        std::vector<char> dst(4000);
+        npz.read_data("samples", offset, dst.size(), dst.data());
+        CHECK(std::equal(dst.begin(), dst.end(), raw+offset));
+    }
+    // Rows from all over the samples, so from all of the pieces
+    ChannelMask bigMask;
+    bigMask.add_range(250, 300);
+    CHECK(same_matrix(read_samples_channels<short>(files[3].c_str(), bigMask), rows_in_mask(big, bigMask)));
+
+    // A container, added to after it was closed
+    {
+        ContainerWriter writer(files[4], false);
+        writer.write_event(100, 7, m);
+    }
+    const WaveformMatrix<short> second=make_event(101, 3200, 6, 50);
+    {
+        ContainerWriter writer(files[4], true);
+        writer.write_event(101, 8, second);
+    }
+    CHECK(ContainerReader(files[4]).index().size()==2);
+    CHECK(same_rows(read_samples_container<short>(files[4].c_str(), 100, 0), m));
+    CHECK(same_rows(read_samples_container<short>(files[4].c_str(), 101, 0), second));
+
+    for(auto const& f: files) std::remove(f.c_str());
+    std::remove(channel_index_filename(files[1]).c_str());
+    return check_result();
 }
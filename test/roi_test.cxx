@@ -0,0 +1,73 @@
+// Checks find_rois() on a made-up row, and that zero-suppressing rows
+// and densifying them again gives back the rows
+
+#include "../roi.h"
+#include "check.h"
+
+#include <utility>
+#include <vector>
+
+typedef std::vector<std::pair<int, int> > Rois;
+
+int main()
+{
+    const short baseline=100;
+    const int threshold=10;
+    const int pre=2;
+    const int post=3;
+    std::vector<short> row(50, baseline);
+    // At the start, so the pre-padding is cut short
+    row[0]=120;
+    // Close enough for their padding to overlap, so merged, with a
+    // tick below threshold in between that's kept as it is
+    row[10]=115;
+    row[12]=105;
+    row[15]=130;
+    // Far enough apart that their padding just meets, so kept apart
+    row[25]=111;
+    row[31]=111;
+    // Signals below the baseline count too
+    row[40]=80;
+    // At the end, so the post-padding is cut short
+    row[49]=140;
+
+    Rois rois;
+    find_rois(row.data(), row.size(), baseline, threshold, pre, post, rois);
+    CHECK(rois==Rois({{0, 4}, {8, 19}, {23, 29}, {29, 35}, {38, 44}, {47, 50}}));
+
+    // A quiet row has no ROIs, and they're appended to what's there
+    std::vector<short> quiet(50, baseline+threshold-1);
+    find_rois(quiet.data(), quiet.size(), baseline, threshold, pre, post, rois);
+    CHECK(rois.size()==6);
+
+    // Zero-suppress three rows, one of them quiet, with their own
+    // baselines. Every tick away from a signal is at the baseline, so
+    // densifying gives back exactly the same rows
+    WaveformMatrix<short> m(row.size());
+    m.resize(3);
+    std::copy(row.begin(), row.end(), m.row(0));
+    std::fill(m.row(1), m.row(2), 900);
+    for(size_t i=0; i<row.size(); ++i) m.row(2)[i]=row[i]-baseline+500;
+    m.events={7, 7, 7};
+    m.channels={1600, 1601, 1602};
+    ThreadPool pool(2);
+    SparseWaveforms s=zero_suppress(m, {baseline, 900, 500}, threshold, pre, post, pool);
+
+    CHECK(s.nsamples==row.size() && s.nrows()==3);
+    CHECK(s.nrois()==12);
+    CHECK(s.roi_offsets==std::vector<int64_t>({0, 6, 6, 12}));
+    CHECK(s.values.size()==2*(4+11+6+6+6+3));
+    CHECK(s.channels==m.channels && s.events==m.events);
+
+    WaveformMatrix<short> dense=densify<short>(s);
+    CHECK(dense.nsamples==m.nsamples);
+    CHECK(dense.samples==m.samples);
+    CHECK(dense.channels==m.channels && dense.events==m.events);
+
+    // Densifying a single row into a wider type
+    std::vector<int> wide(s.nsamples);
+    densify_row(s, 2, wide.data());
+    CHECK(std::equal(wide.begin(), wide.end(), m.row(2)));
+
+    return check_result();
+}
@@ -0,0 +1,142 @@
+#ifndef TEXT_WRITER_H
+#define TEXT_WRITER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "waveform_matrix.h"
+
+// Write the text form of `value` at `p`, which must have room for it,
+// and return the end of what was written. The text is the same as
+// `std::ostream <<` would produce with the default settings, ie
+// printf("%g") for floating point values
+template<class T>
+char* format_text_value(char* p, char* end, T value)
+{
+    std::to_chars_result res;
+    if constexpr(std::is_floating_point<T>::value){
+        res=std::to_chars(p, end, value, std::chars_format::general, 6);
+    }
+    else{
+        res=std::to_chars(p, end, value);
+    }
+    return res.ptr;
+}
+
+// Writes rows of numbers to a text file. Rows are formatted with
+// std::to_chars into large buffers, which are reused from one block of
+// rows to the next and written to the file with one write() each,
+// rather than going through an ostream value by value
+class TextWriter
+{
+public:
+    // Open `filename`, replacing any existing file unless `append` is
+    // true, in which case rows are added to the end of it. Rows are
+    // formatted on `nthreads` threads
+    TextWriter(std::string const& filename, bool append, unsigned int nthreads=1)
+        : m_filename(filename), m_pool(nthreads), m_buffers(m_pool.size()), m_used(m_pool.size())
+    {
+        m_fd=open(filename.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+        if(m_fd<0){
+            throw std::runtime_error("Unable to open "+filename+": "+strerror(errno));
+        }
+    }
+
+    ~TextWriter()
+    {
+        close(m_fd);
+    }
+
+    TextWriter(TextWriter const&) = delete;
+    TextWriter& operator=(TextWriter const&) = delete;
+
+    // Write a line for each row of `m` (or for rows [first, last) if
+    // they're given), with the values converted to type U and each
+    // followed by a space: the event number, then the channel number,
+    // then the samples. The metadata columns are omitted if they're
+    // empty in `m`
+    template<class U, class T>
+    void write_rows(WaveformMatrix<T> const& m, size_t first=0, size_t last=SIZE_MAX)
+    {
+        const bool with_events=!m.events.empty();
+        const bool with_channels=!m.channels.empty();
+        last=std::min(last, m.nrows());
+        const size_t nrows=last>first ? last-first : 0;
+        const size_t ncols=(with_events ? 1 : 0)+(with_channels ? 1 : 0)+m.nsamples;
+        // Enough for any value of any type we write, and its space
+        const size_t max_value_chars=32;
+        const size_t max_row_chars=ncols*max_value_chars+1;
+        // About a megabyte of text per block, but at least one row
+        const size_t rows_per_block=std::max<size_t>(1, (1<<20)/max_row_chars);
+        const size_t nblocks=(nrows+rows_per_block-1)/rows_per_block;
+
+        // Format as many blocks as there are threads at once, and
+        // then write them out in order
+        for(size_t first_block=0; first_block<nblocks; first_block+=m_buffers.size()){
+            const size_t nbatch=std::min(m_buffers.size(), nblocks-first_block);
+            m_pool.parallel_for(nbatch, [&](size_t ibatch, unsigned int){
+                const size_t begin=first+(first_block+ibatch)*rows_per_block;
+                const size_t end=std::min(begin+rows_per_block, last);
+                // Only grow the buffer, so that it isn't cleared
+                // again for every block
+                std::vector<char>& buffer=m_buffers[ibatch];
+                buffer.resize(std::max(buffer.size(), (end-begin)*max_row_chars));
+                char* p=buffer.data();
+                char* pend=p+buffer.size();
+                for(size_t i=begin; i<end; ++i){
+                    // The metadata are converted to U first so that
+                    // they print the same way as they would in a row of U
+                    if(with_events){ p=format_text_value(p, pend, (U)m.events[i]); *p++=' '; }
+                    if(with_channels){ p=format_text_value(p, pend, (U)m.channels[i]); *p++=' '; }
+                    const T* row=m.row(i);
+                    for(size_t j=0; j<m.nsamples; ++j){
+                        p=format_text_value(p, pend, (U)row[j]);
+                        *p++=' ';
+                    }
+                    *p++='\n';
+                }
+                m_used[ibatch]=p-buffer.data();
+            });
+            for(size_t ibatch=0; ibatch<nbatch; ++ibatch){
+                write_all(m_buffers[ibatch].data(), m_used[ibatch]);
+            }
+        }
+    }
+
+private:
+    // write() may write less than it's asked to, so keep going until
+    // it's all out
+    void write_all(const char* data, size_t n)
+    {
+        while(n>0){
+            ssize_t nwritten=write(m_fd, data, n);
+            if(nwritten<0){
+                if(errno==EINTR) continue;
+                throw std::runtime_error("Failed to write to "+m_filename+": "+strerror(errno));
+            }
+            data+=nwritten;
+            n-=nwritten;
+        }
+    }
+
+    std::string m_filename;
+    int m_fd=-1;
+    ThreadPool m_pool;
+    // One buffer for each block of rows being formatted at once
+    std::vector<std::vector<char> > m_buffers;
+    // How much of each buffer holds the current block
+    std::vector<size_t> m_used;
+};
+
+#endif // include guard
@@ -0,0 +1,74 @@
+#ifndef WAVEFORM_MATRIX_H
+#define WAVEFORM_MATRIX_H
+
+#include <cstddef>
+#include <vector>
+
+// A set of equal-length rows of samples (one row per channel, or per
+// hit, etc) stored contiguously in row-major order, so that the whole
+// thing is a single allocation that can be written out directly. The
+// event number and channel number of each row are kept in separate
+// columns alongside the samples.
+//
+// Either metadata column may be left empty if it doesn't apply (eg,
+// hits don't have an event number). Otherwise it has one entry per row
+template<class T>
+struct WaveformMatrix
+{
+    explicit WaveformMatrix(size_t nsamples_=0)
+        : nsamples(nsamples_)
+    {}
+
+    // Number of samples in each row
+    size_t nsamples;
+    // Event number of each row
+    std::vector<int> events;
+    // Channel number of each row
+    std::vector<int> channels;
+    // The samples themselves. Row `i` is samples[i*nsamples] to
+    // samples[(i+1)*nsamples-1]
+    std::vector<T> samples;
+
+    size_t nrows() const { return nsamples==0 ? 0 : samples.size()/nsamples; }
+    bool empty() const { return samples.empty(); }
+
+    T* row(size_t i) { return samples.data()+i*nsamples; }
+    const T* row(size_t i) const { return samples.data()+i*nsamples; }
+
+    // Set the number of rows, keeping the existing ones. The metadata
+    // columns are only resized if `with_events`/`with_channels` are
+    // true, so that columns that don't apply stay empty
+    void resize(size_t nrows, bool with_events=true, bool with_channels=true)
+    {
+        if(with_events) events.resize(nrows);
+        if(with_channels) channels.resize(nrows);
+        samples.resize(nrows*nsamples);
+    }
+
+    void reserve(size_t nrows)
+    {
+        events.reserve(nrows);
+        channels.reserve(nrows);
+        samples.reserve(nrows*nsamples);
+    }
+
+    // Add a row with the given event and channel numbers, and return a
+    // pointer to its (zero-initialized) samples for the caller to fill
+    T* add_row(int event, int channel)
+    {
+        events.push_back(event);
+        channels.push_back(channel);
+        samples.resize(samples.size()+nsamples);
+        return row(nrows()-1);
+    }
+
+    // Add a row with no event number
+    T* add_row(int channel)
+    {
+        channels.push_back(channel);
+        samples.resize(samples.size()+nsamples);
+        return row(nrows()-1);
+    }
+};
+
+#endif // include guard